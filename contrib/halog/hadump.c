@@ -0,0 +1,194 @@
+/*
+ * haproxy binary log files decoder
+ *
+ * Dumps the lines stored by the "file@" log targets as the text a syslog
+ * daemon would have written, so that they can be piped to halog :
+ *
+ *     hadump /var/log/haproxy/access.* | halog -st
+ *
+ * The files are ordered by their rotation sequence number, so those of the
+ * same process come out in chronological order.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <types/log.h>
+
+struct file {
+	const char *name;
+	const struct logfile_hdr *hdr;
+	size_t size;			/* size of the mapping */
+};
+
+static const char *monthname[12] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static int show_usec = 0;
+static int show_pri = 0;
+
+void usage(FILE *output, const char *msg)
+{
+	fprintf(output,
+		"%s"
+		"Usage: hadump [-u] [-p] <file>...\n"
+		"  -u  print the microseconds after the time\n"
+		"  -p  print the syslog priority before the date\n"
+		"\n",
+		msg ? msg : "");
+}
+
+void die(const char *msg)
+{
+	fprintf(stderr, "%s", msg);
+	exit(1);
+}
+
+/* orders the files by rotation sequence number */
+static int cmp_files(const void *a, const void *b)
+{
+	const struct file *fa = a, *fb = b;
+
+	if (fa->hdr->seq != fb->hdr->seq)
+		return fa->hdr->seq < fb->hdr->seq ? -1 : 1;
+	return fa->hdr->pid < fb->hdr->pid ? -1 : fa->hdr->pid > fb->hdr->pid;
+}
+
+/* Maps file <name> into <f>. Returns 0 on success, or -1 if it cannot be read
+ * or does not contain a valid header, in which case it is reported.
+ */
+static int map_file(const char *name, struct file *f)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	if (st.st_size < LOG_FILE_HDR_SIZE) {
+		fprintf(stderr, "%s: file too short, skipping\n", name);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	f->name = name;
+	f->hdr = map;
+	f->size = st.st_size;
+
+	/* files which were never used or are being reset are silently ignored */
+	if (memcmp(f->hdr->magic, LOG_FILE_MAGIC, sizeof(f->hdr->magic)) != 0) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+	return 0;
+}
+
+/* Prints all the complete records of file <f> to stdout */
+static void dump_file(const struct file *f)
+{
+	const struct logfile_hdr *hdr = f->hdr;
+	const struct logfile_rec *rec;
+	uint64_t ofs, end;
+	struct tm tm;
+	time_t sec;
+
+	/* the file may be written to while we read it */
+	end = hdr->used;
+	if (end > f->size)
+		end = f->size;
+
+	for (ofs = hdr->hdr_size; ofs + sizeof(*rec) <= end; ) {
+		rec = (const struct logfile_rec *)((const char *)hdr + ofs);
+		if (ofs + sizeof(*rec) + rec->len > end) {
+			fprintf(stderr, "%s: truncated record at offset %llu\n",
+				f->name, (unsigned long long)ofs);
+			break;
+		}
+
+		sec = rec->sec;
+		localtime_r(&sec, &tm);
+		if (show_pri)
+			printf("<%d>", rec->pri);
+		printf("%s %2d %02d:%02d:%02d",
+		       monthname[tm.tm_mon], tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+		if (show_usec)
+			printf(".%06u", rec->usec);
+		printf(" %s %s[%u]: %.*s\n",
+		       hdr->host[0] ? hdr->host : "localhost", hdr->tag, hdr->pid,
+		       rec->len, (const char *)(rec + 1));
+
+		ofs += (sizeof(*rec) + rec->len + 3) & ~3;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct file *files;
+	int nbfiles = 0;
+	int i;
+
+	argc--; argv++;
+	while (argc > 0 && **argv == '-') {
+		if (strcmp(*argv, "-u") == 0)
+			show_usec = 1;
+		else if (strcmp(*argv, "-p") == 0)
+			show_pri = 1;
+		else if (strcmp(*argv, "--") == 0) {
+			argc--; argv++;
+			break;
+		}
+		else {
+			usage(stderr, "unknown option\n");
+			exit(1);
+		}
+		argc--; argv++;
+	}
+
+	if (argc < 1) {
+		usage(stderr, "missing file name\n");
+		exit(1);
+	}
+
+	files = calloc(argc, sizeof(*files));
+	if (!files)
+		die("not enough memory\n");
+
+	for (i = 0; i < argc; i++)
+		if (map_file(argv[i], &files[nbfiles]) == 0)
+			nbfiles++;
+
+	qsort(files, nbfiles, sizeof(*files), cmp_files);
+
+	for (i = 0; i < nbfiles; i++)
+		dump_file(&files[i]);
+
+	return 0;
+}
@@ -1,9 +1,10 @@
 #include <hash.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <common/logging.h>
-
-unsigned int hap_cacheline_size = 32;
+#include <common/standard.h>
 
 void hap_strlow(u_char *dst, u_char *src, size_t n)
 {
@@ -15,214 +16,229 @@ void hap_strlow(u_char *dst, u_char *src, size_t n)
 	}
 }
 
+/* Returns the home slot of hash <key> in table <hash>. The hash is mixed so
+ * that keys differing only in their last characters spread over the table.
+ */
+static inline unsigned int hap_hash_slot(hash_t *hash, unsigned int key)
+{
+	return (key * 2654435761U) >> (32 - hash->bits);
+}
+
+/* Returns the element of table <hash> named <name> of <len> bytes, whose hash
+ * is <key>, or NULL if it is not there. The stored hashes are compared first
+ * so that names are only compared once they are almost certainly equal.
+ */
 hash_elt_t *hap_hash_find(hash_t *hash, unsigned int key, u_char *name, size_t len)
 {
-	unsigned int 	i;
 	hash_elt_t     *elt;
-	
-	elt = hash->buckets[key % hash->size];	
-	if (elt == NULL) {
-		return NULL;
+	unsigned int	pos, dist;
+
+	pos = hap_hash_slot(hash, key);
+	for (dist = 1; ; dist++) {
+		elt = &hash->elts[pos];
+		/* a free slot or an element closer to its home slot means
+		 * that ours would have been placed before.
+		 */
+		if (elt->dist < dist)
+			return NULL;
+		if (elt->hash == key && elt->len == len && memcmp(elt->name, name, len) == 0)
+			return elt;
+		pos = (pos + 1) & (hash->size - 1);
 	}
-	//logging(TRACE, "key size:%d;%d,%d", key % hash->size, len, elt->len);
-	//logging(TRACE, "%s\n%s", name, elt->name);
-	while (elt->value) {
-		if (len != (size_t) elt->len) {
-			goto next;		
+}
+
+/* Places element <elt> in table <hash>, which must have a free slot and not
+ * already contain it, moving the elements it passes when they are closer to
+ * their home slot. <elt> is used as a scratch area. Returns the slot where the
+ * element was placed.
+ */
+static hash_elt_t *hap_hash_place(hash_t *hash, hash_elt_t *elt)
+{
+	hash_elt_t     *slot, *ret = NULL, tmp;
+	unsigned int	pos;
+
+	pos = hap_hash_slot(hash, elt->hash);
+	for (elt->dist = 1; ; elt->dist++) {
+		slot = &hash->elts[pos];
+		if (!slot->dist) {
+			*slot = *elt;
+			return ret ? ret : slot;
 		}
-		
-		for (i = 0; i < len; i++) {
-			if (name[i] != elt->name[i]) {
-				goto next;
-			}		
+		if (slot->dist < elt->dist) {
+			tmp = *slot;
+			*slot = *elt;
+			*elt = tmp;
+			if (!ret)
+				ret = slot;
 		}
-		//logging(TRACE, "hash find:%d", elt->vlen);
-		return elt;
-	next:
-		elt++;
-		continue;
+		pos = (pos + 1) & (hash->size - 1);
 	}
-	return NULL;
 }
 
-hash_t *hap_hash_init(hash_key_t *names, int nelts)
+/* Resizes table <hash> to 1 << <bits> slots. Returns 0, or -1 if memory is
+ * missing, in which case the table is left untouched.
+ */
+static int hap_hash_resize(hash_t *hash, unsigned int bits)
 {
-	logging(TRACE, "hap_hash_init");
-	char 			*elts;
-	size_t			 len;
-	short           *test;
-	int 			 i, n, key, size, bucket_size = 4, start = nelts/bucket_size;
-	hash_elt_t		*elt, **buckets;
-	hash_t 			*hash;
-
-	test = (u_short *) malloc (HASH_MAX_SIZE * sizeof(u_short));
-
-	for (size = start; size < HASH_MAX_SIZE; size++) {
-
-		memset(test, 0, size * sizeof(u_short));
-		/*start from new size*/
-		for (n = 0; n < nelts; n++) {
-			if (names[n].key.data == NULL) {
-				continue;
-			}
-			key = names[n].key_hash % size;
+	hash_elt_t     *old = hash->elts, elt;
+	unsigned int	i, size = hash->size;
 
-			/*get every bucket real size*/
-			test[key] = (u_short) (test[key] + 1);
-			/*if the bucket real size is too large, then size++*/
-			if (test[key] > (u_short) bucket_size) {
-				goto next;
-			}
-		}
-		goto found;
-	next:
-		continue;
+	hash->elts = calloc(1U << bits, sizeof(hash_elt_t));
+	if (hash->elts == NULL) {
+		hash->elts = old;
+		return -1;
 	}
+	hash->bits = bits;
+	hash->size = 1U << bits;
 
-	return NULL;
-found:
-	logging(TRACE, "[hap_hash_init][size:%d]", size);
-
-	/*every bucket has a yayuansu*/
 	for (i = 0; i < size; i++) {
-		test[i] = sizeof(void *);
-	}
-
-	/*visit every name to cal the bucket size*/
-	for (n = 0; n < nelts; n++) {
-		if (names[n].key.data == NULL) {
-			continue;
+		if (old[i].dist) {
+			elt = old[i];
+			hap_hash_place(hash, &elt);
 		}
-		key = names[n].key_hash % size;
-		test[key] = (u_short) (test[key] + sizeof(hash_elt_t));
 	}
+	free(old);
+	logging(TRACE, "[hap_hash_resize][size:%u][count:%u]", hash->size, hash->count);
+	return 0;
+}
 
-	len = 0;
+/* Returns a new empty table sized for <nelts> elements, or NULL if memory is
+ * missing. The table grows as elements are inserted.
+ */
+hash_t *hap_hash_create(unsigned int nelts)
+{
+	hash_t 			*hash;
+	unsigned int	 bits = 0;
 
-	/*sum up all bucket size (first to align size) to len*/
-	for (i = 0; i < size; i++) {
-		if (test[i] == sizeof(void *)) {
-			continue;
-		}
-		test[i] = (u_short) (hap_align(test[i], hap_cacheline_size));
-		len += test[i];
-		//logging(TRACE, "test[i]:%d, %d", test[i], sizeof(hash_elt_t));
-	}
+	while ((1U << bits) < HASH_MIN_SIZE ||
+	       (unsigned long long)nelts * 8 > (unsigned long long)(1U << bits) * HASH_MAX_LOAD)
+		bits++;
 
-	hash = malloc(sizeof(hash));
+	hash = calloc(1, sizeof(*hash));
 	if (hash == NULL) {
-		goto error_hash;
+		return NULL;
 	}
+	hash->elts = calloc(1U << bits, sizeof(hash_elt_t));
+	if (hash->elts == NULL) {
+		free(hash);
+		return NULL;
+	}
+	hash->bits = bits;
+	hash->size = 1U << bits;
+	return hash;
+}
 
-	buckets = malloc(size * sizeof(hash_elt_t *));
-	
-	if (buckets == NULL) {
-		goto error_buckets;
+/* Inserts the element named <name> of <len> bytes, whose hash is <key>, into
+ * table <hash> with value <value> of <vlen> bytes. The name is not copied. If
+ * an element with the same name is already there, it is left untouched. The
+ * table is doubled when it gets too loaded. Returns the element holding the
+ * name, which remains valid until the next insert or delete, or NULL if
+ * memory is missing.
+ */
+hash_elt_t *hap_hash_insert(hash_t *hash, unsigned int key, u_char *name, size_t len,
+			    void *value, unsigned int vlen)
+{
+	hash_elt_t     *elt, new;
+
+	elt = hap_hash_find(hash, key, name, len);
+	if (elt) {
+		return elt;
 	}
 
-	/*malloc bucket space according to len(still need to align len)*/
-	elts = malloc(len + hap_cacheline_size);
-	memset(elts, 0, len + hap_cacheline_size);
-	if (elts == NULL) {
-		goto error_elts;
+	if ((unsigned long long)(hash->count + 1) * 8 > (unsigned long long)hash->size * HASH_MAX_LOAD &&
+	    hap_hash_resize(hash, hash->bits + 1) < 0) {
+		return NULL;
 	}
 
-	/*start from align address*/
-	//elts = hap_align_ptr(elts, hap_cacheline_size);
+	new.value = value;
+	new.vlen = vlen;
+	new.len = len;
+	new.name = name;
+	new.hash = key;
+	hash->count++;
+	return hap_hash_place(hash, &new);
+}
 
-	/*assign space to every bucket*/
-	for (i = 0; i < size; i++) {
-		if (test[i] == sizeof(void *)) {
-			continue;
-		}
-		buckets[i] = (hash_elt_t *) elts;
-		elts += test[i];
-		//logging(TRACE, "test[i]:%d", test[i]);
+/* Removes the element named <name> of <len> bytes, whose hash is <key>, from
+ * table <hash>. The following elements are shifted back so that no tombstone
+ * is needed. Returns 1 if the element was found, otherwise 0.
+ */
+int hap_hash_delete(hash_t *hash, unsigned int key, u_char *name, size_t len)
+{
+	hash_elt_t     *elt;
+	unsigned int	pos, next;
+
+	elt = hap_hash_find(hash, key, name, len);
+	if (elt == NULL) {
+		return 0;
 	}
 
-	/*stuff data*/
-	for (i = 0; i < size; i++) {
-		test[i] = 0;
+	pos = elt - hash->elts;
+	while (1) {
+		next = (pos + 1) & (hash->size - 1);
+		if (hash->elts[next].dist <= 1)
+			break;
+		hash->elts[pos] = hash->elts[next];
+		hash->elts[pos].dist--;
+		pos = next;
+	}
+	memset(&hash->elts[pos], 0, sizeof(hash_elt_t));
+	hash->count--;
+	return 1;
+}
+
+/* Returns a new table holding the <nelts> elements of <names> whose name is
+ * set, or NULL if memory is missing. Only the first of several elements with
+ * the same name is kept.
+ */
+hash_t *hap_hash_init(hash_key_t *names, int nelts)
+{
+	hash_t 			*hash;
+	int				 n;
+
+	hash = hap_hash_create(nelts);
+	if (hash == NULL) {
+		return NULL;
 	}
 
 	for (n = 0; n < nelts; n++) {
 		if (names[n].key.data == NULL) {
 			continue;
 		}
-		key = names[n].key_hash % size;
-		elt = (hash_elt_t *) ((u_char *) buckets [key] + test[key]);
-		//logging(TRACE, "test%:%d", test[key]%sizeof(hash_elt_t));
-		elt->value = names[n].value;
-		elt->len = (u_short) names[n].key.len;
-		elt->vlen = names[n].vlen;
-		//memcpy(elt->name, names[n].key.data, strlen(names[n].key.data));
-		//elt->name[names[n].key.len] = '\0';
-		elt->name = names[n].key.data;
-		//logging(TRACE, "set:%s %d\n   %s %d", names[n].key.data, names[n].key.len, 
-		//	buckets[key]->name, buckets[key]->name - (int)(buckets[key]->name + 1));
-		
-		/*update the location of next elt in bucket*/
-		test[key] = (u_short) (test[key] + sizeof(hash_elt_t));
-	}
-
-	/*stuff the end node*/
-	for (i = 0; i < size; i++) {
-		if (buckets[i] == NULL) {
-			continue;
+		if (!hap_hash_insert(hash, names[n].key_hash, names[n].key.data, names[n].key.len,
+				     names[n].value, names[n].vlen)) {
+			hap_hash_free(hash);
+			return NULL;
 		}
-		elt = (hash_elt_t *)((u_char *)buckets[i] + test[i]);
-		elt->value = NULL;
 	}
-	free(test);
-	hash->buckets = buckets;
-	hash->size = size;
-
+	logging(TRACE, "[hap_hash_init][size:%u][count:%u]", hash->size, hash->count);
 	return hash;
+}
 
-error_hash:
-	free(test);
-error_buckets:
+void hap_hash_free(hash_t *hash)
+{
+	if (hash == NULL) {
+		return;
+	}
+	free(hash->elts);
 	free(hash);
-error_elts:
-	free(buckets);
-	return NULL;
 }
 
+/* The keys are hashed with the word-at-a-time hash shared with the rest of
+ * the code.
+ */
 unsigned int hap_hash_key(u_char *data, size_t len)
 {
-	unsigned int i, key;
-
-	key = 0;
-
-	for (i = 0; i < len; i++) {
-		key = hap_hash(key, data[i]);
-	}
-	return key;
+	return hash_mem(data, len);
 }
 
 unsigned int hap_hash_key_lc(u_char *data, size_t len)
 {
-	unsigned int i, key;
-
-	key = 0;
-
-	for (i = 0; i < len; i++) {
-		key = hap_hash(key, hap_tolower(data[i]));
-	}
-	return key;
+	return hash_mem_lc(data, len);
 }
 
 unsigned int hap_hash_strlow(u_char *dst, u_char *src, size_t n)
 {
-	unsigned int key;
-
-	key = 0;
-
-	while (n--) {
-		*dst = hap_tolower(*src);
-		key = hap_hash(key, *dst);
-		dst++;
-		src++;
-	}
-	return key;
+	hap_strlow(dst, src, n);
+	return hash_mem(dst, n);
 }
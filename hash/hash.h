@@ -3,27 +3,32 @@
 #include <sys/types.h>
 
 
-#define HASH_MAX_SIZE 1000
-
-#define hap_align(d, a) (((d) + (a - 1)) & ~(a - 1))
-#define hap_align_ptr(p, a) \
-	(u_char *) (((int *) (p) + ((int *) a - 1)) & ~((int *) a - 1))
+/* minimal number of slots of a table, and maximal load in eighths of it */
+#define HASH_MIN_SIZE	16
+#define HASH_MAX_LOAD	7
 
 typedef struct {
 	size_t len;
 	u_char *data;
 } str_t;
 
+/* A slot of the table. Elements are kept by Robin Hood hashing : an element
+ * is never further from its home slot than the ones it passed on its way.
+ */
 typedef struct{
-	void 				*value;  // NULL when elt is a yayuansu in buckets
+	void 				*value;
 	unsigned int 	 	 vlen;	 // len of value
-	u_short		 	 	 len;
+	unsigned int	 	 len;
 	u_char				*name;
+	unsigned int		 hash;	 // full hash of name
+	unsigned int		 dist;	 // distance to the home slot plus one, 0 when free
 } hash_elt_t;
 
 typedef struct{
-	hash_elt_t     	   **buckets;
-	unsigned int	 	 size;
+	hash_elt_t		    *elts;	 // <size> slots
+	unsigned int	 	 size;	 // number of slots, a power of two
+	unsigned int		 bits;	 // log2(size)
+	unsigned int		 count;	 // number of elements
 } hash_t;
 
 typedef struct {
@@ -34,11 +39,20 @@ typedef struct {
 } hash_key_t;
 
 
-#define hap_hash(key, c)    ((unsigned int) key * 31 + c)
 #define hap_tolower(c)		(u_char) ((c >= 'A' && c <= 'Z') ? (c | 0x20) : c)
 #define hap_toupper(c)		(u_char) ((c >= 'a' && c <= 'z') ? (c & ~0x20) : c)
 
 
-//void hap_strlow(u_char *dst, u_char *src, size_t n);
+void hap_strlow(u_char *dst, u_char *src, size_t n);
+hash_elt_t *hap_hash_find(hash_t *hash, unsigned int key, u_char *name, size_t len);
+hash_t *hap_hash_create(unsigned int nelts);
+hash_elt_t *hap_hash_insert(hash_t *hash, unsigned int key, u_char *name, size_t len,
+			    void *value, unsigned int vlen);
+int hap_hash_delete(hash_t *hash, unsigned int key, u_char *name, size_t len);
+hash_t *hap_hash_init(hash_key_t *names, int nelts);
+void hap_hash_free(hash_t *hash);
+unsigned int hap_hash_key(u_char *data, size_t len);
+unsigned int hap_hash_key_lc(u_char *data, size_t len);
+unsigned int hap_hash_strlow(u_char *dst, u_char *src, size_t n);
 
 #endif /*_HAPROXY_HASH_H*/
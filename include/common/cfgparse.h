@@ -34,6 +34,7 @@
 #define CFG_LISTEN	2
 #define CFG_USERLIST	3
 #define CFG_PEERS	4
+#define CFG_CACHE	5
 
 struct cfg_keyword {
 	int section;                            /* section type for this keyword */
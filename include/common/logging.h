@@ -1,15 +1,54 @@
 #ifndef _COMMON_LOGGING_H
 #define _COMMON_LOGGING_H
 
+#include <common/compiler.h>
+
 enum {
 	TRACE = 0,
 	DEBUG,
 	INFO,
 	WARN,
 	ERROR,
-	FATAL
+	FATAL,
+	SILENT,		/* only used as a threshold, disables all messages */
 };
-void logtest();
-void logging(int level, const char *format, ...);
 
-#endif /*_COMMON_LOGGING_H*/
\ No newline at end of file
+/* Messages below this level are not even compiled in. It may be set with
+ * "make LOGGING_LEVEL=INFO" for instance.
+ */
+#ifndef CONFIG_HAP_LOGGING_LEVEL
+#define CONFIG_HAP_LOGGING_LEVEL TRACE
+#endif
+
+/* Messages below this level are dropped at runtime. It is set by the
+ * "logging-level" global keyword and the "set logging-level" CLI command.
+ */
+#define LOGGING_DEF_LEVEL INFO
+extern int logging_level;
+
+/* Once the process is started, messages are queued in a ring of this size
+ * shared with a drain process which writes them to the file. It is set by
+ * the "logging-ring-size" global keyword and rounded up to a power of 2.
+ */
+#define LOGGING_DEF_RING_SIZE (1024 * 1024)
+extern unsigned int logging_ring_size;
+
+/* Emits a debug message of level <level>. Both thresholds are checked before
+ * the arguments are evaluated, so that disabled calls only cost a comparison
+ * (or nothing at all when below the build threshold).
+ */
+#define logging(level, format, ...)						\
+	do {									\
+		if ((level) >= CONFIG_HAP_LOGGING_LEVEL &&			\
+		    unlikely((level) >= logging_level))				\
+			__logging((level), (format), ##__VA_ARGS__);		\
+	} while (0)
+
+void __logging(int level, const char *format, ...)
+	__attribute__ ((format(printf, 2, 3)));
+int logging_parse_level(const char *name);
+const char *logging_level_name(int level);
+void logging_open();
+int logging_start();
+
+#endif /*_COMMON_LOGGING_H*/
@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
 #include <common/syscall.h>
 
 /* On recent Linux kernels, the splice() syscall may be used for faster data copy.
@@ -65,6 +66,13 @@ extern int splice(int fdin, loff_t *off_in, int fdout, loff_t *off_out, size_t l
 static _syscall6(int, splice, int, fdin, loff_t *, off_in, int, fdout, loff_t *, off_out, size_t, len, unsigned long, flags);
 #endif /* VSYSCALL */
 
+#ifndef __NR_vmsplice
+#warning unsupported architecture, guessing __NR_vmsplice=316 like x86...
+#define __NR_vmsplice           316
+#endif /* __NR_vmsplice */
+
+static _syscall4(int, vmsplice, int, fd, const struct iovec *, iov, unsigned long, nr_segs, unsigned int, flags);
+
 #else
 /* use the system's definition */
 #include <fcntl.h>
@@ -122,6 +122,23 @@ char *lltoa(long long n, char *dst, size_t size);
  */
 char *utoa_pad(unsigned int n, char *dst, size_t size);
 
+/*
+ * unsigned int upper case hexadecimal ASCII representation, on at least
+ * <digits> digits
+ *
+ * return the last char '\0' or NULL if no enough
+ * space in dst
+ */
+char *uxtoa_o(unsigned int n, char *dst, size_t size, int digits);
+
+/*
+ * dotted IPv4 address ASCII representation
+ *
+ * return the last char '\0' or NULL if no enough
+ * space in dst
+ */
+char *ip4toa_o(const struct in_addr *addr, char *dst, size_t size);
+
 /* Fast macros to convert up to 10 different parameters inside a same call of
  * expression.
  */
@@ -561,6 +578,12 @@ static inline unsigned int __full_hash(unsigned int a)
 	return a * 3221225473U;
 }
 
+/* hash <len> bytes at <data> to a 32-bit integer, one word at a time */
+extern unsigned int hash_mem(const void *data, size_t len);
+
+/* same as hash_mem() but ASCII letters are hashed as if they were lower case */
+extern unsigned int hash_mem_lc(const void *data, size_t len);
+
 /* returns non-zero if addr has a valid and non-null IPv4 or IPv6 address,
  * otherwise zero.
  */
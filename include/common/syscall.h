@@ -124,6 +124,19 @@
 #endif /* $arch */
 #endif /* __NR_splice */
 
+/* vmsplice came with splice and suffers from the same libc delays. */
+#ifndef __NR_vmsplice
+#if defined(__powerpc__) || defined(__powerpc64__)
+#define __NR_vmsplice           285
+#elif defined(__sparc__) || defined(__sparc64__)
+#define __NR_vmsplice           25
+#elif defined(__x86_64__)
+#define __NR_vmsplice           278
+#elif defined (__i386__)
+#define __NR_vmsplice           316
+#endif /* $arch */
+#endif /* __NR_vmsplice */
+
 
 #endif /* __linux__ */
 #endif /* _COMMON_SYSCALL_H */
@@ -1,17 +1,55 @@
-
-
-#include <common/config.h>
-#include <common/memory.h>
-#include <types/cache.h>
-
-#include <proto/session.h>
-
-int process_cache_file(struct session *s);
-void init_cache_file();
-int process_cache_mem(struct session *s);
-int process_cache(struct session *s);
-
-
-
-
-
+/*
+ * include/proto/cache.h
+ * This file contains the static file cache function prototypes.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, version 2.1
+ * exclusively.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _PROTO_CACHE_H
+#define _PROTO_CACHE_H
+
+#include <common/config.h>
+#include <common/memory.h>
+#include <types/cache.h>
+
+#include <proto/session.h>
+
+extern struct cache cache;
+extern struct pool_head *pool2_cache_key;
+extern const struct cache_enc cache_enc[CACHE_ENC_MAX];
+extern struct si_applet cache_applet;
+
+int init_cache_file();
+void deinit_cache_file();
+int cache_start();
+int cache_reload();
+int cache_purge(const char *uri);
+int cache_load_mime_types(const char *file, char **err);
+int cache_save_snapshot();
+void cache_prepare_request(struct session *s, struct buffer *req);
+void cache_check_response(struct session *s, struct buffer *rep);
+void cache_store_start(struct session *s, struct buffer *res);
+unsigned long long cache_store_data(struct session *s, struct buffer *res, unsigned long long len);
+void cache_end_txn(struct session *s);
+int cache_process_request(struct session *s, struct buffer *req, int an_bit);
+
+#endif /* _PROTO_CACHE_H */
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ * End:
+ */
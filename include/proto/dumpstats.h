@@ -40,6 +40,7 @@
 #define STATS_TYPE_BE  1
 #define STATS_TYPE_SV  2
 #define STATS_TYPE_SO  3
+#define STATS_TYPE_CA  4
 
 /* unix stats socket states */
 #define STAT_CLI_INIT   0   /* initial state */
@@ -54,6 +55,7 @@
 #define STAT_CLI_O_ERR  7   /* dump errors */
 #define STAT_CLI_O_TAB  8   /* dump tables */
 #define STAT_CLI_O_CLR  9   /* clear tables */
+#define STAT_CLI_O_CACHE 10 /* dump cache counters */
 
 extern struct si_applet http_stats_applet;
 
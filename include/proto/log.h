@@ -40,8 +40,17 @@ extern char default_tcp_log_format[];
 extern char default_http_log_format[];
 extern char clf_http_log_format[];
 
+extern int log_batch;
+extern unsigned int log_drops;
+extern unsigned int log_file_size;
+extern int log_file_count;
 
-int build_logline(struct session *s, char *dst, size_t maxsize, struct list *list_format);
+
+int build_logline(struct session *s, char *dst, size_t maxsize, const struct logformat_prog *prog);
+
+struct logformat_prog *compile_logformat(struct list *list_format);
+
+void free_logformat_prog(struct logformat_prog *prog);
 
 /*
  * send a log for the session when we have enough info about it.
@@ -106,6 +115,17 @@ void send_log(struct proxy *p, int level, const char *format, ...)
 
 void __send_log(struct proxy *p, int level, char *message, size_t size);
 
+void log_flush();
+
+/*
+ * Returns the "file@" target for files prefixed with <path>, or NULL if there
+ * is not enough memory. log_files_init() creates and maps the files of all
+ * the targets and must be called before the chroot.
+ */
+struct logfile *log_file_get(const char *path);
+int log_files_init();
+void log_files_deinit();
+
 /*
  * returns log level for <lev> or -1 if not found.
  */
@@ -122,19 +142,19 @@ int get_log_facility(const char *fac);
  *
  * Return the adress of the \0 character, or NULL on error
  */
-char *lf_text(char *dst, char *src, size_t size, struct logformat_node *node);
+char *lf_text(char *dst, char *src, size_t size, int options);
 
 /*
  * Write a IP adress to the log string
  * +X option write in hexadecimal notation, most signifant byte on the left
  */
-char *lf_ip(char *dst, struct sockaddr *sockaddr, size_t size, struct logformat_node *node);
+char *lf_ip(char *dst, struct sockaddr *sockaddr, size_t size, int options);
 
 /*
  * Write a port to the log
  * +X option write in hexadecimal notation, most signifant byte on the left
  */
-char *lf_port(char *dst, struct sockaddr *sockaddr, size_t size, struct logformat_node *node);
+char *lf_port(char *dst, struct sockaddr *sockaddr, size_t size, int options);
 
 
 #endif /* _PROTO_LOG_H */
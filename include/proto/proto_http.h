@@ -54,6 +54,8 @@ extern struct chunk http_err_chunks[HTTP_ERR_SIZE];
 extern const char *HTTP_200;
 extern const char *HTTP_302;
 extern const char *HTTP_303;
+extern const char *HTTP_304;
+extern const char *HTTP_416;
 
 #define HTTP_IS_CTL(x)   (http_is_ctl[(unsigned char)(x)])
 #define HTTP_IS_SEP(x)   (http_is_sep[(unsigned char)(x)])
@@ -90,6 +92,8 @@ void manage_server_side_cookies(struct session *t, struct buffer *rtr);
 void check_response_for_cacheability(struct session *t, struct buffer *rtr);
 int stats_check_uri(struct stream_interface *si, struct http_txn *txn, struct proxy *backend);
 void init_proto_http();
+int http_header_match2(const char *hdr, const char *end,
+		       const char *name, int len);
 int http_find_header2(const char *name, int len,
 		      char *sol, struct hdr_idx *idx,
 		      struct hdr_ctx *ctx);
@@ -103,6 +107,8 @@ unsigned int http_get_hdr(const struct http_msg *msg, const char *hname, int hle
 			  struct hdr_idx *idx, int occ,
 			  struct hdr_ctx *ctx, char **vptr, int *vlen);
 
+void http_parse_connection_header(struct http_txn *txn, struct http_msg *msg, int to_del);
+void http_close_server_conn(struct session *s);
 void http_init_txn(struct session *s);
 void http_end_txn(struct session *s);
 void http_reset_txn(struct session *s);
@@ -32,6 +32,7 @@ extern struct pool_head *pool2_session;
 extern struct list sessions;
 
 int session_accept(struct listener *l, int cfd, struct sockaddr_storage *addr);
+int session_init_buffers(struct session *s);
 
 /* perform minimal intializations, report 0 in case of error, 1 if OK. */
 int init_session();
@@ -42,13 +43,6 @@ void session_shutdown(struct session *session, int why);
 void session_process_counters(struct session *s);
 void sess_change_server(struct session *sess, struct server *newsrv);
 
-/*haproxy-second*/
-int process_cache_file(struct session *s);
-void init_cache_file();
-int process_cache_mem(struct session *s);
-int process_cache(struct session *s);
-/*haproxy-second end*/
-
 struct task *process_session(struct task *t);
 void default_srv_error(struct session *s, struct stream_interface *si);
 int parse_track_counters(char **args, int *arg,
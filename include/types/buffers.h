@@ -144,13 +144,14 @@
 #define AN_REQ_SWITCHING_RULES  0x00000010  /* apply the switching rules */
 #define AN_REQ_INSPECT_BE       0x00000020  /* inspect request contents in the backend */
 #define AN_REQ_HTTP_PROCESS_BE  0x00000040  /* process the backend's HTTP part */
-#define AN_REQ_SRV_RULES        0x00000080  /* use-server rules */
-#define AN_REQ_HTTP_INNER       0x00000100  /* inner processing of HTTP request */
-#define AN_REQ_HTTP_TARPIT      0x00000200  /* wait for end of HTTP tarpit */
-#define AN_REQ_HTTP_BODY        0x00000400  /* inspect HTTP request body */
-#define AN_REQ_STICKING_RULES   0x00000800  /* table persistence matching */
-#define AN_REQ_PRST_RDP_COOKIE  0x00001000  /* persistence on rdp cookie */
-#define AN_REQ_HTTP_XFER_BODY   0x00002000  /* forward request body */
+#define AN_REQ_CACHE_LOOKUP     0x00000080  /* answer the request from the cache */
+#define AN_REQ_SRV_RULES        0x00000100  /* use-server rules */
+#define AN_REQ_HTTP_INNER       0x00000200  /* inner processing of HTTP request */
+#define AN_REQ_HTTP_TARPIT      0x00000400  /* wait for end of HTTP tarpit */
+#define AN_REQ_HTTP_BODY        0x00000800  /* inspect HTTP request body */
+#define AN_REQ_STICKING_RULES   0x00001000  /* table persistence matching */
+#define AN_REQ_PRST_RDP_COOKIE  0x00002000  /* persistence on rdp cookie */
+#define AN_REQ_HTTP_XFER_BODY   0x00004000  /* forward request body */
 
 /* response analysers */
 #define AN_RES_INSPECT          0x00010000  /* content inspection */
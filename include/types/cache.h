@@ -1,14 +1,388 @@
-#ifndef _TYPES_CACHE_H
-#define _TYPES_CACHE_H
-
-#define CACHE_LEN	1000
-#define SIZE_LEN	100
-#define FNAME_LEN	100
-
-struct cache {
-	char 		uri[100];
-};
-
-
-
-#endif /*_TYPES_CACHE_H*/
+/*
+ * include/types/cache.h
+ * This file defines everything related to the static file cache.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, version 2.1
+ * exclusively.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _TYPES_CACHE_H
+#define _TYPES_CACHE_H
+
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <hash.h>
+
+#include <common/config.h>
+#include <common/mini-clist.h>
+
+#include <ebmbtree.h>
+
+struct proxy;
+
+#define CACHE_LEN	1000
+#define SIZE_LEN	100
+
+#define CACHE_KEY_LEN		2048		/* max length of a cache key */
+#define CACHE_MAX_RANGES	8		/* requests with more ranges get the whole object */
+#define CACHE_MAX_SEGS		(2 * CACHE_MAX_RANGES + 3)
+#define CACHE_DEF_MAX_OBJ	(1024*1024)	/* default max-object-size */
+#define CACHE_RELOAD_DELAY	200		/* ms to wait for more changes before reloading */
+#define CACHE_WARM_FILES	64		/* max files loaded per warm-up run */
+#define CACHE_WARM_BYTES	(1024*1024)	/* max bytes loaded per warm-up run */
+#define CACHE_WARM_AHEAD	32		/* files prefetched ahead of the warm-up */
+#define CACHE_WARM_REPORT	1000		/* ms between two warm-up progress reports */
+#define CACHE_DEF_LOCK_TMOUT	5000		/* default lock-timeout, in ms */
+#define CACHE_SKETCH_ROWS	4		/* rows of the frequency sketch */
+#define CACHE_SKETCH_MIN	1024		/* min counters per row */
+#define CACHE_SKETCH_MAX	(1 << 22)	/* max counters per row */
+#define CACHE_SKETCH_MEM	4096		/* bytes of max-memory per counter */
+#define CACHE_SKETCH_AGE	10		/* increments per counter before halving them */
+#define CACHE_SHM_OBJ		(sizeof(struct cache_obj) + 2 * CACHE_LEN + 16)	/* shared memory per object, without body */
+#define CACHE_MIME_LEN		32		/* max length of a file extension in the MIME table */
+#define CACHE_DEF_MIME		"application/octet-stream"	/* type of files with an unknown extension */
+#define CACHE_DATE_LEN		96		/* room for a Date header and the end of the headers */
+#define CACHE_DEF_NEG_ENTRIES	4096		/* default negative-entries */
+
+/* Endings of the headers of a hit, indexed by cache_txn.conn */
+#define CACHE_CONN_NONE		0		/* empty line only */
+#define CACHE_CONN_CLO		1		/* Connection: close */
+#define CACHE_CONN_KAL		2		/* Connection: keep-alive */
+#define CACHE_CONN_PX_CLO	3		/* Proxy-Connection: close */
+#define CACHE_CONN_PX_KAL	4		/* Proxy-Connection: keep-alive */
+#define CACHE_CONN_MAX		5
+
+/* Content codings of the object variants, by order of preference */
+#define CACHE_ENC_BR		0
+#define CACHE_ENC_GZIP		1
+#define CACHE_ENC_MAX		2
+
+struct cache_enc {
+	const char *name;		/* content coding name */
+	const char *ext;		/* extension of the precompressed files */
+};
+
+/* cache_obj flags */
+#define CACHE_OBJ_F_MMAP	0x00000001	/* body lives in its own read-only mapping */
+#define CACHE_OBJ_F_GEN		0x00000002	/* variant encoded at load time, not read from a file */
+#define CACHE_OBJ_F_PENDING	0x00000004	/* body not read yet, the object must not be served */
+#define CACHE_OBJ_F_FAILED	0x00000008	/* the file could not be read, the object stays pending */
+#define CACHE_OBJ_F_SNAP	0x00000010	/* headers and body live in the snapshot mapping */
+#define CACHE_OBJ_F_SHM		0x00000020	/* object and body live in the shared memory area */
+#define CACHE_OBJ_F_SPLICE	0x00000040	/* body may be vmspliced, it never changes once read */
+#define CACHE_OBJ_F_DATE	0x00000080	/* headers lack a Date, the current one is added on hits */
+#define CACHE_OBJ_F_NEG		0x00000100	/* error response of the negative cache, without body */
+
+/* Negative responses, indexed by cache_neg.status */
+#define CACHE_NEG_NONE		0		/* free slot */
+#define CACHE_NEG_404		1		/* 404 Not Found */
+#define CACHE_NEG_410		2		/* 410 Gone */
+#define CACHE_NEG_MAX		3
+
+/* A cached object : the precomputed response headers and the file's contents,
+ * with the validators used to answer conditional requests.
+ * Bodies larger than a buffer are stored in their own anonymous mapping so
+ * that they can be vmspliced to the client instead of being copied.
+ * Static objects left unchanged by a reload are shared by the old and the new
+ * lookup tables, <refcnt> counting the tables which reference them. They are
+ * indexed as soon as their file is found, but remain pending until the warm-up
+ * has read their body. With several processes, the objects indexed before the
+ * fork live in a shared memory area, filled by the first process only and
+ * never released.
+ */
+struct cache_obj {
+	char *hdr;			/* response headers */
+	char *body;			/* file contents */
+	unsigned int hdr_len;
+	unsigned int body_len;
+	unsigned int flags;		/* CACHE_OBJ_F_* */
+	char *nm_hdr;			/* headers of the 304 response, or NULL */
+	unsigned int nm_len;
+	char *etag;			/* ETag value within <hdr>, or NULL */
+	int etag_len;
+	time_t mtime;			/* Last-Modified date, or -1 if unknown */
+	char *path;			/* file the object is read from, or NULL */
+	struct cache_root *root;	/* root of this file */
+	ino_t ino;			/* inode of the file the object was read from */
+	off_t size;			/* size of this file */
+	unsigned int refcnt;		/* number of lookup tables holding a static object */
+	struct cache_obj *variant[CACHE_ENC_MAX];	/* encoded variants, or NULL */
+};
+
+/* cache_entry flags */
+#define CACHE_ENT_F_DELETED	0x00000001	/* unlinked, released with its last reference */
+#define CACHE_ENT_F_REFRESH	0x00000002	/* expired, being fetched again by an internal session */
+
+/* A response received from a server and stored in the cache. The entry is
+ * indexed by its key in cache.store and chained in the LRU list. Sessions
+ * sending it hold a reference so that an entry evicted meanwhile is only
+ * released once the last of them is done with it. Once expired, it may still
+ * be served until <stale> while an internal session fetches it again.
+ */
+struct cache_entry {
+	struct list lru;		/* chaining in cache.lru, least recently used first */
+	struct cache_obj obj;		/* headers and body sent on hits */
+	unsigned int expire;		/* expiration date, in ticks */
+	unsigned int stale;		/* date until which it may be served expired, in ticks */
+	int uri;			/* offset of the URI in the key */
+	unsigned int hash;		/* hash of the key without the encodings */
+	unsigned int refcnt;		/* number of sessions sending this entry */
+	unsigned int flags;		/* CACHE_ENT_F_* */
+	unsigned int size;		/* memory accounted for this entry */
+	struct proxy *be;		/* backend which stored it, the one refreshing it */
+	struct ebmb_node node;		/* indexing in cache.store, the key follows */
+};
+
+/* A response being fetched from a server for a request which missed the cache.
+ * It is indexed by the request's key in cache.fills for as long as the
+ * transaction which fetches it may store it. Other requests with the same key
+ * missing the cache meanwhile wait in <waiters> instead of reaching a server,
+ * and are woken up once the response is stored or will not be.
+ */
+struct cache_fill {
+	struct list waiters;		/* sessions waiting for this response */
+	struct ebmb_node node;		/* indexing in cache.fills, the key follows */
+};
+
+/* A contiguous part of a response sent from the cache : headers, or a slice
+ * of an object's body which may then be spliced.
+ */
+struct cache_seg {
+	const char *ptr;		/* first byte of the segment */
+	unsigned int len;		/* length of the segment */
+	int body;			/* non-zero if it points to an object's body */
+};
+
+/* A byte range requested by a client, already checked against the body */
+struct cache_range {
+	unsigned int start;		/* first byte */
+	unsigned int len;		/* number of bytes */
+};
+
+/* cache_txn flags */
+#define CACHE_TXN_F_NOSTORE	0x00000001	/* the request forbids storing the response */
+#define CACHE_TXN_F_NOLOOKUP	0x00000002	/* the request asks for a fresh response */
+#define CACHE_TXN_F_NOT_MOD	0x00000004	/* a 304 response is being sent */
+#define CACHE_TXN_F_WAITING	0x00000008	/* waiting for another request's fill */
+#define CACHE_TXN_F_WAITED	0x00000010	/* has already waited, must not wait again */
+#define CACHE_TXN_F_COUNTED	0x00000020	/* already counted by the admission sketch */
+
+/* Per-transaction cache context. The key is made of the request's Host header
+ * followed by its URI, then by a line feed and the normalized Accept-Encoding
+ * header which is only part of the key for responses varying on it.
+ */
+struct cache_txn {
+	char *key;			/* cache key, or NULL if not applicable */
+	int uri;			/* offset of the URI in <key> */
+	int path_len;			/* length of the URI's path, without the query string */
+	int len;			/* length of the key without the Accept-Encoding part */
+	int vlen;			/* length of the whole key */
+	int inm, inm_len;		/* If-None-Match value stored after the key, or 0 */
+	time_t ims;			/* If-Modified-Since date, or 0 */
+	int range, range_len;		/* Range value stored after the key, or 0 */
+	int if_range, if_range_len;	/* If-Range value stored after the key, or 0 */
+	unsigned int flags;		/* CACHE_TXN_F_* */
+	int ttl;			/* response lifetime in seconds, 0 if it must not be stored */
+	int swr;			/* response's stale-while-revalidate in seconds, or -1 */
+	int vary;			/* the response varies on Accept-Encoding */
+	struct cache_entry *store;	/* entry being filled from the response, or NULL */
+	struct cache_fill *fill;	/* fill owned by this transaction, or NULL */
+	struct list wait;		/* chaining in the waiters of a fill when waiting */
+	struct cache_entry *refresh;	/* entry refreshed by this internal session, or NULL */
+	struct cache_root *root;	/* root of the static object found, or NULL */
+	unsigned int hdr_left;		/* response header bytes still to be skipped */
+	unsigned int body_pos;		/* response body bytes already stored */
+	char *gen;			/* headers generated for a 206 or 416 response, or NULL */
+	int conn;			/* CACHE_CONN_* ending the headers of a hit */
+	struct cache_seg segs[CACHE_MAX_SEGS];	/* parts of the response sent on a hit */
+	int nb_segs;			/* number of segments in <segs> */
+	int cur_seg;			/* segment being sent */
+	unsigned int seg_pos;		/* bytes of the current segment already sent */
+};
+
+/* A 404 or 410 response recently received for a key, in the negative cache
+ * which keeps one of them per slot. Keys are only compared by hash.
+ */
+struct cache_neg {
+	unsigned int hash;		/* hash of the key without the encodings */
+	unsigned int expire;		/* expiration date, in ticks */
+	int status;			/* CACHE_NEG_*, CACHE_NEG_NONE if the slot is free */
+};
+
+/* A MIME type of the "mime-types" file, indexed by file extension in
+ * cache.mime. The lower case extension follows.
+ */
+struct cache_mime {
+	char *type;			/* Content-Type of the files with this extension */
+	struct ebmb_node node;		/* indexing in cache.mime, the extension follows */
+};
+
+/* A cache root maps an URI prefix to a local directory. Every regular file
+ * found below this directory is loaded in memory at startup and served for
+ * the URI made of the prefix followed by the file's relative path.
+ */
+/* cache_root flags */
+#define CACHE_ROOT_F_COMPRESS	0x00000001	/* compress text files when loading them */
+#define CACHE_ROOT_F_MAX_AGE	0x00000002	/* files are sent with a Cache-Control max-age */
+
+struct cache_root {
+	struct list list;		/* chaining in cache.roots */
+	unsigned int flags;		/* CACHE_ROOT_F_* */
+	char *prefix;			/* URI prefix, always ends with '/' */
+	int prefix_len;
+	char *dir;			/* local directory, without trailing '/' */
+	int dir_fd;			/* <dir> opened before the chroot, or -1 */
+	unsigned int max_size;		/* max bytes loaded from this root, 0 = unlimited */
+	unsigned int max_file;		/* larger files are not loaded, 0 = unlimited */
+	unsigned int max_age;		/* Cache-Control max-age of the files, in seconds */
+	unsigned long long size;	/* bytes loaded from this root */
+	unsigned int files;		/* number of files loaded from this root */
+	unsigned int load_time;		/* time spent indexing it by the last load, in ms */
+	unsigned long long hits;	/* requests answered from this root */
+	unsigned long long misses;	/* requests below the prefix left to the servers */
+	unsigned long long bytes_out;	/* bytes of the responses sent from this root */
+	struct {
+		const char *file;	/* file where the root is declared */
+		int line;		/* line where the root is declared */
+	} conf;
+};
+
+/* A lookup table built from all the files found below the roots. A reload
+ * builds a new table next to the current one and swaps them. Sessions sending
+ * a static object hold a reference on its table so that a replaced table is
+ * only released once the last of them is done with it.
+ */
+struct cache_table {
+	hash_key_t *keys;		/* one entry per loaded file, value is a cache_obj */
+	int nb_keys;			/* number of entries used in <keys> */
+	int max_keys;			/* number of entries allocated in <keys> */
+	hash_t *hash;			/* lookup table built from <keys>, or NULL if empty */
+	int reused;			/* number of objects shared with the previous table */
+	unsigned int refcnt;		/* the cache's reference plus one per session */
+};
+
+/* Snapshot file : a header followed by an array of records, one per static
+ * object, then by their URI, path and headers, then by their bodies, each
+ * aligned on CACHE_SNAP_ALIGN so that they can be spliced from the mapping.
+ * The variants of an object immediately follow its record. Offsets are
+ * relative to the beginning of the file.
+ */
+#define CACHE_SNAP_MAGIC	"HAPCSNP3"
+#define CACHE_SNAP_ALIGN	4096
+
+struct cache_snap_hdr {
+	char magic[8];			/* CACHE_SNAP_MAGIC */
+	unsigned int rec_size;		/* sizeof(struct cache_snap_rec) */
+	unsigned int nb_recs;		/* number of records */
+	unsigned long long size;	/* size of the whole file */
+};
+
+struct cache_snap_rec {
+	unsigned long long data;	/* offset of the URI, path, headers and 304 headers */
+	unsigned long long body;	/* offset of the body */
+	unsigned long long ino;		/* validators of the file, see cache_obj */
+	long long size;
+	long long mtime;
+	unsigned int body_len;
+	unsigned int hdr_len;
+	unsigned int nm_len;
+	unsigned int etag;		/* offset of the ETag value within the headers */
+	unsigned int etag_len;
+	unsigned int flags;		/* CACHE_OBJ_F_GEN */
+	unsigned int conf;		/* digest of the settings its headers depend on, for files */
+	unsigned short uri_len;		/* zero for variants, the URI is zero-terminated */
+	unsigned short path_len;	/* zero for generated variants, zero-terminated */
+	short enc;			/* CACHE_ENC_* for variants, -1 for files */
+	unsigned short nb_var;		/* number of variant records following a file's */
+};
+
+/* cache flags */
+#define CACHE_F_WATCH		0x00000001	/* reload the roots when their files change */
+#define CACHE_F_ASYNC		0x00000002	/* files are read by the warm-up task */
+#define CACHE_F_ADMIT_ALL	0x00000004	/* store responses without checking their frequency */
+
+/* The cache : the configured roots with the lookup table built from all the
+ * files they hold, and the responses stored from the servers.
+ */
+struct cache {
+	struct list roots;		/* list of struct cache_root */
+	unsigned int flags;		/* CACHE_F_* */
+	struct cache_table *table;	/* current lookup table, NULL without roots */
+	unsigned int mapped;		/* number of objects with a mapped body */
+	int watch_fd;			/* inotify fd watching the roots, or -1 */
+	struct task *reload_task;	/* task reloading the roots after a change */
+	unsigned int reloads;		/* number of reloads performed */
+	struct task *warm_task;		/* task reading the pending files */
+	int warm_pos;			/* next key of the current table to read */
+	int warm_ahead;			/* next key of the current table to prefetch */
+	unsigned int warm_files;	/* files read by the current warm-up */
+	unsigned int warm_total;	/* files pending when it started */
+	unsigned long long warm_bytes;	/* bytes read by the current warm-up */
+	struct timeval warm_start;	/* date it started */
+	unsigned int warm_report;	/* date of the next progress report, in ticks */
+	char *shm_area;			/* memory shared by all processes, or NULL */
+	unsigned long shm_size;		/* size of the shared area */
+	unsigned long shm_used;		/* bytes allocated from it by this process */
+	int shm_writer;			/* this process fills the shared objects */
+	int shm_sealed;			/* the pre-fork objects are published, nothing more is allocated */
+	int warm_job;			/* the warm-up holds a job to keep the process alive */
+	char *snap_path;		/* snapshot file, or NULL */
+	char *snap_map;			/* snapshot mapping, or NULL */
+	unsigned long long snap_size;	/* size of the mapping */
+	hash_key_t *snap_keys;		/* snapshot records indexed by URI, only while loading */
+	hash_t *snap_hash;
+	unsigned int snap_used;		/* number of objects taken from the snapshot */
+	struct eb_root store;		/* stored responses, indexed by key */
+	struct list lru;		/* stored responses, least recently used first */
+	unsigned int max_mem;		/* memory limit for stored responses, 0 = disabled */
+	unsigned int max_obj;		/* larger response bodies are not stored */
+	unsigned long long mem_used;	/* memory used by stored responses */
+	unsigned int entries;		/* number of stored responses */
+	struct eb_root fills;		/* responses being fetched, indexed by key */
+	unsigned int lock_timeout;	/* max time to wait for a fill, in ms, 0 = disabled */
+	unsigned int swr;		/* time expired responses may be served, in ms */
+	unsigned int refreshes;		/* number of refreshes started */
+	unsigned char *sketch;		/* request frequencies, CACHE_SKETCH_ROWS rows of counters */
+	unsigned int sketch_mask;	/* counters per row minus one */
+	unsigned int sketch_adds;	/* increments since the counters were halved */
+	unsigned int rejected;		/* responses refused by the admission filter */
+	unsigned long long hits;	/* requests answered from stored responses */
+	unsigned long long misses;	/* requests out of the roots left to the servers */
+	unsigned long long bytes_out;	/* bytes of the responses sent from the store */
+	unsigned int evictions;		/* stored responses evicted to make room */
+	unsigned int purged;		/* stored responses removed by "purge cache" */
+	unsigned int load_time;		/* time spent indexing the roots by the last load, in ms */
+	unsigned int warm_time;		/* duration of the last complete warm-up, in ms */
+	struct eb_root mime;		/* struct cache_mime indexed by extension */
+	struct cache_neg *neg;		/* negative cache slots, or NULL if disabled */
+	unsigned int neg_mask;		/* number of slots minus one */
+	unsigned int neg_entries;	/* number of slots configured, 0 = default */
+	unsigned int neg_ttl;		/* lifetime of the negative responses, in ms, 0 = disabled */
+	unsigned long long neg_hits;	/* requests answered from the negative cache */
+	struct task *date_task;		/* task refreshing <date> every second */
+	time_t date_sec;		/* second of the current <date> */
+	char date[CACHE_CONN_MAX][CACHE_DATE_LEN];	/* Date header and end of headers, per CACHE_CONN_* */
+	unsigned int date_len[CACHE_CONN_MAX];
+};
+
+#endif /*_TYPES_CACHE_H*/
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ * End:
+ */
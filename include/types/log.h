@@ -22,16 +22,24 @@
 #ifndef _TYPES_LOG_H
 #define _TYPES_LOG_H
 
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <common/config.h>
+#include <common/mini-clist.h>
 
 #define MAX_SYSLOG_LEN          1024
 #define NB_LOG_FACILITIES       24
 #define NB_LOG_LEVELS           8
 #define SYSLOG_PORT             514
 #define UNIQUEID_LEN            128
+#define LOG_QUEUE_SIZE          64      /* log lines sent at once to syslog servers */
+#define LOG_FILE_MAGIC          "HALOGF1" /* 8 bytes with the trailing zero */
+#define LOG_FILE_HDR_SIZE       4096    /* offset of the first record in a log file */
+#define LOG_FILE_MIN_SIZE       65536
+#define LOG_FILE_DEF_SIZE       (16 * 1024 * 1024)
+#define LOG_FILE_DEF_COUNT      4
 
 
 /* lists of fields that can be logged */
@@ -110,6 +118,22 @@ struct logformat_node {
 	char *arg;
 };
 
+struct logformat_ctx;
+
+/* One element of a compiled log-format, see compile_logformat() */
+struct logformat_insn {
+	char *(*emit)(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx);
+	int options;			/* LOG_OPT_* of the field */
+	int len;			/* length of <text> */
+	char *text;			/* constant text, NULL for the fields */
+};
+
+/* A log-format compiled into a flat array of emitters */
+struct logformat_prog {
+	int nb_insn;
+	struct logformat_insn insn[0];
+};
+
 #define LOG_OPT_HEXA		0x00000001
 #define LOG_OPT_MANDATORY	0x00000002
 #define LOG_OPT_QUOTE		0x00000004
@@ -130,14 +154,60 @@ struct logformat_node {
 #define LW_BCKIP	4096	/* backend IP */
 #define LW_FRTIP 	8192	/* frontend IP */
 
+/* Header of each file of a "file@" log target. The files are preallocated and
+ * mapped, the records are appended after the header until the file is full,
+ * then the next file of the set is reset and used. <seq> grows on each reset
+ * so that the decoder can order the files. Everything is in host byte order.
+ */
+struct logfile_hdr {
+	char magic[8];			/* LOG_FILE_MAGIC, written last */
+	uint32_t hdr_size;		/* offset of the first record */
+	uint32_t pid;			/* process writing to this file */
+	uint64_t seq;			/* rotation sequence number, starts at 1 */
+	uint64_t size;			/* usable size of the file, which may be larger */
+	volatile uint64_t used;		/* end of the last complete record */
+	char tag[32];			/* syslog tag of the process */
+	char host[64];			/* host name */
+};
+
+/* A log line stored in a file. It is followed by the <len> bytes of the text,
+ * without the syslog header nor the LF, then padded to a multiple of 4 bytes.
+ */
+struct logfile_rec {
+	uint32_t sec;			/* date of the line */
+	uint32_t usec;
+	uint16_t len;			/* length of the text */
+	uint8_t pri;			/* syslog facility and level */
+	uint8_t flags;			/* unused for now */
+};
+
+/* A set of files for a "file@" log target, shared by all loggers using it */
+struct logfile {
+	struct list list;		/* chaining of all the log files */
+	char *path;			/* prefix of the file names */
+	int count;			/* number of files per process */
+	struct logfile_hdr **maps;	/* <count> mapped files per process */
+	struct logfile_hdr *cur;	/* file being written to, NULL before the first line */
+};
+
 struct logsrv {
 	struct list list;
 	struct sockaddr_storage addr;
+	struct logfile *file;		/* set for "file@" targets instead of <addr> */
 	int facility;
 	int level;
 	int minlvl;
 };
 
+/* A log line waiting in the queue to be sent to a syslog server */
+struct logmsg {
+	const struct logsrv *logsrv;	/* the syslog server */
+	int fd;				/* socket to send it through */
+	int logger;			/* logger number, for the errors */
+	int len;			/* length of the line, including the header */
+	char data[MAX_SYSLOG_LEN];
+};
+
 #endif /* _TYPES_LOG_H */
 
 /*
@@ -33,6 +33,7 @@
 #include <common/mini-clist.h>
 
 #include <types/buffers.h>
+#include <types/cache.h>
 #include <types/proto_http.h>
 #include <types/proxy.h>
 #include <types/queue.h>
@@ -86,6 +87,7 @@
 #define SN_IGNORE_PRST	0x00080000	/* ignore persistence */
 #define SN_BE_TRACK_SC1 0x00100000	/* backend tracks stick-counter 1 */
 #define SN_BE_TRACK_SC2 0x00200000	/* backend tracks stick-counter 2 */
+#define SN_INTERNAL	0x00400000	/* started by haproxy itself, not counted on the frontend */
 
 /* Termination sequence tracing.
  *
@@ -210,11 +212,10 @@ struct session {
 	unsigned int uniq_id;			/* unique ID used for the traces */
 	char *unique_id;			/* custom unique ID */
 
-	FILE 		*fp;
-	hash_elt_t  *elt;
-	int 		 cache;
-	int 		 send_flag;
-	int 		 count;
+	struct cache_obj *cobj;			/* cached object being sent, or NULL */
+	struct cache_entry *centry;		/* stored response holding <cobj>, or NULL */
+	struct cache_table *ctable;		/* lookup table holding <cobj>, or NULL */
+	struct cache_txn ctxn;			/* cache context of the current transaction */
 	long 		 offset;
 	long 		 size;
 };
@@ -179,6 +179,7 @@ struct stream_interface {
 				unsigned int flags;	/* STAT_* */
 				int iid, type, sid;	/* proxy id, type and service id if bounding of stats is enabled */
 				int st_code;		/* the status code returned by an action */
+				struct cache_root *root;	/* cache root being dumped */
 			} stats;
 			struct {
 				struct bref bref;	/* back-reference from the session being dumped */
@@ -146,8 +146,8 @@ struct server *get_server_sh(struct proxy *px, const char *addr, int len)
  */
 struct server *get_server_uh(struct proxy *px, char *uri, int uri_len)
 {
-	unsigned long hash = 0;
-	int c;
+	unsigned int hash = 0;
+	char *p, *end;
 	int slashes = 0;
 
 	if (px->lbprm.tot_weight == 0)
@@ -160,18 +160,21 @@ struct server *get_server_uh(struct proxy *px, char *uri, int uri_len)
 	if (px->uri_len_limit)
 		uri_len = MIN(uri_len, px->uri_len_limit);
 
-	while (uri_len--) {
-		c = *uri++;
-		if (c == '/') {
-			slashes++;
-			if (slashes == px->uri_dirs_depth1) /* depth+1 */
+	/* first find where the hashed part ends, then hash it at once */
+	end = uri + uri_len;
+	if (!px->uri_whole && (p = memchr(uri, '?', uri_len)) != NULL)
+		end = p;
+
+	if (px->uri_dirs_depth1) {
+		for (p = uri; p < end; p++) {
+			if (*p == '/' && ++slashes == px->uri_dirs_depth1) { /* depth+1 */
+				end = p;
 				break;
+			}
 		}
-		else if (c == '?' && !px->uri_whole)
-			break;
-
-		hash = c + (hash << 6) + (hash << 16) - hash;
 	}
+
+	hash = hash_mem(uri, end - uri);
 	if ((px->lbprm.algo & BE_LB_HASH_TYPE) != BE_LB_HASH_MAP)
 		hash = full_hash(hash);
  hash_done:
@@ -192,8 +195,8 @@ struct server *get_server_uh(struct proxy *px, char *uri, int uri_len)
  */
 struct server *get_server_ph(struct proxy *px, const char *uri, int uri_len)
 {
-	unsigned long hash = 0;
-	const char *p;
+	unsigned int hash;
+	const char *p, *end;
 	const char *params;
 	int plen;
 
@@ -221,11 +224,8 @@ struct server *get_server_ph(struct proxy *px, const char *uri, int uri_len)
 				p += plen + 1;
 				uri_len -= plen + 1;
 
-				while (uri_len && *p != '&') {
-					hash = *p + (hash << 6) + (hash << 16) - hash;
-					uri_len--;
-					p++;
-				}
+				end = memchr(p, '&', uri_len);
+				hash = hash_mem(p, end ? end - p : uri_len);
 				if ((px->lbprm.algo & BE_LB_HASH_TYPE) != BE_LB_HASH_MAP)
 					hash = full_hash(hash);
 				if (px->lbprm.algo & BE_LB_LKUP_CHTREE)
@@ -250,7 +250,7 @@ struct server *get_server_ph(struct proxy *px, const char *uri, int uri_len)
  */
 struct server *get_server_ph_post(struct session *s)
 {
-	unsigned long    hash = 0;
+	unsigned int     hash;
 	struct http_txn *txn  = &s->txn;
 	struct buffer   *req  = s->req;
 	struct http_msg *msg  = &txn->req;
@@ -259,6 +259,7 @@ struct server *get_server_ph_post(struct session *s)
 	unsigned long    len  = msg->body_len;
 	const char      *params = b_ptr(req, (int)(msg->sov - req->o));
 	const char      *p    = params;
+	const char      *start;
 
 	if (len > buffer_len(req) - msg->sov)
 		len = buffer_len(req) - msg->sov;
@@ -279,6 +280,7 @@ struct server *get_server_ph_post(struct session *s)
 				 */
 				p += plen + 1;
 				len -= plen + 1;
+				start = p;
 
 				while (len && *p != '&') {
 					if (unlikely(!HTTP_IS_TOKEN(*p))) {
@@ -291,11 +293,11 @@ struct server *get_server_ph_post(struct session *s)
 									      * This body does not contain parameters.
 									      */
 					}
-					hash = *p + (hash << 6) + (hash << 16) - hash;
 					len--;
 					p++;
 					/* should we break if vlen exceeds limit? */
 				}
+				hash = hash_mem(start, p - start);
 				if ((px->lbprm.algo & BE_LB_HASH_TYPE) != BE_LB_HASH_MAP)
 					hash = full_hash(hash);
 				if (px->lbprm.algo & BE_LB_LKUP_CHTREE)
@@ -327,13 +329,13 @@ struct server *get_server_ph_post(struct session *s)
  */
 struct server *get_server_hh(struct session *s)
 {
-	unsigned long    hash = 0;
+	unsigned int     hash = 0;
 	struct http_txn *txn  = &s->txn;
 	struct proxy    *px   = s->be;
 	unsigned int     plen = px->hh_len;
 	unsigned long    len;
 	struct hdr_ctx   ctx;
-	const char      *p;
+	const char      *p, *end;
 
 	/* tot_weight appears to mean srv_count */
 	if (px->lbprm.tot_weight == 0)
@@ -342,7 +344,7 @@ struct server *get_server_hh(struct session *s)
 	ctx.idx = 0;
 
 	/* if the message is chunked, we skip the chunk size, but use the value as len */
-	http_find_header2(px->hh_name, plen, b_ptr(s->req, -s->req->o), &txn->hdr_idx, &ctx);
+	http_find_header2(px->hh_name, plen, b_ptr(s->req, (int)-s->req->o), &txn->hdr_idx, &ctx);
 
 	/* if the header is not found or empty, let's fallback to round robin */
 	if (!ctx.idx || !ctx.vlen)
@@ -358,32 +360,24 @@ struct server *get_server_hh(struct session *s)
 	len = ctx.vlen;
 	p = (char *)ctx.line + ctx.val;
 	if (!px->hh_match_domain) {
-		while (len) {
-			hash = *p + (hash << 6) + (hash << 16) - hash;
-			len--;
-			p++;
-		}
+		hash = hash_mem(p, len);
 	} else {
-		int dohash = 0;
-		p += len - 1;
 		/* special computation, use only main domain name, not tld/host
 		 * going back from the end of string, start hashing at first
 		 * dot stop at next.
 		 * This is designed to work with the 'Host' header, and requires
-		 * a special option to activate this.
+		 * a special option to activate this. Domain names are not case
+		 * sensitive, so neither is the hash.
 		 */
-		while (len) {
-			if (*p == '.') {
-				if (!dohash)
-					dohash = 1;
-				else
-					break;
-			} else {
-				if (dohash)
-					hash = *p + (hash << 6) + (hash << 16) - hash;
-			}
-			len--;
-			p--;
+		end = p + len;
+		while (end > p && *(end - 1) != '.')
+			end--;
+		if (end > p) {
+			end--;
+			len = end - p;
+			while (len && p[len - 1] != '.')
+				len--;
+			hash = hash_mem_lc(p + len, end - (p + len));
 		}
 	}
 	if ((px->lbprm.algo & BE_LB_HASH_TYPE) != BE_LB_HASH_MAP)
@@ -398,10 +392,9 @@ struct server *get_server_hh(struct session *s)
 /* RDP Cookie HASH.  */
 struct server *get_server_rch(struct session *s)
 {
-	unsigned long    hash = 0;
+	unsigned int     hash = 0;
 	struct proxy    *px   = s->be;
 	unsigned long    len;
-	const char      *p;
 	int              ret;
 	struct sample    smp;
 	struct arg       args[2];
@@ -435,12 +428,7 @@ struct server *get_server_rch(struct session *s)
 	/* Found a the hh_name in the headers.
 	 * we will compute the hash based on this value ctx.val.
 	 */
-	p = smp.data.str.str;
-	while (len) {
-		hash = *p + (hash << 6) + (hash << 16) - hash;
-		len--;
-		p++;
-	}
+	hash = hash_mem(smp.data.str.str, len);
 	if ((px->lbprm.algo & BE_LB_HASH_TYPE) != BE_LB_HASH_MAP)
 		hash = full_hash(hash);
  hash_done:
@@ -1,552 +1,3666 @@
-#include <stdlib.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <dirent.h>
-#include <sys/types.h>
-
-#include <hash.h>
-
-#include <common/config.h>
-#include <common/debug.h>
-#include <common/memory.h>
-#include <common/logging.h>
-
-
-#include <proto/cache.h>
-#include <proto/session.h>
-#include <proto/protocols.h>
-#include <proto/proto_http.h>
-#include <proto/proto_tcp.h>
-#include <proto/buffers.h>
-
-
-struct cache    *cache;
-hash_key_t      *hash_key;
-hash_t          *hash;
-
-/*haproxy-second*/
-int process_cache_file(struct session *s)
-{
-	logging(TRACE, "[process_cache_file]");
-	char file[100] = "/home/ww/cache";
-    char size[100] = "\0";
-	struct http_txn *txn = &s->txn;
-	struct http_msg *msg_req = &txn->req;
-	struct http_msg *msg_rsp = &txn->rsp;
-	logging(TRACE, "data:%s\nmeth:%d,uri:%s\n", msg_req->buf->data, txn->meth, txn->uri);
-    int i = strlen(file), j = 0, max = 0, readl = 0, read_len = 0, cur_read = 0;
-	if (!s->fp) {
-		for ( ; txn->uri[j] != ' '; j++) {
-
-		}
-		j++;
-		for ( ; txn->uri[j] != ' '; i++, j++) {
-			file[i] = txn->uri[j];
-		}
-		file[i] = 0;
-		logging(TRACE, "process_session:file:%s\n", file);
-
-		FILE *fp = fopen(file, "rb");
-		if (fp) {
-			s->fp = fp;
-			s->cache = 1;
-			s->offset = 0;
-			fseek(fp, 0L, SEEK_END);
-			s->size = ftell(fp);
-			sprintf(size, "%d", s->size);
-            fseek(fp, 0L, SEEK_SET);
-			msg_req->buf->p = msg_req->buf->data;
-			msg_req->buf->i = 0;
-			msg_req->buf->o = 0;
-			msg_req->buf->to_forward = 0;
-			msg_rsp->buf->data[0] = 0;
-			memset(msg_req->buf->data, 0, sizeof(char)*msg_req->buf->size);
-			memcpy(msg_rsp->buf->p, HTTP_200, strlen(HTTP_200));
-			memcpy(msg_rsp->buf->p + strlen(HTTP_200), size, strlen(size));
-			memcpy(msg_rsp->buf->p + strlen(HTTP_200) + strlen(size), "\r\nContent-Type: image/ipeg\r\n\r\n",
-                                                                strlen("\r\nContent-Type: image/ipeg\r\n\r\n"));
-
-			msg_rsp->buf->i = 0;
-			msg_rsp->buf->o = strlen(HTTP_200) + strlen(size) + strlen("\r\nContent-Type: image/ipeg\r\n\r\n");
-			msg_rsp->buf->to_forward = msg_rsp->buf->o + s->size;
-			msg_rsp->buf->p += msg_rsp->buf->o;
-			max = bi_avail(msg_rsp->buf);
-
-			logging(TRACE, "[haproxy-second.cache][msg_rsp->buf->to_forward:%d]", msg_rsp->buf->to_forward);
-			
-            if (!max)
-            {
-                msg_rsp->buf->flags |= BF_FULL;
-                s->si[0].flags |= SI_FL_WAIT_ROOM;
-                return 1;
-            }
-
-            /*
-                        * 1. compute the maximum block size we can read at once.
-                        */
-            if (buffer_empty(msg_rsp->buf))
-            {
-                /* let's realign the buffer to optimize I/O */
-                msg_rsp->buf->p = msg_rsp->buf->data;
-            }
-            else if (msg_rsp->buf->data + msg_rsp->buf->o < msg_rsp->buf->p &&
-                     msg_rsp->buf->p + msg_rsp->buf->i < msg_rsp->buf->data + msg_rsp->buf->size)
-            {
-                /* remaining space wraps at the end, with a moving limit */
-                if (max > msg_rsp->buf->data + msg_rsp->buf->size - (msg_rsp->buf->p + msg_rsp->buf->i))
-                    max = msg_rsp->buf->data + msg_rsp->buf->size - (msg_rsp->buf->p + msg_rsp->buf->i);
-            }
-            readl = fread(bi_end(msg_rsp->buf), sizeof(char), max, s->fp);
-			logging(TRACE, "[haproxy-second.cache][msg_rsp->buf->to_forward:%d][max:%d][o:%d]", 
-					msg_rsp->buf->to_forward, max, msg_rsp->buf->o);
-			if (readl > 0) {
-                s->offset += readl;
-             //   msg_rsp->buf->o += readl;
-                read_len += readl;
-                msg_rsp->buf->i += readl;
-                cur_read += readl;
-
-                /* if we're allowed to directly forward data, we must update ->o */
-                if (msg_rsp->buf->to_forward && !(msg_rsp->buf->flags & (BF_SHUTW|BF_SHUTW_NOW)))
-                {
-                    unsigned long fwd = readl;
-                    if (msg_rsp->buf->to_forward != BUF_INFINITE_FORWARD)
-                    {
-                        if (fwd > msg_rsp->buf->to_forward)
-                            fwd = msg_rsp->buf->to_forward;
-                        msg_rsp->buf->to_forward -= fwd;
-                    }
-                    b_adv(msg_rsp->buf, fwd);
-                }
-				logging(TRACE, "[haproxy-second.cache][msg_rsp->buf->to_forward:%d][max:%d][o:%d]", 
-					msg_rsp->buf->to_forward, max, msg_rsp->buf->o);
-
-                logging(TRACE, "read_test:%d,size:%d,o:%d,%s\n", readl, msg_rsp->buf->size, msg_rsp->buf->o, msg_rsp->buf->data);
-
-                if (s->offset >= s->size) {
-                    logging(TRACE, "process_session:if (fp) close\n");
-                    msg_req->msg_state = HTTP_MSG_TUNNEL;
-                    msg_rsp->msg_state = HTTP_MSG_TUNNEL;
-                    fclose(fp);
-                    s->fp = NULL;
-                }
-              //  logging(TRACE, "response,%d,write:%s\n", bo_ptr(msg_rsp->buf) - msg_rsp->buf->data, bo_ptr(msg_rsp->buf));
-                if (msg_rsp->buf->o) {
-                    logging(TRACE, "set poll\n");
-                    EV_FD_SET(s->si[0].conn.t.sock.fd, DIR_WR);
-					EV_FD_SET(s->si[0].conn.t.sock.fd, DIR_RD);
-                    EV_FD_CLR(s->si[1].conn.t.sock.fd, DIR_WR);
-                }
-
-                logging(TRACE,"process_session:if (fp)[msg_rsp->o:%d][size:%d][offset:%d][max:%d][readl:%d]\n",
-                    msg_rsp->buf->o, s->size, s->offset, max, readl);
-            } else {
-				
-            }
-		} else {
-			s->cache = -1;
-			//bi_erase(msg_rsp->buf);
-		}
-	}
-	else {
-		logging(TRACE, "[haproxy-second.cache][read cache not first]");
-        max = bi_avail(msg_rsp->buf);
-
-        if (!max)
-        {
-            msg_rsp->buf->flags |= BF_FULL;
-            s->si[0].flags |= SI_FL_WAIT_ROOM;
-            return 1;
-        }
-
-        /*
-	            * 1. compute the maximum block size we can read at once.
-	            */
-        if (buffer_empty(msg_rsp->buf))
-        {
-            /* let's realign the buffer to optimize I/O */
-            msg_rsp->buf->p = msg_rsp->buf->data;
-        }
-        else if (msg_rsp->buf->data + msg_rsp->buf->o < msg_rsp->buf->p &&
-                 msg_rsp->buf->p + msg_rsp->buf->i < msg_rsp->buf->data + msg_rsp->buf->size)
-        {
-            /* remaining space wraps at the end, with a moving limit */
-            if (max > msg_rsp->buf->data + msg_rsp->buf->size - (msg_rsp->buf->p + msg_rsp->buf->i))
-                max = msg_rsp->buf->data + msg_rsp->buf->size - (msg_rsp->buf->p + msg_rsp->buf->i);
-        }
-	    logging(TRACE, "process_session:if (fp) else[msg_rsp->o:%d][p->char:%d][max:%d]\n",
-               msg_rsp->buf->o, msg_rsp->buf->p-msg_rsp->buf->data, max);
-
-        readl = fread(bi_end(msg_rsp->buf), sizeof(char), max, s->fp);
-
-        logging(TRACE, "readl:%d\n", readl);
-        if (readl > 0) {
-            s->offset += readl;
-      //      msg_rsp->buf->o += readl;
-            read_len += readl;
-            msg_rsp->buf->i += readl;
-            cur_read += readl;
-
-            /* if we're allowed to directly forward data, we must update ->o */
-            if (msg_rsp->buf->to_forward && !(msg_rsp->buf->flags & (BF_SHUTW|BF_SHUTW_NOW)))
-            {
-                unsigned long fwd = readl;
-                if (msg_rsp->buf->to_forward != BUF_INFINITE_FORWARD)
-                {
-                    if (fwd > msg_rsp->buf->to_forward)
-                        fwd = msg_rsp->buf->to_forward;
-                    msg_rsp->buf->to_forward -= fwd;
-                }
-                b_adv(msg_rsp->buf, fwd);
-            }
-
-            if (s->offset >= s->size) {
-                logging(TRACE, "process_session:if (fp) close\n");
-                msg_req->msg_state = HTTP_MSG_TUNNEL;
-                msg_rsp->msg_state = HTTP_MSG_TUNNEL;
-                fclose(s->fp);
-                s->fp = NULL;
-            }
-            logging(TRACE, "here\n");
-            if (msg_rsp->buf->o) {
-             
-                EV_FD_SET(s->si[0].conn.t.sock.fd, DIR_WR);
-				EV_FD_SET(s->si[0].conn.t.sock.fd, DIR_RD);
-                EV_FD_CLR(s->si[1].conn.t.sock.fd, DIR_WR);
-            }
-        } else {
-
-        }
-		logging(TRACE, "process_session:if (fp) else[msg_rsp->o:%d][size:%d][offset:%d]\n", msg_rsp->buf->o, s->size, s->offset);
-
-	}
-    return 1;
-}
-void read_a_file(hash_key_t *name)
-{
-    char cache[CACHE_LEN] = "\0";
-    char size[SIZE_LEN] = "\0";
-    int offset = 0, fsize = 0, vsize = 0, readl = 0;
-    char file[100] = "/home/ww/cache";
-    memcpy(file + strlen(file), name->key.data, strlen(name->key.data));
-    FILE *fp = fopen(file, "rb");
-    char *value = NULL;
-   // logging(TRACE, "read_a_file:%s", file );
-    if (fp) {
-        fseek(fp, 0L, SEEK_END);
-        fsize = ftell(fp);
-        sprintf(size, "%d", fsize);
-        fseek(fp, 0L, SEEK_SET);
-        memset(cache, 0, CACHE_LEN);
-        memcpy(cache, HTTP_200, strlen(HTTP_200));
-        memcpy(cache + strlen(HTTP_200), size, strlen(size));
-        memcpy(cache + strlen(HTTP_200) + strlen(size), "\r\nContent-Type: image/ipeg\r\n\r\n",
-                                                            strlen("\r\nContent-Type: image/ipeg\r\n\r\n"));
-        //logging(TRACE, "%s", cache);
-        offset = strlen(cache);
-        vsize = fsize + offset;
-        value = malloc (fsize + strlen(cache));
-        memcpy(value, cache, offset); 
-        while ((readl = fread(value + offset, sizeof(char), fsize, fp)) != 0) {
-            logging(TRACE, "fread:%d", readl);
-            if (readl > 0) {
-                offset += readl;
-            } else {
-                break;
-            }
-        }
-        logging(TRACE, "%d, %d", vsize, offset);
-        if (offset != vsize) {
-            logging(INFO, "[readerr][file:%s]", file);
-            free(value);
-            value = NULL;
-        }
-        name->value = value;
-        name->vlen = vsize;
-        fclose(fp);
-    } else {
-        name->vlen = 0;
-        name->value = NULL;
-    }
-    if (name->value) {
-        logging(TRACE, "init vlen:%d", name->vlen);
-    }
-}
-
-void read_files(hash_key_t *names, int nelts)
-{
-    logging(TRACE, "read_files");
-    int i = 0;
-    while (i < nelts) {
-        read_a_file(&names[i]);
-        i++;
-    }
-}
-
-void init_cache_file()
-{
-	logging(TRACE, "init_cache_file");
-	char dir[100] = "/home/ww/cache/hwtestjss/images";
-	char pre_uri[100] = "/hwtestjss/images/";
-	int len_pre_uri = strlen(pre_uri);
-	struct dirent	*dirp;
-	DIR             *dp;
-	int 			 files_num = 0;
-	if ((dp = opendir(dir)) == NULL) {
-		logging(TRACE, "[init_cache_file]opendir error");
-		return;
-	}	
-	while ((dirp = readdir(dp)) != NULL) {
-		
-		if (strcmp(dirp->d_name, ".") == 0|| 
-			strcmp(dirp->d_name, "..") == 0)
-			continue;
-        else
-            files_num++;
-		//logging(TRACE, "[init_cache_file]%s", dirp->d_name);		
-	}
-	logging(TRACE, "files_num:%d", files_num);
-	cache = (struct cache *) malloc (files_num * sizeof(struct cache));
-	logging(TRACE, "cache:%u", cache);
-	if (cache == NULL) {
-		logging(FATAL, "[init_cache_file][malloc cache error!]");
-		return;
-	}
-
-    hash_key = (hash_key_t *) malloc (sizeof(hash_key_t) * files_num);
-
-	files_num = 0;
-	logging(TRACE, "here");
-	close(dir);
-	if ((dp = opendir(dir)) == NULL) {
-		logging(TRACE, "[init_cache_file]opendir error");
-		return;
-	}	
-	while ((dirp = readdir(dp)) != NULL) {
-		
-		if (strcmp(dirp->d_name, ".") == 0|| 
-			strcmp(dirp->d_name, "..") == 0)
-			continue;
-		//logging(TRACE, "[init_cache_file]%s", dirp->d_name);
-		memcpy(pre_uri + len_pre_uri, dirp->d_name, dirp->d_reclen);
-		memcpy(cache[files_num].uri, pre_uri, strlen(pre_uri));
-        hash_key[files_num].key.data = cache[files_num].uri;
-        hash_key[files_num].key.len = strlen(cache[files_num].uri) + 1;
-        hash_key[files_num].key_hash = hap_hash_key(hash_key[files_num].key.data, hash_key[files_num].key.len);
-		//logging(TRACE, "init cache:%s, %u", hash_key[files_num].key.data, hash_key[files_num].key.len, hash_key[files_num].key_hash);
-		files_num++;
-	}
-	close(dir);
-    read_files(hash_key, files_num);
-	hash = hap_hash_init(hash_key, files_num);
-    /*printf("%s\n%s\n",hash_key[12].key.data, hap_hash_find(hash, hap_hash_key(hash_key[12].key.data, hash_key[12].key.len),
-                                hash_key[12].key.data, hash_key[12].key.len));
-    if (hash) {
-        int i = 0;
-        hash_elt_t *elt;
-        while (i < hash->size) {
-            elt = hash->buckets[i];
-            if (hash->buckets[i] != NULL) {
-                logging(TRACE, "print i%d:%s", i, hash->buckets[i]->name);
-                elt++;
-                while (elt && elt->value) {
-                    logging(TRACE, "print i%d:%s", i, elt->name);
-                    elt++;
-                }
-            }
-            i++;
-        }
-    }*/
-
-}
-
-int process_cache_mem(struct session *s)
-{
-    logging(TRACE, "[process_cache_file]");
-    char uri[100] = "";
-    char size[100] = "\0";
-    hash_elt_t *elt;
-    struct http_txn *txn = &s->txn;
-    struct http_msg *msg_req = &txn->req;
-    struct http_msg *msg_rsp = &txn->rsp;
-    logging(TRACE, "data:%s\nmeth:%d,uri:%s\n", msg_req->buf->data, txn->meth, txn->uri);
-    int i = 0, j = 0, max = 0, readl = 0, read_len = 0, cur_read = 0;
-    if (!s->elt) {
-        for ( ; txn->uri[j] != ' '; j++) {
-        }
-        j++;
-        for ( ; txn->uri[j] != ' '; i++, j++) {
-            uri[i] = txn->uri[j];
-        }
-        uri[i] = 0;
-        //logging(TRACE, "process_session:file:%s\n", uri);
-        //logging(TRACE, "hash find:%s", hap_hash_find(hash, hap_hash_key(uri, strlen(uri) + 1), uri, strlen(uri) + 1));
-        elt = hap_hash_find(hash, hap_hash_key(uri, strlen(uri) + 1), uri, strlen(uri) + 1);
-        if (elt) {
-            logging(TRACE, "value len:%d\n%s", elt->vlen, elt->value);
-            s->cache = 1;
-            s->offset = 0;
-            s->size = elt->vlen;
-            s->elt = elt;
-            msg_req->buf->p = msg_req->buf->data;
-            msg_req->buf->i = 0;
-            msg_req->buf->o = 0;
-            msg_req->buf->to_forward = 0;
-            msg_rsp->buf->data[0] = 0;
-            msg_rsp->buf->i = 0;
-            msg_rsp->buf->o = 0;
-            msg_rsp->buf->to_forward = elt->vlen;
-            msg_rsp->buf->p += msg_rsp->buf->o;
-            max = bi_avail(msg_rsp->buf);
-
-            logging(TRACE, "[haproxy-second.cache][msg_rsp->buf->to_forward:%d]", msg_rsp->buf->to_forward);
-            
-            if (!max)
-            {
-                msg_rsp->buf->flags |= BF_FULL;
-                s->si[0].flags |= SI_FL_WAIT_ROOM;
-                return 1;
-            }
-            logging(TRACE, "check");
-            /*
-            * 1. compute the maximum block size we can read at once.
-            */
-            if (buffer_empty(msg_rsp->buf))
-            {
-                /* let's realign the buffer to optimize I/O */
-                msg_rsp->buf->p = msg_rsp->buf->data;
-            }
-            else if (msg_rsp->buf->data + msg_rsp->buf->o < msg_rsp->buf->p &&
-                     msg_rsp->buf->p + msg_rsp->buf->i < msg_rsp->buf->data + msg_rsp->buf->size)
-            {
-                /* remaining space wraps at the end, with a moving limit */
-                if (max > msg_rsp->buf->data + msg_rsp->buf->size - (msg_rsp->buf->p + msg_rsp->buf->i))
-                    max = msg_rsp->buf->data + msg_rsp->buf->size - (msg_rsp->buf->p + msg_rsp->buf->i);
-            }
-            if (max > s->size - s->offset) {
-                max = s->size - s->offset;
-            }
-            logging(TRACE, "check");
-            memcpy(bi_end(msg_rsp->buf), s->elt->value, max);
-            logging(TRACE, "[haproxy-second.cache][msg_rsp->buf->to_forward:%d][max:%d][o:%d]", 
-                    msg_rsp->buf->to_forward, max, msg_rsp->buf->o);
-            
-            s->offset += max;
-         //   msg_rsp->buf->o += readl;
-            read_len += max;
-            msg_rsp->buf->i += max;
-            cur_read += max;
-
-            /* if we're allowed to directly forward data, we must update ->o */
-            if (msg_rsp->buf->to_forward && !(msg_rsp->buf->flags & (BF_SHUTW|BF_SHUTW_NOW)))
-            {
-                unsigned long fwd = max;
-                if (msg_rsp->buf->to_forward != BUF_INFINITE_FORWARD)
-                {
-                    if (fwd > msg_rsp->buf->to_forward)
-                        fwd = msg_rsp->buf->to_forward;
-                    msg_rsp->buf->to_forward -= fwd;
-                }
-                b_adv(msg_rsp->buf, fwd);
-            }
-            //logging(TRACE, "[haproxy-second.cache][msg_rsp->buf->to_forward:%d][max:%d][o:%d]", 
-             //   msg_rsp->buf->to_forward, max, msg_rsp->buf->o);
-
-            logging(TRACE, "read_test:%d,size:%d,o:%d,%s\n", max, msg_rsp->buf->size, msg_rsp->buf->o, msg_rsp->buf->data);
-
-            if (s->offset >= s->size) {
-                msg_req->msg_state = HTTP_MSG_TUNNEL;
-                msg_rsp->msg_state = HTTP_MSG_TUNNEL;
-            }
-          //  logging(TRACE, "response,%d,write:%s\n", bo_ptr(msg_rsp->buf) - msg_rsp->buf->data, bo_ptr(msg_rsp->buf));
-            logging(TRACE, "[process_cache_mem][o:%d]", msg_rsp->buf->o);
-            if (msg_rsp->buf->o) {
-                logging(TRACE, "set poll\n");
-                EV_FD_SET(s->si[0].conn.t.sock.fd, DIR_WR);
-                EV_FD_SET(s->si[0].conn.t.sock.fd, DIR_RD);
-                EV_FD_CLR(s->si[1].conn.t.sock.fd, DIR_WR);
-            }
-
-            logging(TRACE,"process_session:if (fp)[msg_rsp->o:%d][size:%d][offset:%d][max:%d][max:%d]\n",
-                msg_rsp->buf->o, s->size, s->offset, max, max);
-           
-        } else {
-            s->cache = -1;
-        }
-    } else {
-        logging(TRACE, "[haproxy-second.cache][read cache not first]");
-        max = bi_avail(msg_rsp->buf);
-
-        if (!max)
-        {
-            msg_rsp->buf->flags |= BF_FULL;
-            s->si[0].flags |= SI_FL_WAIT_ROOM;
-            return 1;
-        }
-
-        /*
-        * 1. compute the maximum block size we can read at once.
-        */
-        if (buffer_empty(msg_rsp->buf))
-        {
-            /* let's realign the buffer to optimize I/O */
-            msg_rsp->buf->p = msg_rsp->buf->data;
-        }
-        else if (msg_rsp->buf->data + msg_rsp->buf->o < msg_rsp->buf->p &&
-                 msg_rsp->buf->p + msg_rsp->buf->i < msg_rsp->buf->data + msg_rsp->buf->size)
-        {
-            /* remaining space wraps at the end, with a moving limit */
-            if (max > msg_rsp->buf->data + msg_rsp->buf->size - (msg_rsp->buf->p + msg_rsp->buf->i))
-                max = msg_rsp->buf->data + msg_rsp->buf->size - (msg_rsp->buf->p + msg_rsp->buf->i);
-        }
-        logging(TRACE, "process_session:if (fp) else[msg_rsp->o:%d][p->char:%d][max:%d]\n",
-               msg_rsp->buf->o, msg_rsp->buf->p-msg_rsp->buf->data, max);
-        if (max > s->size - s->offset) {
-            max = s->size - s->offset;
-        }
-        memcpy(bi_end(msg_rsp->buf), s->elt->value + s->offset, max);
-
-        s->offset += max;
-  //      msg_rsp->buf->o += readl;
-        read_len += max;
-        msg_rsp->buf->i += max;
-        cur_read += max;
-
-        /* if we're allowed to directly forward data, we must update ->o */
-        if (msg_rsp->buf->to_forward && !(msg_rsp->buf->flags & (BF_SHUTW|BF_SHUTW_NOW)))
-        {
-            unsigned long fwd = max;
-            if (msg_rsp->buf->to_forward != BUF_INFINITE_FORWARD)
-            {
-                if (fwd > msg_rsp->buf->to_forward)
-                    fwd = msg_rsp->buf->to_forward;
-                msg_rsp->buf->to_forward -= fwd;
-            }
-            b_adv(msg_rsp->buf, fwd);
-        }
-
-        if (s->offset >= s->size) {
-            msg_req->msg_state = HTTP_MSG_TUNNEL;
-            msg_rsp->msg_state = HTTP_MSG_TUNNEL;
-        }
-        logging(TRACE, "here\n");
-        if (msg_rsp->buf->o) {
-        
-            EV_FD_SET(s->si[0].conn.t.sock.fd, DIR_WR);
-            EV_FD_SET(s->si[0].conn.t.sock.fd, DIR_RD);
-            EV_FD_CLR(s->si[1].conn.t.sock.fd, DIR_WR);
-        }
-    
-        logging(TRACE, "process_session:if (fp) else[msg_rsp->o:%d][size:%d][offset:%d]\n", msg_rsp->buf->o, s->size, s->offset);
-
-    }
-	return 0;
-}
-
-int process_cache(struct session *s)
-{
-	logging(TRACE, "process_cache");
-	return process_cache_mem(s);
-}
-
-
+/*
+ * HTTP cache : files found below the configured roots are loaded in memory at
+ * startup, and cacheable responses from the servers are stored in a memory
+ * bounded LRU, both being served directly from there.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef CONFIG_HAP_LINUX_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <hash.h>
+#include <ebsttree.h>
+
+#include <common/config.h>
+#include <common/debug.h>
+#include <common/memory.h>
+#include <common/logging.h>
+#include <common/splice.h>
+#include <common/standard.h>
+#include <common/ticks.h>
+#include <common/time.h>
+
+#include <types/global.h>
+
+
+#include <proto/cache.h>
+#include <proto/log.h>
+#include <proto/session.h>
+#include <proto/protocols.h>
+#include <proto/proxy.h>
+#include <proto/proto_http.h>
+#include <proto/proto_tcp.h>
+#include <proto/buffers.h>
+#include <proto/fd.h>
+#include <proto/hdr_idx.h>
+#include <proto/pipe.h>
+#include <proto/stream_interface.h>
+#include <proto/task.h>
+
+
+struct cache cache = {
+	.roots = LIST_HEAD_INIT(cache.roots),
+	.watch_fd = -1,
+	.store = EB_ROOT_UNIQUE,
+	.lru   = LIST_HEAD_INIT(cache.lru),
+	.fills = EB_ROOT_UNIQUE,
+	.lock_timeout = CACHE_DEF_LOCK_TMOUT,
+	.mime  = EB_ROOT_UNIQUE,
+};
+
+struct pool_head *pool2_cache_key;
+struct pool_head *pool2_cache_gen;
+
+/* content codings of the object variants, indexed by CACHE_ENC_* */
+const struct cache_enc cache_enc[CACHE_ENC_MAX] = {
+	[CACHE_ENC_BR]   = { .name = "br",   .ext = ".br" },
+	[CACHE_ENC_GZIP] = { .name = "gzip", .ext = ".gz" },
+};
+
+/* endings of the headers of a hit, indexed by CACHE_CONN_* */
+static const char *const cache_conn_hdr[CACHE_CONN_MAX] = {
+	[CACHE_CONN_NONE]   = "\r\n",
+	[CACHE_CONN_CLO]    = "Connection: close\r\n\r\n",
+	[CACHE_CONN_KAL]    = "Connection: keep-alive\r\n\r\n",
+	[CACHE_CONN_PX_CLO] = "Proxy-Connection: close\r\n\r\n",
+	[CACHE_CONN_PX_KAL] = "Proxy-Connection: keep-alive\r\n\r\n",
+};
+
+/* MIME types of the most common extensions, for the ones which do not appear
+ * in the "mime-types" file.
+ */
+static const struct {
+	const char *ext;
+	const char *type;
+} cache_def_mime[] = {
+	{ "css",   "text/css" },
+	{ "csv",   "text/csv" },
+	{ "gif",   "image/gif" },
+	{ "htm",   "text/html" },
+	{ "html",  "text/html" },
+	{ "ico",   "image/x-icon" },
+	{ "jpeg",  "image/jpeg" },
+	{ "jpg",   "image/jpeg" },
+	{ "js",    "application/javascript" },
+	{ "json",  "application/json" },
+	{ "mp3",   "audio/mpeg" },
+	{ "mp4",   "video/mp4" },
+	{ "pdf",   "application/pdf" },
+	{ "png",   "image/png" },
+	{ "svg",   "image/svg+xml" },
+	{ "txt",   "text/plain" },
+	{ "wasm",  "application/wasm" },
+	{ "webm",  "video/webm" },
+	{ "webp",  "image/webp" },
+	{ "woff",  "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ "xml",   "application/xml" },
+	{ "zip",   "application/zip" },
+	{ NULL,    NULL }
+};
+
+/* error responses sent for the keys found in the negative cache, indexed by
+ * CACHE_NEG_*. The Date and the end of the headers are added on hits.
+ */
+#define CACHE_NEG_OBJ(str) {						\
+	.hdr = str, .hdr_len = sizeof(str) - 1,				\
+	.flags = CACHE_OBJ_F_NEG | CACHE_OBJ_F_DATE,			\
+}
+
+static struct cache_obj cache_neg_obj[CACHE_NEG_MAX] = {
+	[CACHE_NEG_404] = CACHE_NEG_OBJ("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n"),
+	[CACHE_NEG_410] = CACHE_NEG_OBJ("HTTP/1.1 410 Gone\r\nContent-Length: 0\r\n\r\n"),
+};
+
+static void cache_unlink_entry(struct cache_entry *e);
+static struct si_applet cache_refresh_applet;
+
+/* Returns a pointer to a free entry at the end of the key array of table
+ * <tbl>, growing the array if needed, or NULL if memory is missing. The entry
+ * is only accounted for once the caller increments tbl->nb_keys.
+ */
+static hash_key_t *cache_alloc_key(struct cache_table *tbl)
+{
+	hash_key_t *keys;
+	int max;
+
+	if (tbl->nb_keys < tbl->max_keys)
+		return &tbl->keys[tbl->nb_keys];
+
+	max = tbl->max_keys ? tbl->max_keys * 2 : 64;
+	keys = realloc(tbl->keys, max * sizeof(*keys));
+	if (!keys)
+		return NULL;
+	tbl->keys = keys;
+	tbl->max_keys = max;
+	return &tbl->keys[tbl->nb_keys];
+}
+
+/* Releases the body of object <obj>. */
+static void cache_free_body(struct cache_obj *obj)
+{
+	if (obj->flags & CACHE_OBJ_F_SNAP)
+		;
+	else if (obj->flags & CACHE_OBJ_F_MMAP)
+		munmap(obj->body, obj->body_len);
+	else
+		free(obj->body);
+	obj->body = NULL;
+}
+
+/* Releases object <obj>, its body and its variants. Objects in the shared
+ * memory area may still be used by other processes and are never released.
+ */
+static void cache_free_obj(struct cache_obj *obj)
+{
+	int enc;
+
+	if (!obj || (obj->flags & CACHE_OBJ_F_SHM))
+		return;
+	for (enc = 0; enc < CACHE_ENC_MAX; enc++)
+		cache_free_obj(obj->variant[enc]);
+	cache_free_body(obj);
+	free(obj->path);
+	free(obj);
+}
+
+/* Drops a lookup table's reference on static object <obj>, which is released
+ * with the last one.
+ */
+static inline void cache_put_obj(struct cache_obj *obj)
+{
+	if (!(obj->flags & CACHE_OBJ_F_SHM) && --obj->refcnt == 0)
+		cache_free_obj(obj);
+}
+
+/* Takes a lookup table's reference on static object <obj>. The ones in the
+ * shared memory area are not counted since they are never released.
+ */
+static inline void cache_get_obj(struct cache_obj *obj)
+{
+	if (!(obj->flags & CACHE_OBJ_F_SHM))
+		obj->refcnt++;
+}
+
+/* Returns <len> zeroed bytes from the shared memory area, or NULL if this
+ * process does not fill it or if it is full. Nothing is ever released there,
+ * so it is only used by the objects indexed before the fork and their gzip
+ * variants.
+ */
+static void *cache_shm_alloc(unsigned long len)
+{
+	void *ptr;
+
+	if (!cache.shm_area || !cache.shm_writer)
+		return NULL;
+
+	len = (len + 15) & ~15UL;
+	if (len > cache.shm_size - cache.shm_used)
+		return NULL;
+	ptr = cache.shm_area + cache.shm_used;
+	cache.shm_used += len;
+	return ptr;
+}
+
+/* Returns non-zero if this process may read the body of pending object <obj>.
+ * The objects in the shared memory area are only filled by its writer.
+ */
+static inline int cache_may_fill(const struct cache_obj *obj)
+{
+	return !(obj->flags & CACHE_OBJ_F_SHM) || cache.shm_writer;
+}
+
+/* Allocates room for a body of <len> bytes in <obj>. Bodies which do not fit
+ * in a buffer get their own anonymous mapping so that they may be vmspliced.
+ * Returns 0 on success or -1 on failure.
+ */
+static int cache_alloc_body(struct cache_obj *obj, unsigned int len)
+{
+	obj->body_len = len;
+	if (len >= global.tune.bufsize) {
+		obj->body = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (obj->body == MAP_FAILED) {
+			obj->body = NULL;
+			return -1;
+		}
+		obj->flags |= CACHE_OBJ_F_MMAP | CACHE_OBJ_F_SPLICE;
+		return 0;
+	}
+
+	/* malloc(0) may return NULL */
+	obj->body = malloc(len ? len : 1);
+	return obj->body ? 0 : -1;
+}
+
+/* Formats date <t> as an HTTP date into <out> which must be at least 30 bytes
+ * long. Returns the length of the string.
+ */
+static int cache_format_date(char *out, time_t t)
+{
+	struct tm tm;
+
+	return strftime(out, 30, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&t, &tm));
+}
+
+/* Parses the <len> bytes HTTP date at <str>. Only the RFC1123 format is
+ * supported. Returns the date, or -1 if it cannot be parsed.
+ */
+static time_t cache_parse_date(const char *str, int len)
+{
+	char date[64];
+	struct tm tm;
+	char *end;
+
+	if (len >= sizeof(date))
+		return -1;
+	memcpy(date, str, len);
+	date[len] = 0;
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (!end || *end)
+		return -1;
+	return timegm(&tm);
+}
+
+/* Returns the MIME type of file <path> according to its extension, looked up
+ * in the "mime-types" file first, then in the default types. Files with an
+ * unknown extension get CACHE_DEF_MIME.
+ */
+static const char *cache_mime_type(const char *path)
+{
+	struct ebmb_node *node;
+	const char *dot = strrchr(path, '.');
+	char ext[CACHE_MIME_LEN];
+	int i;
+
+	if (!dot || strchr(dot, '/') || strlen(dot + 1) >= sizeof(ext))
+		return CACHE_DEF_MIME;
+
+	for (i = 0; dot[i + 1]; i++)
+		ext[i] = tolower((unsigned char)dot[i + 1]);
+	ext[i] = 0;
+
+	node = ebst_lookup(&cache.mime, ext);
+	if (node)
+		return ebmb_entry(node, struct cache_mime, node)->type;
+
+	for (i = 0; cache_def_mime[i].ext; i++)
+		if (strcmp(ext, cache_def_mime[i].ext) == 0)
+			return cache_def_mime[i].type;
+	return CACHE_DEF_MIME;
+}
+
+/* Loads the MIME types from file <file> in the mime.types format : one type
+ * per line followed by its extensions, blank lines and '#' comments being
+ * ignored. An extension listed several times gets the last type. Returns 0
+ * on success, or -1 with <err> filled with the error message.
+ */
+int cache_load_mime_types(const char *file, char **err)
+{
+	struct cache_mime *mime;
+	struct ebmb_node *node;
+	char line[1024], *type, *ext, *p;
+	int linenum = 0;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f) {
+		memprintf(err, "cannot open '%s' : %s", file, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		linenum++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = 0;
+
+		type = strtok(line, " \t\r\n");
+		if (!type)
+			continue;
+
+		while ((ext = strtok(NULL, " \t\r\n")) != NULL) {
+			if (strlen(ext) >= CACHE_MIME_LEN) {
+				memprintf(err, "'%s' line %d : extension '%s' is too long",
+					  file, linenum, ext);
+				goto fail;
+			}
+			for (p = ext; *p; p++)
+				*p = tolower((unsigned char)*p);
+
+			node = ebst_lookup(&cache.mime, ext);
+			if (node) {
+				mime = ebmb_entry(node, struct cache_mime, node);
+				free(mime->type);
+			}
+			else {
+				mime = calloc(1, sizeof(*mime) + strlen(ext) + 1);
+				if (!mime)
+					goto oom;
+				strcpy((char *)mime->node.key, ext);
+				ebst_insert(&cache.mime, &mime->node);
+			}
+			mime->type = strdup(type);
+			if (!mime->type)
+				goto oom;
+		}
+	}
+	fclose(f);
+	return 0;
+
+ oom:
+	memprintf(err, "out of memory while loading '%s'", file);
+ fail:
+	fclose(f);
+	return -1;
+}
+
+/* Formats the Date header with the current date, followed by each ending of
+ * the headers. Hits may still reference the previous one, which is fine since
+ * its length never changes. Does nothing within the same second.
+ */
+static void cache_update_date()
+{
+	char str[30];
+	int conn;
+
+	if (cache.date_sec == date.tv_sec)
+		return;
+
+	cache.date_sec = date.tv_sec;
+	cache_format_date(str, date.tv_sec);
+	for (conn = 0; conn < CACHE_CONN_MAX; conn++)
+		cache.date_len[conn] = snprintf(cache.date[conn], CACHE_DATE_LEN, "Date: %s\r\n%s",
+						str, cache_conn_hdr[conn]);
+}
+
+/* Task refreshing the Date header sent with the static objects at the
+ * beginning of every second.
+ */
+static struct task *cache_date_task(struct task *t)
+{
+	cache_update_date();
+	t->expire = tick_add(now_ms, MS_TO_TICKS(1000 - date.tv_usec / 1000));
+	return t;
+}
+
+/* Allocates a new object for file <path> of root <root> described by <st>
+ * whose body will be <len> bytes long once encoded with content coding <enc>
+ * (CACHE_ENC_*, or -1 for the identity), and precomputes its response headers
+ * and the ones of the 304 response. The Content-Type depends on the extension
+ * of <path>, which must be the one of the file not encoded. A "Vary" header
+ * is added if <vary> is non-zero. The object is placed in the shared memory
+ * area if <shared> is non-zero and it fits there. The Date is left to the
+ * hits. The body is allocated but left to be filled by the caller. Returns
+ * NULL on failure.
+ */
+static struct cache_obj *cache_new_obj(struct cache_root *root, const char *path,
+				       const struct stat *st, unsigned int len, int enc, int vary,
+				       int shared)
+{
+	char hdr[CACHE_LEN], nm[CACHE_LEN], etag[64], date[30], ext[64], cc[32];
+	struct cache_obj *obj;
+	int hlen, nlen, elen;
+
+	/* same validators as most web servers so that they remain valid when
+	 * the file is served from there. Encoded variants get their own tag.
+	 */
+	elen = snprintf(etag, sizeof(etag), "\"%lx-%llx-%lx%s%s\"",
+			(unsigned long)st->st_ino, (unsigned long long)st->st_size,
+			(unsigned long)st->st_mtime,
+			enc >= 0 ? "-" : "", enc >= 0 ? cache_enc[enc].name : "");
+	cache_format_date(date, st->st_mtime);
+
+	snprintf(ext, sizeof(ext), "%s%s%s%s",
+		 enc >= 0 ? "Content-Encoding: " : "", enc >= 0 ? cache_enc[enc].name : "",
+		 enc >= 0 ? "\r\n" : "", vary ? "Vary: Accept-Encoding\r\n" : "");
+
+	*cc = 0;
+	if (root->flags & CACHE_ROOT_F_MAX_AGE)
+		snprintf(cc, sizeof(cc), "Cache-Control: max-age=%u\r\n", root->max_age);
+
+	/* the ETag must remain the last header */
+	hlen = snprintf(hdr, sizeof(hdr), "%s%u\r\nContent-Type: %s\r\n%s%s"
+			"Last-Modified: %s\r\nETag: %s\r\n\r\n",
+			HTTP_200, len, cache_mime_type(path), ext, cc, date, etag);
+	if (hlen < 0 || hlen >= sizeof(hdr))
+		return NULL;
+
+	nlen = snprintf(nm, sizeof(nm), "%s%s%sLast-Modified: %s\r\nETag: %s\r\n\r\n",
+			HTTP_304, vary ? "Vary: Accept-Encoding\r\n" : "", cc, date, etag);
+	if (nlen < 0 || nlen >= sizeof(nm))
+		return NULL;
+
+	obj = NULL;
+	if (shared)
+		obj = cache_shm_alloc(((sizeof(*obj) + hlen + nlen + 15) & ~15UL) + len);
+	if (obj) {
+		obj->flags = CACHE_OBJ_F_SHM;
+		obj->body = (char *)obj + ((sizeof(*obj) + hlen + nlen + 15) & ~15UL);
+		obj->body_len = len;
+		if (len >= global.tune.bufsize)
+			obj->flags |= CACHE_OBJ_F_SPLICE;
+	}
+	else if ((obj = calloc(1, sizeof(*obj) + hlen + nlen)) == NULL)
+		return NULL;
+	obj->hdr = (char *)(obj + 1);
+	obj->hdr_len = hlen;
+	memcpy(obj->hdr, hdr, hlen);
+	obj->nm_hdr = obj->hdr + hlen;
+	obj->nm_len = nlen;
+	memcpy(obj->nm_hdr, nm, nlen);
+	obj->etag = obj->hdr + hlen - 4 - elen;
+	obj->etag_len = elen;
+	obj->flags |= CACHE_OBJ_F_DATE;
+	obj->mtime = st->st_mtime;
+	obj->ino = st->st_ino;
+	obj->size = st->st_size;
+	obj->refcnt = 1;
+
+	if (!(obj->flags & CACHE_OBJ_F_SHM) && cache_alloc_body(obj, len) < 0) {
+		free(obj);
+		return NULL;
+	}
+	if (obj->flags & CACHE_OBJ_F_SPLICE)
+		cache.mapped++;
+	return obj;
+}
+
+/* Makes the body of object <obj> read-only once it is filled. */
+static void cache_seal_obj(struct cache_obj *obj)
+{
+	/* pages referenced by a pipe must never change once spliced */
+	if (obj->flags & CACHE_OBJ_F_MMAP)
+		mprotect(obj->body, obj->body_len, PROT_READ);
+}
+
+/* Allocates a new object for regular file <path> of root <root> described by
+ * <st>, whose contents are encoded with content coding <enc>. <type_path> is
+ * the path of the file not encoded which gives the MIME type. See
+ * cache_new_obj() for the other arguments. The object remains pending until
+ * cache_fill_obj() reads its body. Returns the object, or NULL if memory is
+ * missing.
+ */
+static struct cache_obj *cache_file_obj(struct cache_root *root, const char *path,
+					const char *type_path, const struct stat *st,
+					int enc, int vary)
+{
+	struct cache_obj *obj;
+
+	/* only the files indexed before the fork are shared by all processes,
+	 * the reloaded ones use their own memory so that they may be released.
+	 */
+	obj = cache_new_obj(root, type_path, st, st->st_size, enc, vary, !cache.shm_sealed);
+	if (!obj)
+		return NULL;
+
+	obj->path = strdup(path);
+	if (!obj->path) {
+		cache_free_obj(obj);
+		return NULL;
+	}
+	obj->root = root;
+	obj->flags |= CACHE_OBJ_F_PENDING;
+	return obj;
+}
+
+/* Opens the file of pending object <obj> for reading. It is looked up from its
+ * root's directory when it was kept open, so that it is still found after the
+ * chroot. Returns the fd or -1.
+ */
+static int cache_open_obj(const struct cache_obj *obj)
+{
+	const struct cache_root *root = obj->root;
+	const char *rel;
+	int len;
+
+	if (root && root->dir_fd >= 0) {
+		len = strlen(root->dir);
+		if (strncmp(obj->path, root->dir, len) == 0) {
+			for (rel = obj->path + len; *rel == '/'; rel++);
+			if (*rel)
+				return openat(root->dir_fd, rel, O_RDONLY);
+		}
+	}
+	return open(obj->path, O_RDONLY);
+}
+
+/* Reads the body of pending object <obj> from its file, after which it may be
+ * served. Returns 0 on success or -1 if the file could not be read entirely,
+ * in which case the object is marked as failed and remains pending.
+ */
+static int cache_fill_obj(struct cache_obj *obj)
+{
+	size_t done;
+	ssize_t ret;
+	int fd;
+
+	done = 0;
+	fd = cache_open_obj(obj);
+	if (fd >= 0) {
+		while (done < obj->body_len) {
+			ret = read(fd, obj->body + done, obj->body_len - done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+			done += ret;
+		}
+		close(fd);
+	}
+
+	if (fd < 0 || done != obj->body_len) {
+		logging(INFO, "[readerr][file:%s]", obj->path);
+		obj->flags |= CACHE_OBJ_F_FAILED;
+		return -1;
+	}
+
+	cache_seal_obj(obj);
+	/* other processes may serve it as soon as the flag is seen */
+	__sync_synchronize();
+	obj->flags &= ~CACHE_OBJ_F_PENDING;
+	return 0;
+}
+
+/* Asks the kernel to start reading the files of pending object <obj> and of
+ * its pending variants, so that they are found in the page cache by the time
+ * the warm-up reads them.
+ */
+static void cache_prefetch_obj(struct cache_obj *obj)
+{
+#ifdef POSIX_FADV_WILLNEED
+	struct cache_obj *cur;
+	int enc, fd;
+
+	for (enc = -1; enc < CACHE_ENC_MAX; enc++) {
+		cur = enc < 0 ? obj : obj->variant[enc];
+		if (!cur || (cur->flags & (CACHE_OBJ_F_PENDING|CACHE_OBJ_F_FAILED)) != CACHE_OBJ_F_PENDING)
+			continue;
+		fd = cache_open_obj(cur);
+		if (fd < 0)
+			continue;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+#endif
+}
+
+#ifdef USE_ZLIB
+/* Returns a gzip encoded variant of static object <src>, or NULL if memory is
+ * missing or if it would not be smaller.
+ */
+static struct cache_obj *cache_gzip_obj(struct cache_obj *src)
+{
+	struct cache_obj *obj = NULL;
+	struct stat st;
+	z_stream z;
+	uLong max;
+	char *out;
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	max = deflateBound(&z, src->body_len);
+	out = malloc(max);
+	if (!out)
+		goto end;
+
+	z.next_in = (Bytef *)src->body;
+	z.avail_in = src->body_len;
+	z.next_out = (Bytef *)out;
+	z.avail_out = max;
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END || z.total_out >= src->body_len)
+		goto end;
+
+	/* same validators as the file it comes from */
+	memset(&st, 0, sizeof(st));
+	st.st_ino = src->ino;
+	st.st_size = src->size;
+	st.st_mtime = src->mtime;
+	obj = cache_new_obj(src->root, src->path, &st, z.total_out, CACHE_ENC_GZIP, 1,
+			    src->flags & CACHE_OBJ_F_SHM);
+	if (obj) {
+		obj->flags |= CACHE_OBJ_F_GEN;
+		memcpy(obj->body, out, z.total_out);
+		cache_seal_obj(obj);
+	}
+ end:
+	deflateEnd(&z);
+	free(out);
+	return obj;
+}
+#endif
+
+/* Returns non-zero if the file of path <path> is worth being compressed. Only
+ * text files are considered, based on their extension.
+ */
+static int cache_is_text(const char *path)
+{
+	static const char *ext[] = {
+		".html", ".htm", ".css", ".js", ".json", ".xml", ".txt", ".svg", NULL
+	};
+	const char *dot = strrchr(path, '.');
+	int i;
+
+	if (!dot || strchr(dot, '/'))
+		return 0;
+	for (i = 0; ext[i]; i++)
+		if (strcasecmp(dot, ext[i]) == 0)
+			return 1;
+	return 0;
+}
+
+/* Returns non-zero if file <path> is a precompressed variant of another file
+ * of the same directory, in which case it is not served under its own URI.
+ */
+static int cache_is_variant(const char *path)
+{
+	struct stat st;
+	char *base;
+	int enc, len, ret = 0;
+
+	len = strlen(path);
+	for (enc = 0; enc < CACHE_ENC_MAX; enc++) {
+		int elen = strlen(cache_enc[enc].ext);
+
+		if (len <= elen || strcmp(path + len - elen, cache_enc[enc].ext) != 0)
+			continue;
+		base = my_strndup(path, len - elen);
+		if (base) {
+			ret = stat(base, &st) == 0 && S_ISREG(st.st_mode);
+			free(base);
+		}
+		break;
+	}
+	return ret;
+}
+
+/* Returns non-zero if <size> more bytes may be loaded from root <root>. */
+static inline int cache_root_fits(struct cache_root *root, off_t size)
+{
+	if (size > INT_MAX - CACHE_LEN || (root->max_file && size > root->max_file))
+		return 0;
+	return !root->max_size || root->size + size <= root->max_size;
+}
+
+/* Returns the size accounted in its root for static object <obj>, that is the
+ * size of its body and of the ones of its variants.
+ */
+static unsigned long long cache_obj_size(const struct cache_obj *obj)
+{
+	unsigned long long size = obj->body_len;
+	int enc;
+
+	for (enc = 0; enc < CACHE_ENC_MAX; enc++)
+		if (obj->variant[enc])
+			size += obj->variant[enc]->body_len;
+	return size;
+}
+
+/* Returns non-zero if static object <obj> is still up to date with regular
+ * file <path> described by <st> and with its precompressed siblings, in which
+ * case a reload may keep it instead of reading the file again.
+ */
+static int cache_obj_fresh(const struct cache_obj *obj, const char *path, const struct stat *st)
+{
+	const struct cache_obj *var;
+	char *vpath = NULL;
+	struct stat vst;
+	int enc, ret = 0;
+
+	if (obj->ino != st->st_ino || obj->size != st->st_size || obj->mtime != st->st_mtime ||
+	    (obj->flags & CACHE_OBJ_F_FAILED))
+		return 0;
+
+	for (enc = 0; enc < CACHE_ENC_MAX; enc++) {
+		var = obj->variant[enc];
+		if (!memprintf(&vpath, "%s%s", path, cache_enc[enc].ext))
+			goto out;
+		if (stat(vpath, &vst) < 0 || !S_ISREG(vst.st_mode)) {
+			/* the sibling is gone */
+			if (var && !(var->flags & CACHE_OBJ_F_GEN))
+				goto out;
+			continue;
+		}
+		/* a sibling appeared or was updated */
+		if (!var || (var->flags & CACHE_OBJ_F_GEN) || var->ino != vst.st_ino ||
+		    var->size != vst.st_size || var->mtime != vst.st_mtime)
+			goto out;
+	}
+	ret = 1;
+ out:
+	free(vpath);
+	return ret;
+}
+
+/* Reads the bodies of pending static object <obj> and of its pending
+ * variants, then encodes its gzip variant if its root compresses it. Variants
+ * which cannot be read are dropped. Returns the number of bytes read.
+ */
+static unsigned int cache_warm_obj(struct cache_obj *obj)
+{
+	struct cache_root *root = obj->root;
+	struct cache_obj *var;
+	unsigned int done = 0;
+	int enc;
+
+	/* variants first since the object is served as soon as it is read */
+	for (enc = 0; enc < CACHE_ENC_MAX; enc++) {
+		var = obj->variant[enc];
+		if (!var || !(var->flags & CACHE_OBJ_F_PENDING))
+			continue;
+		if (cache_fill_obj(var) < 0) {
+			root->size -= var->body_len;
+			obj->variant[enc] = NULL;
+			cache_free_obj(var);
+			continue;
+		}
+		done += var->body_len;
+	}
+
+	if (cache_fill_obj(obj) < 0)
+		return done;
+	done += obj->body_len;
+
+#ifdef USE_ZLIB
+	if ((root->flags & CACHE_ROOT_F_COMPRESS) && !obj->variant[CACHE_ENC_GZIP] &&
+	    cache_is_text(obj->path)) {
+		var = cache_gzip_obj(obj);
+		if (var && !cache_root_fits(root, var->body_len)) {
+			cache_free_obj(var);
+			var = NULL;
+		}
+		if (var)
+			root->size += var->body_len;
+		__sync_synchronize();
+		obj->variant[CACHE_ENC_GZIP] = var;
+	}
+#endif
+	return done;
+}
+
+/* Returns a digest of the settings the headers and variants of file <path> of
+ * root <root> depend on : the root's compression and max-age, and the MIME
+ * type of the file. A snapshot record is only reused if it did not change.
+ */
+static unsigned int cache_snap_conf(const struct cache_root *root, const char *path)
+{
+	char conf[CACHE_LEN];
+	int len;
+
+	len = snprintf(conf, sizeof(conf), "%x %u %s",
+		       root->flags & (CACHE_ROOT_F_COMPRESS|CACHE_ROOT_F_MAX_AGE),
+		       root->max_age, cache_mime_type(path));
+	if (len < 0 || len >= sizeof(conf))
+		len = 0;
+	return hash_mem(conf, len);
+}
+
+/* Returns a new object for the snapshot record <rec> of a file or a variant,
+ * whose headers and body point into the snapshot mapping, with the variants
+ * whose records follow it. Returns NULL if memory is missing.
+ */
+static struct cache_obj *cache_snap_obj(const struct cache_snap_rec *rec, struct cache_root *root)
+{
+	struct cache_obj *obj, *var;
+	char *data = cache.snap_map + rec->data;
+	int i;
+
+	obj = calloc(1, sizeof(*obj));
+	if (!obj)
+		return NULL;
+
+	obj->flags = CACHE_OBJ_F_SNAP | CACHE_OBJ_F_DATE | (rec->flags & CACHE_OBJ_F_GEN);
+	if (rec->path_len) {
+		obj->path = strdup(data + rec->uri_len + 1);
+		if (!obj->path)
+			goto fail;
+	}
+	data += rec->uri_len + 1 + rec->path_len + 1;
+	obj->hdr = data;
+	obj->hdr_len = rec->hdr_len;
+	obj->nm_hdr = data + rec->hdr_len;
+	obj->nm_len = rec->nm_len;
+	obj->etag = obj->hdr + rec->etag;
+	obj->etag_len = rec->etag_len;
+	obj->body = cache.snap_map + rec->body;
+	obj->body_len = rec->body_len;
+	obj->ino = rec->ino;
+	obj->size = rec->size;
+	obj->mtime = rec->mtime;
+	obj->root = root;
+	obj->refcnt = 1;
+	if (obj->body_len >= global.tune.bufsize) {
+		obj->flags |= CACHE_OBJ_F_SPLICE;
+		cache.mapped++;
+	}
+
+	for (i = 1; i <= rec->nb_var; i++) {
+		var = cache_snap_obj(rec + i, root);
+		if (!var)
+			goto fail;
+		obj->variant[rec[i].enc] = var;
+	}
+	return obj;
+ fail:
+	cache_free_obj(obj);
+	return NULL;
+}
+
+/* Indexes regular file <path> described by <st> into table <tbl> under URI
+ * <uri>, accounting it in <root>, with its encoded variants : the sibling
+ * files named after it with a ".br" or ".gz" extension, or a gzip encoded copy
+ * if the root compresses text files. When the object found in table <old> for
+ * this URI is still up to date, it is shared instead of being read again.
+ * The same goes for the record found in the snapshot at startup. Otherwise the
+ * files are read at once, unless the warm-up task reads them.
+ * Files which do not fit in the root's limits are silently skipped. Returns 0
+ * on success or when the file was skipped, -1 if memory is missing.
+ */
+static int cache_load_file(struct cache_table *tbl, struct cache_table *old,
+			   struct cache_root *root, const char *path, const char *uri,
+			   const struct stat *st)
+{
+	struct cache_obj *obj, *var[CACHE_ENC_MAX];
+	unsigned long long size;
+	hash_elt_t *elt;
+	hash_key_t *key;
+	char *vpath = NULL;
+	struct stat vst;
+	int enc, vary = 0;
+
+	if (!cache_root_fits(root, st->st_size))
+		return 0;
+
+	key = cache_alloc_key(tbl);
+	if (!key)
+		return -1;
+
+	key->key.data = (u_char *)strdup(uri);
+	if (!key->key.data)
+		return -1;
+	key->key.len = strlen(uri) + 1;
+	key->key_hash = hap_hash_key(key->key.data, key->key.len);
+
+	elt = NULL;
+	if (old && old->hash)
+		elt = hap_hash_find(old->hash, key->key_hash, key->key.data, key->key.len);
+	if (elt && cache_obj_fresh(elt->value, path, st)) {
+		obj = elt->value;
+		size = cache_obj_size(obj);
+		if (!cache_root_fits(root, size))
+			goto out_skip_key;
+		cache_get_obj(obj);
+		tbl->reused++;
+		goto out_add;
+	}
+
+	/* at startup, the snapshot holds the files which did not change, as
+	 * long as the settings their headers were built with did not either.
+	 */
+	elt = NULL;
+	if (!old && cache.snap_hash)
+		elt = hap_hash_find(cache.snap_hash, key->key_hash, key->key.data, key->key.len);
+	if (elt && ((struct cache_snap_rec *)elt->value)->conf != cache_snap_conf(root, path))
+		elt = NULL;
+	if (elt) {
+		obj = cache_snap_obj(elt->value, root);
+		if (obj && cache_obj_fresh(obj, path, st)) {
+			size = cache_obj_size(obj);
+			if (cache_root_fits(root, size)) {
+				cache.snap_used++;
+				goto out_add;
+			}
+		}
+		cache_free_obj(obj);
+	}
+
+	memset(var, 0, sizeof(var));
+	size = st->st_size;
+	for (enc = 0; enc < CACHE_ENC_MAX; enc++) {
+		if (!memprintf(&vpath, "%s%s", path, cache_enc[enc].ext))
+			goto out_oom;
+		if (stat(vpath, &vst) < 0 || !S_ISREG(vst.st_mode) ||
+		    !cache_root_fits(root, size + vst.st_size))
+			continue;
+		var[enc] = cache_file_obj(root, vpath, path, &vst, enc, 1);
+		if (!var[enc])
+			goto out_oom;
+		size += vst.st_size;
+		vary = 1;
+	}
+	free(vpath);
+
+	if ((root->flags & CACHE_ROOT_F_COMPRESS) && !var[CACHE_ENC_GZIP] && cache_is_text(path))
+		vary = 1;
+
+	obj = cache_file_obj(root, path, path, st, -1, vary);
+	if (!obj) {
+		vpath = NULL;
+		goto out_oom;
+	}
+	memcpy(obj->variant, var, sizeof(var));
+
+ out_add:
+	key->value = obj;
+	key->vlen = obj->hdr_len + obj->body_len;
+
+	tbl->nb_keys++;
+	root->size += size;
+	root->files++;
+
+	if (!(cache.flags & CACHE_F_ASYNC) && (obj->flags & CACHE_OBJ_F_PENDING) &&
+	    cache_may_fill(obj))
+		cache_warm_obj(obj);
+	return 0;
+
+ out_oom:
+	free(vpath);
+	free(key->key.data);
+	for (enc = 0; enc < CACHE_ENC_MAX; enc++)
+		cache_free_obj(var[enc]);
+	return -1;
+
+ out_skip_key:
+	free(key->key.data);
+	return 0;
+}
+
+/* Recursively indexes directory <dir> of root <root> into table <tbl>, reusing
+ * the objects of table <old> which are still up to date. Its files are served
+ * under URI prefix <uri> (which ends with a '/'). Hidden files and directories
+ * are ignored. The directory is watched for changes when the cache is watching
+ * its roots. Returns 0 on success or -1 if memory is missing.
+ */
+static int cache_index_dir(struct cache_table *tbl, struct cache_table *old,
+			   struct cache_root *root, const char *dir, const char *uri)
+{
+	struct dirent *de;
+	struct stat st;
+	char *path = NULL, *name = NULL;
+	DIR *dp;
+	int err = 0;
+
+	dp = opendir(dir);
+	if (!dp) {
+		if (!old)
+			Warning("cache root '%s' (declared at %s:%d) : cannot open directory '%s' : %s.\n",
+				root->prefix, root->conf.file, root->conf.line, dir, strerror(errno));
+		return 0;
+	}
+
+#ifdef CONFIG_HAP_LINUX_INOTIFY
+	if (cache.watch_fd >= 0 &&
+	    inotify_add_watch(cache.watch_fd, dir,
+			      IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|
+			      IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR) < 0)
+		send_log(NULL, LOG_WARNING, "Cache root '%s' : cannot watch directory '%s' : %s.\n",
+			 root->prefix, dir, strerror(errno));
+#endif
+
+	while ((de = readdir(dp)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		if (!memprintf(&path, "%s/%s", dir, de->d_name)) {
+			err = -1;
+			break;
+		}
+
+		if (stat(path, &st) < 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			if (!memprintf(&name, "%s%s/", uri, de->d_name) ||
+			    cache_index_dir(tbl, old, root, path, name) < 0) {
+				err = -1;
+				break;
+			}
+		}
+		else if (S_ISREG(st.st_mode)) {
+			/* precompressed variants are loaded with their file */
+			if (cache_is_variant(path))
+				continue;
+			if (!memprintf(&name, "%s%s", uri, de->d_name) ||
+			    cache_load_file(tbl, old, root, path, name, &st) < 0) {
+				err = -1;
+				break;
+			}
+		}
+	}
+
+	free(path);
+	free(name);
+	closedir(dp);
+	return err;
+}
+
+/* Releases table <tbl> and drops its references on its objects. */
+static void cache_free_table(struct cache_table *tbl)
+{
+	int i;
+
+	for (i = 0; i < tbl->nb_keys; i++) {
+		free(tbl->keys[i].key.data);
+		cache_put_obj(tbl->keys[i].value);
+	}
+	free(tbl->keys);
+	hap_hash_free(tbl->hash);
+	free(tbl);
+}
+
+/* Drops a reference on table <tbl>, which is released with the last one. */
+static inline void cache_release_table(struct cache_table *tbl)
+{
+	if (--tbl->refcnt == 0)
+		cache_free_table(tbl);
+}
+
+/* Builds a new lookup table from the files of all configured cache roots,
+ * sharing the objects of table <old> (which may be NULL) which are still up to
+ * date. The roots' counters are updated. The table is returned with a single
+ * reference, or NULL if memory is missing. <err> is set to a message then.
+ */
+static struct cache_table *cache_build_table(struct cache_table *old, const char **err)
+{
+	struct cache_root *root;
+	struct cache_table *tbl;
+	struct timeval start, end;
+
+	tbl = calloc(1, sizeof(*tbl));
+	if (!tbl) {
+		*err = "out of memory";
+		return NULL;
+	}
+	tbl->refcnt = 1;
+
+	cache.load_time = 0;
+	list_for_each_entry(root, &cache.roots, list) {
+		root->size = 0;
+		root->files = 0;
+		gettimeofday(&start, NULL);
+		if (cache_index_dir(tbl, old, root, root->dir, root->prefix) < 0) {
+			*err = "out of memory while loading the files";
+			goto fail;
+		}
+		gettimeofday(&end, NULL);
+		root->load_time = tv_ms_elapsed(&start, &end);
+		cache.load_time += root->load_time;
+		logging(INFO, "[cache_build_table][root:%s][files:%u][size:%llu][ms:%u]",
+			root->prefix, root->files, root->size, root->load_time);
+	}
+
+	if (tbl->nb_keys) {
+		tbl->hash = hap_hash_init(tbl->keys, tbl->nb_keys);
+		if (!tbl->hash) {
+			*err = "cannot build the lookup table";
+			goto fail;
+		}
+	}
+	return tbl;
+
+ fail:
+	cache_free_table(tbl);
+	return NULL;
+}
+
+/* Starts reading the pending files of the current table in the background,
+ * restarting the warm-up in progress if any. Does nothing if the warm-up task
+ * is not running.
+ */
+static void cache_warm_start()
+{
+	struct cache_table *tbl = cache.table;
+	struct cache_obj *obj;
+	int i;
+
+	if (!cache.warm_task)
+		return;
+
+	cache.warm_pos = cache.warm_ahead = 0;
+	cache.warm_files = cache.warm_total = 0;
+	cache.warm_bytes = 0;
+	for (i = 0; i < tbl->nb_keys; i++) {
+		obj = tbl->keys[i].value;
+		if ((obj->flags & (CACHE_OBJ_F_PENDING|CACHE_OBJ_F_FAILED)) == CACHE_OBJ_F_PENDING)
+			cache.warm_total++;
+	}
+	if (!cache.warm_total)
+		return;
+
+	cache.warm_start = now;
+	cache.warm_report = tick_add(now_ms, MS_TO_TICKS(CACHE_WARM_REPORT));
+	send_log(NULL, LOG_INFO, "Cache warm-up started : %u files to read.\n", cache.warm_total);
+	task_wakeup(cache.warm_task, TASK_WOKEN_INIT);
+
+	/* the other processes rely on the writer to fill the shared objects,
+	 * so it must not leave before, even if it has no listener.
+	 */
+	if (cache.shm_area && !cache.warm_job) {
+		cache.warm_job = 1;
+		jobs++;
+	}
+}
+
+/* Task reading the pending files of the current table, a few of them per call
+ * so that the sessions are still processed meanwhile. The next files are
+ * prefetched so that the kernel reads them while the current ones are copied.
+ * The progress is reported every CACHE_WARM_REPORT ms.
+ */
+static struct task *cache_warm_task(struct task *t)
+{
+	struct cache_table *tbl = cache.table;
+	struct cache_obj *obj;
+	unsigned int bytes = 0;
+	int files = 0;
+
+	while (cache.warm_pos < tbl->nb_keys &&
+	       files < CACHE_WARM_FILES && bytes < CACHE_WARM_BYTES) {
+		while (cache.warm_ahead < tbl->nb_keys &&
+		       cache.warm_ahead < cache.warm_pos + CACHE_WARM_AHEAD)
+			cache_prefetch_obj(tbl->keys[cache.warm_ahead++].value);
+
+		obj = tbl->keys[cache.warm_pos++].value;
+		if ((obj->flags & (CACHE_OBJ_F_PENDING|CACHE_OBJ_F_FAILED)) != CACHE_OBJ_F_PENDING)
+			continue;
+		bytes += cache_warm_obj(obj);
+		files++;
+	}
+	cache.warm_files += files;
+	cache.warm_bytes += bytes;
+
+	if (cache.warm_pos < tbl->nb_keys) {
+		if (tick_is_expired(cache.warm_report, now_ms)) {
+			send_log(NULL, LOG_INFO, "Cache warm-up : %u/%u files read (%u%%), %llu bytes.\n",
+				 cache.warm_files, cache.warm_total,
+				 (unsigned int)(cache.warm_files * 100ULL / cache.warm_total),
+				 cache.warm_bytes);
+			cache.warm_report = tick_add(now_ms, MS_TO_TICKS(CACHE_WARM_REPORT));
+		}
+		task_wakeup(t, TASK_WOKEN_OTHER);
+		return t;
+	}
+
+	if (files || cache.warm_total) {
+		cache.warm_time = tv_ms_elapsed(&cache.warm_start, &now);
+		send_log(NULL, LOG_NOTICE, "Cache warm-up done : %u files, %llu bytes read in %u ms.\n",
+			 cache.warm_files, cache.warm_bytes, cache.warm_time);
+		cache.warm_total = 0;
+	}
+	if (cache.warm_job) {
+		cache.warm_job = 0;
+		jobs--;
+	}
+	return t;
+}
+
+/* Rebuilds the lookup table from the roots, only reading the files which
+ * changed since the current table was built, and swaps the tables. Sessions
+ * sending objects from the previous table keep it until they are done. The
+ * current table is kept if the new one cannot be built. Returns 0 on success
+ * or -1 on failure.
+ */
+int cache_reload()
+{
+	struct cache_table *tbl, *old = cache.table;
+	const char *err;
+
+	if (!old)
+		return 0;
+
+	tbl = cache_build_table(old, &err);
+	if (!tbl) {
+		send_log(NULL, LOG_ERR, "Cache reload failed : %s, keeping %d files.\n",
+			 err, old->nb_keys);
+		return -1;
+	}
+
+	cache.table = tbl;
+	cache.reloads++;
+	send_log(NULL, LOG_NOTICE, "Cache reloaded : %d files, %d read, %d removed.\n",
+		 tbl->nb_keys, tbl->nb_keys - tbl->reused, old->nb_keys - tbl->reused);
+	cache_release_table(old);
+	cache_warm_start();
+	return 0;
+}
+
+/* Removes from the store the responses whose URI is <uri>, or starts with it
+ * when it ends with a '*', whatever their host and encodings. The responses
+ * being sent are released once done. Returns the number of responses removed.
+ */
+int cache_purge(const char *uri)
+{
+	struct cache_entry *e, *back;
+	const char *key;
+	int len = strlen(uri);
+	int prefix = 0;
+	int count = 0;
+
+	if (len && uri[len - 1] == '*') {
+		prefix = 1;
+		len--;
+	}
+
+	list_for_each_entry_safe(e, back, &cache.lru, lru) {
+		key = (const char *)e->node.key + e->uri;
+		if (strncmp(key, uri, len) != 0)
+			continue;
+		if (!prefix && key[len] && key[len] != '\n')
+			continue;
+		cache_unlink_entry(e);
+		count++;
+	}
+	cache.purged += count;
+	return count;
+}
+
+#ifdef CONFIG_HAP_LINUX_INOTIFY
+/* I/O handler of the inotify fd : drains the events and schedules a reload
+ * once the changes settle. Always returns 0 since it reads until it would
+ * block.
+ */
+static int cache_watch_event(int fd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct task *t = cache.reload_task;
+	ssize_t ret;
+
+	while (1) {
+		ret = read(fd, buf, sizeof(buf));
+		if (ret > 0)
+			continue;
+		if (ret < 0 && errno == EINTR)
+			continue;
+		break;
+	}
+
+	if (!tick_isset(t->expire)) {
+		t->expire = tick_add(now_ms, MS_TO_TICKS(CACHE_RELOAD_DELAY));
+		task_queue(t);
+	}
+	return 0;
+}
+
+/* Task reloading the roots once their files have changed. */
+static struct task *cache_reload_task(struct task *t)
+{
+	t->expire = TICK_ETERNITY;
+	cache_reload();
+	return t;
+}
+
+/* Starts watching the cache roots for changes if enabled. It must be called
+ * by each process, after the fork. A first reload picks the changes which
+ * happened since the files were loaded and sets up the watches. Returns 0 on
+ * success or -1 on failure, in which case the roots are not watched.
+ */
+static int cache_start_watch()
+{
+	int fd;
+
+	if (!(cache.flags & CACHE_F_WATCH) || !cache.table)
+		return 0;
+
+	cache.reload_task = task_new();
+	if (!cache.reload_task)
+		goto fail;
+	cache.reload_task->process = cache_reload_task;
+	cache.reload_task->context = NULL;
+	cache.reload_task->expire = TICK_ETERNITY;
+
+	fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (fd < 0)
+		goto fail;
+	if (fd >= global.maxsock) {
+		close(fd);
+		goto fail;
+	}
+
+	fd_insert(fd);
+	fdtab[fd].owner = NULL;
+	fdtab[fd].cb[DIR_RD].f = cache_watch_event;
+	fdtab[fd].cb[DIR_WR].f = NULL; /* never called */
+	fdtab[fd].state = FD_STREADY;
+	fdtab[fd].flags = 0;
+	fdinfo[fd].peeraddr = NULL;
+	fdinfo[fd].peerlen = 0;
+	EV_FD_SET(fd, DIR_RD);
+	cache.watch_fd = fd;
+
+	cache_reload();
+	return 0;
+
+ fail:
+	if (cache.reload_task)
+		task_free(cache.reload_task);
+	cache.reload_task = NULL;
+	Warning("cache : cannot watch the roots for changes : %s.\n", strerror(errno));
+	return -1;
+}
+#else
+static inline int cache_start_watch()
+{
+	return 0;
+}
+#endif /* CONFIG_HAP_LINUX_INOTIFY */
+
+/* Starts the cache's background activities in the current process : the
+ * watching of the roots and the warm-up which reads the pending files. It must
+ * be called by each process, after the fork. Returns 0 on success or -1 on
+ * failure, in which case the files are read at once.
+ */
+int cache_start()
+{
+	struct cache_table *tbl = cache.table;
+	int i;
+
+	/* the static files and the negative responses are sent without Date */
+	if (tbl || cache.neg) {
+		cache_update_date();
+		cache.date_task = task_new();
+		if (cache.date_task) {
+			cache.date_task->process = cache_date_task;
+			cache.date_task->context = NULL;
+			cache.date_task->expire = TICK_ETERNITY;
+			task_wakeup(cache.date_task, TASK_WOKEN_INIT);
+		}
+		else
+			Warning("cache : cannot start the Date refresh task, the Date will not change.\n");
+	}
+
+	/* the shared objects are all indexed now */
+	cache.shm_sealed = 1;
+
+	if (!tbl)
+		return 0;
+
+	/* only the first process fills the shared objects, the other ones
+	 * read the files they reload themselves.
+	 */
+	if (cache.shm_area) {
+		cache.shm_writer = (relative_pid == 1);
+		if (!cache.shm_writer)
+			cache.flags &= ~CACHE_F_ASYNC;
+	}
+
+	cache_start_watch();
+
+	if (!(cache.flags & CACHE_F_ASYNC))
+		return 0;
+
+	cache.warm_task = task_new();
+	if (cache.warm_task) {
+		cache.warm_task->process = cache_warm_task;
+		cache.warm_task->context = NULL;
+		cache.warm_task->expire = TICK_ETERNITY;
+		cache_warm_start();
+		return 0;
+	}
+
+	Warning("cache : cannot start the warm-up task, reading the files at once.\n");
+	cache.flags &= ~CACHE_F_ASYNC;
+	for (i = 0; i < tbl->nb_keys; i++)
+		if (((struct cache_obj *)tbl->keys[i].value)->flags & CACHE_OBJ_F_PENDING)
+			cache_warm_obj(tbl->keys[i].value);
+	return -1;
+}
+
+/* Returns an upper bound of the shared memory needed by the files found below
+ * directory <dir> of root <root> : their size, the one of their gzip variant
+ * if the root compresses them, and their objects' headers.
+ */
+static unsigned long long cache_shm_scan(struct cache_root *root, const char *dir)
+{
+	unsigned long long size = 0;
+	struct dirent *de;
+	struct stat st;
+	char *path = NULL;
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (!dp)
+		return 0;
+
+	while ((de = readdir(dp)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (!memprintf(&path, "%s/%s", dir, de->d_name))
+			break;
+		if (stat(path, &st) < 0)
+			continue;
+		if (S_ISDIR(st.st_mode))
+			size += cache_shm_scan(root, path);
+		else if (S_ISREG(st.st_mode)) {
+			size += st.st_size + CACHE_SHM_OBJ;
+			if ((root->flags & CACHE_ROOT_F_COMPRESS) && cache_is_text(path))
+				size += st.st_size + CACHE_SHM_OBJ;
+		}
+	}
+
+	free(path);
+	closedir(dp);
+	return size;
+}
+
+/* Maps the memory area shared by all processes, sized after the files found
+ * below the roots. Pages which are never used cost nothing. Returns 0 on
+ * success or -1 on failure.
+ */
+static int cache_shm_init()
+{
+	struct cache_root *root;
+	unsigned long long size = 0;
+	char *area;
+
+	list_for_each_entry(root, &cache.roots, list)
+		size += cache_shm_scan(root, root->dir);
+
+	size += CACHE_SHM_OBJ;
+	if (size != (unsigned long)size)
+		return -1;
+
+	area = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED)
+		return -1;
+
+	cache.shm_area = area;
+	cache.shm_size = size;
+	cache.shm_used = 0;
+	cache.shm_writer = 1;
+	cache.shm_sealed = 0;
+	return 0;
+}
+
+/* Maps the snapshot file read-only and indexes its records by URI, after
+ * having checked that they all lie within the file. Returns 0 on success or
+ * -1 if the file is missing or cannot be used, in which case it is ignored.
+ */
+static int cache_snap_open()
+{
+	const struct cache_snap_hdr *hdr;
+	const struct cache_snap_rec *rec;
+	unsigned long long end;
+	struct stat st;
+	hash_key_t *key;
+	int fd, i, j, nb = 0;
+	char *data;
+
+	fd = open(cache.snap_path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+		close(fd);
+		goto bad;
+	}
+	cache.snap_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (cache.snap_map == MAP_FAILED) {
+		cache.snap_map = NULL;
+		goto bad;
+	}
+	cache.snap_size = st.st_size;
+
+	hdr = (struct cache_snap_hdr *)cache.snap_map;
+	if (memcmp(hdr->magic, CACHE_SNAP_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->rec_size != sizeof(*rec) || hdr->size != st.st_size ||
+	    hdr->nb_recs > (st.st_size - sizeof(*hdr)) / sizeof(*rec))
+		goto bad;
+
+	cache.snap_keys = calloc(hdr->nb_recs + 1, sizeof(*cache.snap_keys));
+	if (!cache.snap_keys)
+		goto bad;
+
+	rec = (struct cache_snap_rec *)(hdr + 1);
+	for (i = 0; i < hdr->nb_recs; i++, rec++) {
+		end = rec->data + rec->uri_len + 1 + rec->path_len + 1 + rec->hdr_len + rec->nm_len;
+		if (end > st.st_size || end < rec->data ||
+		    rec->body + rec->body_len > st.st_size || rec->body + rec->body_len < rec->body ||
+		    rec->etag + rec->etag_len > rec->hdr_len ||
+		    rec->enc < -1 || rec->enc >= CACHE_ENC_MAX)
+			goto bad;
+
+		data = cache.snap_map + rec->data;
+		if (data[rec->uri_len] || data[rec->uri_len + 1 + rec->path_len])
+			goto bad;
+
+		if (rec->enc >= 0) {
+			if (rec->nb_var)
+				goto bad;
+			continue;
+		}
+
+		/* only files are indexed, their variants follow them */
+		if (!rec->uri_len || !rec->path_len || rec->nb_var > hdr->nb_recs - i - 1)
+			goto bad;
+		for (j = 1; j <= rec->nb_var; j++)
+			if (rec[j].enc < 0)
+				goto bad;
+		key = &cache.snap_keys[nb++];
+		key->key.data = (u_char *)data;
+		key->key.len = rec->uri_len + 1;
+		key->key_hash = hap_hash_key(key->key.data, key->key.len);
+		key->value = (void *)rec;
+		key->vlen = rec->hdr_len + rec->body_len;
+	}
+
+	if (nb) {
+		cache.snap_hash = hap_hash_init(cache.snap_keys, nb);
+		if (!cache.snap_hash)
+			goto bad;
+	}
+	return 0;
+
+ bad:
+	Warning("cache : ignoring invalid snapshot file '%s'.\n", cache.snap_path);
+	free(cache.snap_keys);
+	cache.snap_keys = NULL;
+	if (cache.snap_map)
+		munmap(cache.snap_map, cache.snap_size);
+	cache.snap_map = NULL;
+	return -1;
+}
+
+/* Releases the snapshot index once the table is built, and the mapping too
+ * if no object was taken from it.
+ */
+static void cache_snap_close()
+{
+	hap_hash_free(cache.snap_hash);
+	cache.snap_hash = NULL;
+	free(cache.snap_keys);
+	cache.snap_keys = NULL;
+
+	if (cache.snap_map && !cache.snap_used) {
+		munmap(cache.snap_map, cache.snap_size);
+		cache.snap_map = NULL;
+	}
+}
+
+/* Writes <len> bytes from <buf> at offset <off> of file <fd>. Returns 0 on
+ * success or -1 on failure.
+ */
+static int cache_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf = (const char *)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+/* Fills snapshot record <rec> for object <obj> with URI <uri> (NULL for a
+ * variant) and writes its data and body to file <fd> at offsets <*data> and
+ * <*body>, which are then advanced. Returns 0 on success or -1 on failure.
+ */
+static int cache_snap_write_obj(int fd, struct cache_snap_rec *rec, const struct cache_obj *obj,
+				const char *uri, unsigned long long *data, unsigned long long *body)
+{
+	static const char zero = 0;
+	unsigned long long off;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->uri_len = uri ? strlen(uri) : 0;
+	rec->path_len = obj->path ? strlen(obj->path) : 0;
+	rec->hdr_len = obj->hdr_len;
+	rec->nm_len = obj->nm_len;
+	rec->etag = obj->etag - obj->hdr;
+	rec->etag_len = obj->etag_len;
+	rec->body_len = obj->body_len;
+	rec->ino = obj->ino;
+	rec->size = obj->size;
+	rec->mtime = obj->mtime;
+	rec->flags = obj->flags & CACHE_OBJ_F_GEN;
+	rec->enc = -1;
+
+	off = rec->data = *data;
+	if (cache_pwrite(fd, uri ? uri : "", rec->uri_len, off) < 0 ||
+	    cache_pwrite(fd, &zero, 1, off + rec->uri_len) < 0)
+		return -1;
+	off += rec->uri_len + 1;
+	if (cache_pwrite(fd, obj->path ? obj->path : "", rec->path_len, off) < 0 ||
+	    cache_pwrite(fd, &zero, 1, off + rec->path_len) < 0)
+		return -1;
+	off += rec->path_len + 1;
+	if (cache_pwrite(fd, obj->hdr, obj->hdr_len, off) < 0 ||
+	    cache_pwrite(fd, obj->nm_hdr, obj->nm_len, off + obj->hdr_len) < 0)
+		return -1;
+	*data = off + obj->hdr_len + obj->nm_len;
+
+	rec->body = *body;
+	if (cache_pwrite(fd, obj->body, obj->body_len, rec->body) < 0)
+		return -1;
+	*body += (obj->body_len + CACHE_SNAP_ALIGN - 1) & -(unsigned long long)CACHE_SNAP_ALIGN;
+	return 0;
+}
+
+/* Writes all the static objects which were read into the snapshot file, going
+ * through a temporary file so that processes mapping the previous one are not
+ * affected. Returns 0 on success or -1 on failure.
+ */
+int cache_save_snapshot()
+{
+	struct cache_table *tbl = cache.table;
+	struct cache_snap_hdr hdr;
+	struct cache_snap_rec *recs = NULL, *rec;
+	struct cache_obj *obj, *var;
+	unsigned long long data, body, size;
+	char *tmp = NULL;
+	int fd = -1, i, enc, nb = 0, ret = -1;
+
+	if (!cache.snap_path || !tbl)
+		return -1;
+
+	/* the header and the records come first, then their data, then the
+	 * bodies, whose offset is only known once the data size is.
+	 */
+	size = 0;
+	for (i = 0; i < tbl->nb_keys; i++) {
+		obj = tbl->keys[i].value;
+		if (obj->flags & CACHE_OBJ_F_PENDING)
+			continue;
+		nb++;
+		size += tbl->keys[i].key.len + strlen(obj->path) + 1 + obj->hdr_len + obj->nm_len;
+		for (enc = 0; enc < CACHE_ENC_MAX; enc++) {
+			var = obj->variant[enc];
+			if (!var || (var->flags & CACHE_OBJ_F_PENDING))
+				continue;
+			nb++;
+			size += 1 + (var->path ? strlen(var->path) : 0) + 1 + var->hdr_len + var->nm_len;
+		}
+	}
+
+	recs = calloc(nb + 1, sizeof(*recs));
+	if (!recs || !memprintf(&tmp, "%s.%d", cache.snap_path, (int)getpid()))
+		goto out;
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0)
+		goto out;
+
+	data = sizeof(hdr) + (unsigned long long)nb * sizeof(*recs);
+	body = (data + size + CACHE_SNAP_ALIGN - 1) & -(unsigned long long)CACHE_SNAP_ALIGN;
+
+	rec = recs;
+	for (i = 0; i < tbl->nb_keys; i++) {
+		struct cache_snap_rec *file = rec;
+
+		obj = tbl->keys[i].value;
+		if (obj->flags & CACHE_OBJ_F_PENDING)
+			continue;
+		if (cache_snap_write_obj(fd, rec++, obj, (char *)tbl->keys[i].key.data, &data, &body) < 0)
+			goto out;
+		file->conf = cache_snap_conf(obj->root, obj->path);
+		for (enc = 0; enc < CACHE_ENC_MAX; enc++) {
+			var = obj->variant[enc];
+			if (!var || (var->flags & CACHE_OBJ_F_PENDING))
+				continue;
+			if (cache_snap_write_obj(fd, rec, var, NULL, &data, &body) < 0)
+				goto out;
+			rec->enc = enc;
+			rec++;
+			file->nb_var++;
+		}
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_SNAP_MAGIC, sizeof(hdr.magic));
+	hdr.rec_size = sizeof(*recs);
+	hdr.nb_recs = nb;
+	hdr.size = body;
+	if (cache_pwrite(fd, &hdr, sizeof(hdr), 0) < 0 ||
+	    cache_pwrite(fd, recs, nb * sizeof(*recs), sizeof(hdr)) < 0 ||
+	    ftruncate(fd, body) < 0 || close(fd) < 0) {
+		fd = -1;
+		goto out;
+	}
+	fd = -1;
+
+	if (rename(tmp, cache.snap_path) < 0)
+		goto out;
+
+	send_log(NULL, LOG_NOTICE, "Cache snapshot saved to '%s' : %d objects, %llu bytes.\n",
+		 cache.snap_path, nb, body);
+	ret = 0;
+ out:
+	if (ret < 0) {
+		send_log(NULL, LOG_ERR, "Cache snapshot could not be saved to '%s' : %s.\n",
+			 cache.snap_path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		if (tmp)
+			unlink(tmp);
+	}
+	free(tmp);
+	free(recs);
+	return ret;
+}
+
+/* Loads the files of all configured cache roots and builds the lookup table.
+ * Returns 0 on success or -1 on fatal error. A root which cannot be read only
+ * emits a warning.
+ */
+int init_cache_file()
+{
+	struct cache_root *root;
+	const char *err;
+
+	pool2_cache_key = create_pool("cachekey", CACHE_KEY_LEN, MEM_F_SHARED);
+	pool2_cache_gen = create_pool("cachegen", global.tune.bufsize, MEM_F_SHARED);
+	if (!pool2_cache_key || !pool2_cache_gen) {
+		Alert("cache : out of memory.\n");
+		return -1;
+	}
+
+	if (!cache.max_obj)
+		cache.max_obj = CACHE_DEF_MAX_OBJ;
+	if (cache.max_obj > cache.max_mem)
+		cache.max_obj = cache.max_mem;
+
+	/* the frequency sketch has about one counter per page of max-memory */
+	if (cache.max_mem && !(cache.flags & CACHE_F_ADMIT_ALL)) {
+		unsigned int len = CACHE_SKETCH_MIN;
+
+		while (len < CACHE_SKETCH_MAX && len < cache.max_mem / CACHE_SKETCH_MEM)
+			len <<= 1;
+		cache.sketch = calloc(CACHE_SKETCH_ROWS, len);
+		if (!cache.sketch) {
+			Alert("cache : out of memory.\n");
+			return -1;
+		}
+		cache.sketch_mask = len - 1;
+	}
+
+	if (cache.neg_ttl) {
+		unsigned int len = 1;
+
+		while (len < (cache.neg_entries ? cache.neg_entries : CACHE_DEF_NEG_ENTRIES))
+			len <<= 1;
+		cache.neg = calloc(len, sizeof(*cache.neg));
+		if (!cache.neg) {
+			Alert("cache : out of memory.\n");
+			return -1;
+		}
+		cache.neg_mask = len - 1;
+	}
+
+	if (LIST_ISEMPTY(&cache.roots))
+		return 0;
+
+	/* The files are read in the background once the processes are started.
+	 * The roots are kept open so that their files are still found after the
+	 * chroot, otherwise they are read at once. With several processes, they
+	 * are placed in memory shared by all of them, or read before the fork if
+	 * it is not available so that pages are still shared.
+	 */
+	cache.flags |= CACHE_F_ASYNC;
+	list_for_each_entry(root, &cache.roots, list) {
+		root->dir_fd = open(root->dir, O_RDONLY | O_DIRECTORY);
+		if (root->dir_fd >= 0) {
+			fcntl(root->dir_fd, F_SETFD, FD_CLOEXEC);
+			global.maxsock++;
+		}
+		else if (global.chroot) {
+			Warning("cache root '%s' (declared at %s:%d) : cannot keep directory '%s' open (%s), "
+				"the files are read before the chroot.\n",
+				root->prefix, root->conf.file, root->conf.line, root->dir, strerror(errno));
+			cache.flags &= ~CACHE_F_ASYNC;
+		}
+	}
+
+	if (global.nbproc > 1 && cache_shm_init() < 0) {
+		Warning("cache : cannot allocate the shared memory, the files are read before the fork.\n");
+		cache.flags &= ~CACHE_F_ASYNC;
+	}
+
+	if (cache.snap_path)
+		cache_snap_open();
+
+	cache.table = cache_build_table(NULL, &err);
+	cache_snap_close();
+	if (!cache.table) {
+		Alert("cache : %s.\n", err);
+		return -1;
+	}
+	if (cache.snap_used)
+		logging(INFO, "[init_cache_file][snapshot:%s][objects:%u]", cache.snap_path, cache.snap_used);
+
+	if (cache.flags & CACHE_F_WATCH) {
+		/* the roots would not be found anymore once chrooted */
+		if (global.chroot) {
+			Warning("cache : 'watch' is ignored when 'chroot' is set.\n");
+			cache.flags &= ~CACHE_F_WATCH;
+		}
+		else
+			global.maxsock++; /* the inotify fd */
+	}
+	return 0;
+}
+
+/* Releases everything allocated for the cache, including its configuration. */
+void deinit_cache_file()
+{
+	struct cache_root *root, *back;
+	struct ebmb_node *node;
+
+	if (cache.snap_path)
+		cache_save_snapshot();
+
+	if (cache.table)
+		cache_free_table(cache.table);
+	cache.table = NULL;
+	cache.mapped = 0;
+
+	if (cache.snap_map)
+		munmap(cache.snap_map, cache.snap_size);
+	cache.snap_map = NULL;
+	if (cache.shm_area)
+		munmap(cache.shm_area, cache.shm_size);
+	cache.shm_area = NULL;
+	free(cache.snap_path);
+	cache.snap_path = NULL;
+
+	if (cache.watch_fd >= 0) {
+		fd_delete(cache.watch_fd);
+		cache.watch_fd = -1;
+	}
+	if (cache.reload_task) {
+		task_delete(cache.reload_task);
+		task_free(cache.reload_task);
+		cache.reload_task = NULL;
+	}
+	if (cache.warm_task) {
+		task_delete(cache.warm_task);
+		task_free(cache.warm_task);
+		cache.warm_task = NULL;
+	}
+	if (cache.date_task) {
+		task_delete(cache.date_task);
+		task_free(cache.date_task);
+		cache.date_task = NULL;
+	}
+
+	while ((node = ebmb_first(&cache.mime)) != NULL) {
+		struct cache_mime *mime = ebmb_entry(node, struct cache_mime, node);
+
+		ebmb_delete(node);
+		free(mime->type);
+		free(mime);
+	}
+
+	while (!LIST_ISEMPTY(&cache.lru))
+		cache_unlink_entry(LIST_ELEM(cache.lru.n, struct cache_entry *, lru));
+	free(cache.sketch);
+	cache.sketch = NULL;
+	free(cache.neg);
+	cache.neg = NULL;
+
+	list_for_each_entry_safe(root, back, &cache.roots, list) {
+		LIST_DEL(&root->list);
+		if (root->dir_fd >= 0)
+			close(root->dir_fd);
+		free(root->prefix);
+		free(root->dir);
+		free(root);
+	}
+}
+
+/* Releases entry <e> and everything it holds. */
+static void cache_free_entry(struct cache_entry *e)
+{
+	if (e->obj.body)
+		cache_free_body(&e->obj);
+	free(e->obj.hdr);
+	free(e->obj.nm_hdr);
+	free(e);
+}
+
+/* Removes entry <e> from the store. It is released immediately unless some
+ * sessions are still sending it, in which case the last one will do it.
+ */
+static void cache_unlink_entry(struct cache_entry *e)
+{
+	ebmb_delete(&e->node);
+	LIST_DEL(&e->lru);
+	cache.mem_used -= e->size;
+	cache.entries--;
+	e->flags |= CACHE_ENT_F_DELETED;
+	if (!e->refcnt)
+		cache_free_entry(e);
+}
+
+/* Drops a reference to entry <e>, releasing it if it was the last one on an
+ * entry which was removed from the store.
+ */
+static void cache_release_entry(struct cache_entry *e)
+{
+	if (!--e->refcnt && (e->flags & CACHE_ENT_F_DELETED))
+		cache_free_entry(e);
+}
+
+/* Returns the index in row <row> of the frequency sketch of the counter for
+ * key hash <hash>. Each row mixes the hash with its own odd multiplier.
+ */
+static inline unsigned int cache_sketch_idx(unsigned int hash, int row)
+{
+	static const unsigned int seed[CACHE_SKETCH_ROWS] = {
+		0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F,
+	};
+	unsigned int x = hash * seed[row];
+
+	return (x ^ (x >> 15)) & cache.sketch_mask;
+}
+
+/* Returns the estimated number of recent requests for key hash <hash> : the
+ * lowest of its counters, which may only overestimate it.
+ */
+static unsigned int cache_sketch_get(unsigned int hash)
+{
+	unsigned int row, val, min = 255;
+
+	for (row = 0; row < CACHE_SKETCH_ROWS; row++) {
+		val = cache.sketch[row * (cache.sketch_mask + 1) + cache_sketch_idx(hash, row)];
+		if (val < min)
+			min = val;
+	}
+	return min;
+}
+
+/* Records a request for key hash <hash> in the frequency sketch. All counters
+ * are halved once every CACHE_SKETCH_AGE requests per counter, so that the
+ * frequencies only reflect the recent requests.
+ */
+static void cache_sketch_add(unsigned int hash)
+{
+	unsigned int row, len = cache.sketch_mask + 1;
+	unsigned char *cnt;
+
+	for (row = 0; row < CACHE_SKETCH_ROWS; row++) {
+		cnt = &cache.sketch[row * len + cache_sketch_idx(hash, row)];
+		if (*cnt < 255)
+			(*cnt)++;
+	}
+
+	if (++cache.sketch_adds < CACHE_SKETCH_AGE * len)
+		return;
+
+	for (row = 0; row < CACHE_SKETCH_ROWS * len; row++)
+		cache.sketch[row] >>= 1;
+	cache.sketch_adds /= 2;
+}
+
+/* Returns non-zero if entry <e> may be stored in place of the least recently
+ * used entries which must be evicted to make room for it, besides <old> which
+ * it replaces. It is refused if one of them which has not expired was
+ * requested at least as often recently, so that responses requested once and
+ * large ones which would evict many small ones do not replace the hot ones.
+ */
+static int cache_admit(struct cache_entry *e, struct cache_entry *old)
+{
+	struct cache_entry *v;
+	unsigned long long room;
+	unsigned int freq;
+
+	room = cache.max_mem - cache.mem_used;
+	if (old)
+		room += old->size;
+	if (room >= e->size || !cache.sketch)
+		return 1;
+
+	freq = cache_sketch_get(e->hash);
+	list_for_each_entry(v, &cache.lru, lru) {
+		if (v == old)
+			continue;
+		if (!tick_is_expired(v->expire, now_ms) && cache_sketch_get(v->hash) >= freq)
+			return 0;
+		room += v->size;
+		if (room >= e->size)
+			break;
+	}
+	return 1;
+}
+
+/* Returns the valid entry stored under NUL-terminated key <key>, or NULL. The
+ * entry may have expired but still be served stale. Entries which may not be
+ * served anymore are removed on the fly.
+ */
+static struct cache_entry *cache_lookup_entry(const char *key)
+{
+	struct ebmb_node *node;
+	struct cache_entry *e;
+
+	node = ebst_lookup(&cache.store, key);
+	if (!node)
+		return NULL;
+
+	e = ebmb_entry(node, struct cache_entry, node);
+	if (tick_is_expired(e->stale, now_ms)) {
+		cache_unlink_entry(e);
+		return NULL;
+	}
+	return e;
+}
+
+/* Releases the fill owned by the transaction of session <s> if any, and wakes
+ * up the sessions waiting for it so that they look the cache up again. It is
+ * called as soon as the response is stored or is known not to be.
+ */
+static void cache_release_fill(struct session *s)
+{
+	struct cache_fill *fill = s->ctxn.fill;
+	struct session *w;
+
+	if (!fill)
+		return;
+
+	s->ctxn.fill = NULL;
+	ebmb_delete(&fill->node);
+	while (!LIST_ISEMPTY(&fill->waiters)) {
+		w = LIST_ELEM(fill->waiters.n, struct session *, ctxn.wait);
+		LIST_DEL(&w->ctxn.wait);
+		w->ctxn.flags &= ~CACHE_TXN_F_WAITING;
+		w->req->flags |= BF_WAKE_ONCE;
+		task_wakeup(w->task, TASK_WOKEN_MSG);
+	}
+	free(fill);
+}
+
+/* Called when the request of session <s> missed the cache. If the same request
+ * is already being fetched by another session whose response may be stored,
+ * <s> is queued to wait for it, which it only does once, and 1 is returned.
+ * Otherwise <s> may become the session fetching it, and 0 is returned.
+ */
+static int cache_wait_fill(struct session *s)
+{
+	struct cache_txn *ct = &s->ctxn;
+	struct ebmb_node *node;
+	struct cache_fill *fill;
+
+	if (!cache.lock_timeout || !cache.max_mem || !(s->be->options2 & PR_O2_HTTP_CACHE) ||
+	    s->txn.meth != HTTP_METH_GET || (ct->flags & (CACHE_TXN_F_NOSTORE|CACHE_TXN_F_WAITED)))
+		return 0;
+
+	node = ebst_lookup(&cache.fills, ct->key);
+	if (node) {
+		if (ct->flags & CACHE_TXN_F_NOLOOKUP)
+			return 0;
+		fill = ebmb_entry(node, struct cache_fill, node);
+		LIST_ADDQ(&fill->waiters, &ct->wait);
+		ct->flags |= CACHE_TXN_F_WAITING | CACHE_TXN_F_WAITED;
+		s->req->analyse_exp = tick_add(now_ms, MS_TO_TICKS(cache.lock_timeout));
+		logging(TRACE, "[cache_wait_fill][key:%s]", ct->key);
+		return 1;
+	}
+
+	/* conditional and range requests get responses which are not stored */
+	if (ct->inm_len || ct->ims || ct->range)
+		return 0;
+
+	fill = calloc(1, sizeof(*fill) + ct->vlen + 1);
+	if (!fill)
+		return 0;
+	LIST_INIT(&fill->waiters);
+	memcpy(fill->node.key, ct->key, ct->vlen + 1);
+	ebst_insert(&cache.fills, &fill->node);
+	ct->fill = fill;
+	return 0;
+}
+
+/* Copies the whole value of the header line found in <ctx> at offset <*len>
+ * of cache key <key>, followed by a NUL, and updates <*len>. Its length is
+ * stored into <vlen>. Returns the offset of the value, or 0 if it does not
+ * fit.
+ */
+static int cache_keep_value(char *key, int *len, struct hdr_ctx *ctx,
+			    struct hdr_idx *idx, int *vlen)
+{
+	int pos = *len + 1;
+	int l = idx->v[ctx->idx].len - ctx->val;
+
+	while (l > 0 && HTTP_IS_SPHT(ctx->line[ctx->val + l - 1]))
+		l--;
+
+	if (pos + l + 1 > CACHE_KEY_LEN)
+		return 0;
+	memcpy(key + pos, ctx->line + ctx->val, l);
+	key[pos + l] = 0;
+	*len = pos + l;
+	*vlen = l;
+	return pos;
+}
+
+/* Computes the cache key of the request in <req> whose headers were just
+ * parsed, and records what the request says about caching. Only GET and HEAD
+ * requests get a key. Nothing is done if the key does not fit in
+ * CACHE_KEY_LEN bytes.
+ */
+void cache_prepare_request(struct session *s, struct buffer *req)
+{
+	struct http_txn *txn = &s->txn;
+	struct http_msg *msg = &txn->req;
+	struct cache_txn *ct = &s->ctxn;
+	const char *uri = req->p + msg->sl.rq.u;
+	int uri_len = msg->sl.rq.u_l;
+	struct hdr_ctx ctx;
+	char *key;
+	int len, i;
+
+	if (ct->key || (txn->meth != HTTP_METH_GET && txn->meth != HTTP_METH_HEAD))
+		return;
+
+	if (!cache.table && !cache.max_mem && !cache.neg)
+		return;
+
+	key = pool_alloc2(pool2_cache_key);
+	if (!key)
+		return;
+
+	/* host names are case insensitive */
+	len = 0;
+	ctx.idx = 0;
+	if (http_find_header2("Host", 4, req->p, &txn->hdr_idx, &ctx)) {
+		if (ctx.vlen >= CACHE_KEY_LEN)
+			goto fail;
+		for (i = 0; i < ctx.vlen; i++)
+			key[len++] = tolower((unsigned char)ctx.line[ctx.val + i]);
+	}
+
+	if (len + uri_len + 2 > CACHE_KEY_LEN)
+		goto fail;
+	ct->uri = len;
+	memcpy(key + len, uri, uri_len);
+	for (i = 0; i < uri_len && uri[i] != '?'; i++)
+		;
+	ct->path_len = i;
+	len += uri_len;
+	ct->len = len;
+	key[len++] = '\n';
+
+	/* the encodings are concatenated without spaces */
+	ctx.idx = 0;
+	while (http_find_header2("Accept-Encoding", 15, req->p, &txn->hdr_idx, &ctx)) {
+		if (len + ctx.vlen + 2 > CACHE_KEY_LEN)
+			goto fail;
+		if (key[len - 1] != '\n')
+			key[len++] = ',';
+		for (i = 0; i < ctx.vlen; i++)
+			if (!HTTP_IS_SPHT(ctx.line[ctx.val + i]))
+				key[len++] = tolower((unsigned char)ctx.line[ctx.val + i]);
+	}
+	key[len] = 0;
+	ct->vlen = len;
+
+	/* responses to authenticated requests are private */
+	ctx.idx = 0;
+	if (http_find_header2("Authorization", 13, req->p, &txn->hdr_idx, &ctx))
+		ct->flags |= CACHE_TXN_F_NOSTORE;
+
+	ctx.idx = 0;
+	while (http_find_header2("Cache-Control", 13, req->p, &txn->hdr_idx, &ctx)) {
+		if (ctx.vlen == 8 && strncasecmp(ctx.line + ctx.val, "no-cache", 8) == 0)
+			ct->flags |= CACHE_TXN_F_NOLOOKUP;
+		else if (ctx.vlen == 8 && strncasecmp(ctx.line + ctx.val, "no-store", 8) == 0)
+			ct->flags |= CACHE_TXN_F_NOSTORE;
+	}
+
+	ctx.idx = 0;
+	while (http_find_header2("Pragma", 6, req->p, &txn->hdr_idx, &ctx)) {
+		if (ctx.vlen == 8 && strncasecmp(ctx.line + ctx.val, "no-cache", 8) == 0)
+			ct->flags |= CACHE_TXN_F_NOLOOKUP;
+	}
+
+	/* the validators of conditional requests are kept after the key. An
+	 * If-None-Match header which does not fit is never satisfied.
+	 */
+	ct->inm = ++len;
+	ctx.idx = 0;
+	while (http_find_header2("If-None-Match", 13, req->p, &txn->hdr_idx, &ctx)) {
+		if (len + ctx.vlen + 1 > CACHE_KEY_LEN) {
+			ct->inm_len = -1;
+			break;
+		}
+		if (len > ct->inm)
+			key[len++] = ',';
+		memcpy(key + len, ctx.line + ctx.val, ctx.vlen);
+		len += ctx.vlen;
+		ct->inm_len = len - ct->inm;
+	}
+
+	/* dates contain a comma, so the whole line is considered */
+	ctx.idx = 0;
+	if (http_find_header2("If-Modified-Since", 17, req->p, &txn->hdr_idx, &ctx))
+		ct->ims = cache_parse_date(ctx.line + ctx.val,
+					   txn->hdr_idx.v[ctx.idx].len - ctx.val);
+	if (ct->ims < 0)
+		ct->ims = 0;
+
+	/* ranges are only honored for GET requests, and ignored if they do
+	 * not fit.
+	 */
+	ctx.idx = 0;
+	if (txn->meth == HTTP_METH_GET &&
+	    http_find_header2("Range", 5, req->p, &txn->hdr_idx, &ctx)) {
+		ct->range = cache_keep_value(key, &len, &ctx, &txn->hdr_idx, &ct->range_len);
+		ctx.idx = 0;
+		if (ct->range && http_find_header2("If-Range", 8, req->p, &txn->hdr_idx, &ctx)) {
+			ct->if_range = cache_keep_value(key, &len, &ctx, &txn->hdr_idx, &ct->if_range_len);
+			if (!ct->if_range)
+				ct->range = 0;
+		}
+	}
+
+	ct->key = key;
+	return;
+ fail:
+	pool_free2(pool2_cache_key, key);
+}
+
+/* Compares the <len1> bytes entity tag <tag1> with the <len2> bytes <tag2>
+ * using the weak comparison function. Returns non-zero if they match.
+ */
+static int cache_etag_match(const char *tag1, int len1, const char *tag2, int len2)
+{
+	if (len1 > 2 && tag1[0] == 'W' && tag1[1] == '/') {
+		tag1 += 2;
+		len1 -= 2;
+	}
+	if (len2 > 2 && tag2[0] == 'W' && tag2[1] == '/') {
+		tag2 += 2;
+		len2 -= 2;
+	}
+	return len1 == len2 && memcmp(tag1, tag2, len1) == 0;
+}
+
+/* Returns non-zero if the request of session <s> is a conditional request
+ * which object <obj> satisfies, in which case a 304 response may be sent
+ * instead of the object. If-None-Match has precedence over If-Modified-Since.
+ */
+static int cache_not_modified(struct session *s, struct cache_obj *obj)
+{
+	struct cache_txn *ct = &s->ctxn;
+	const char *p, *end, *tag;
+
+	if (!obj->nm_hdr)
+		return 0;
+
+	if (ct->inm_len) {
+		if (ct->inm_len < 0)
+			return 0;
+
+		p = ct->key + ct->inm;
+		end = p + ct->inm_len;
+		while (p < end) {
+			for (tag = p; p < end && *p != ','; p++)
+				;
+			if ((p - tag == 1 && *tag == '*') ||
+			    (obj->etag && cache_etag_match(tag, p - tag, obj->etag, obj->etag_len)))
+				return 1;
+			p++;
+		}
+		return 0;
+	}
+
+	return ct->ims && obj->mtime != -1 && obj->mtime <= ct->ims;
+}
+
+/* Records the 404 or 410 response in <rep> to the request of session <s> in
+ * the negative cache, replacing the one in the same slot. Responses which may
+ * not be shared or with a cookie are ignored. A shorter "max-age" or
+ * "s-maxage" Cache-Control directive takes precedence over "negative-ttl".
+ */
+static void cache_store_neg(struct session *s, struct buffer *rep)
+{
+	struct http_txn *txn = &s->txn;
+	struct cache_txn *ct = &s->ctxn;
+	struct cache_neg *neg;
+	struct hdr_ctx ctx;
+	const char *val;
+	unsigned int hash;
+	int ttl = cache.neg_ttl;
+
+	ctx.idx = 0;
+	while (http_find_header2("Cache-Control", 13, rep->p, &txn->hdr_idx, &ctx)) {
+		val = ctx.line + ctx.val;
+		if ((ctx.vlen >= 8 && strncasecmp(val, "no-cache", 8) == 0) ||
+		    (ctx.vlen >= 8 && strncasecmp(val, "no-store", 8) == 0) ||
+		    (ctx.vlen >= 7 && strncasecmp(val, "private", 7) == 0))
+			return;
+		if (ctx.vlen > 9 && strncasecmp(val, "s-maxage=", 9) == 0 &&
+		    strl2ic(val + 9, ctx.vlen - 9) * 1000LL < ttl)
+			ttl = strl2ic(val + 9, ctx.vlen - 9) * 1000;
+		else if (ctx.vlen > 8 && strncasecmp(val, "max-age=", 8) == 0 &&
+			 strl2ic(val + 8, ctx.vlen - 8) * 1000LL < ttl)
+			ttl = strl2ic(val + 8, ctx.vlen - 8) * 1000;
+	}
+	if (ttl <= 0)
+		return;
+
+	ctx.idx = 0;
+	if (http_find_header2("Set-Cookie", 10, rep->p, &txn->hdr_idx, &ctx))
+		return;
+
+	hash = hash_mem(ct->key, ct->len);
+	neg = &cache.neg[hash & cache.neg_mask];
+	neg->hash = hash;
+	neg->expire = tick_add(now_ms, MS_TO_TICKS(ttl));
+	neg->status = (txn->status == 410) ? CACHE_NEG_410 : CACHE_NEG_404;
+}
+
+/* Removes the key of the request of session <s> from the negative cache, once
+ * a server sent something else than a 404 or 410 response for it.
+ */
+static void cache_forget_neg(struct session *s)
+{
+	struct cache_txn *ct = &s->ctxn;
+	struct cache_neg *neg;
+	unsigned int hash;
+
+	hash = hash_mem(ct->key, ct->len);
+	neg = &cache.neg[hash & cache.neg_mask];
+	if (neg->hash == hash)
+		neg->status = CACHE_NEG_NONE;
+}
+
+/* Returns the error response to send to the request of session <s> if its
+ * backend has "option http-cache" and its key is in the negative cache,
+ * otherwise NULL. Expired slots are freed.
+ */
+static struct cache_obj *cache_lookup_neg(struct session *s)
+{
+	struct cache_txn *ct = &s->ctxn;
+	struct cache_neg *neg;
+	unsigned int hash;
+
+	if (!cache.neg || !(s->be->options2 & PR_O2_HTTP_CACHE) ||
+	    (ct->flags & CACHE_TXN_F_NOLOOKUP))
+		return NULL;
+
+	hash = hash_mem(ct->key, ct->len);
+	neg = &cache.neg[hash & cache.neg_mask];
+	if (neg->status == CACHE_NEG_NONE || neg->hash != hash)
+		return NULL;
+
+	if (tick_is_expired(neg->expire, now_ms)) {
+		neg->status = CACHE_NEG_NONE;
+		return NULL;
+	}
+	return &cache_neg_obj[neg->status];
+}
+
+/* Checks whether the response in <rep> whose headers were just processed may
+ * be stored in the cache, and if so for how long. Only complete 200 responses
+ * to GET requests with a known length, a positive "s-maxage" or "max-age" and
+ * no cookie are stored. The only supported "Vary" header is Accept-Encoding,
+ * in which case the response is stored for the request's encodings only.
+ */
+void cache_check_response(struct session *s, struct buffer *rep)
+{
+	struct http_txn *txn = &s->txn;
+	struct cache_txn *ct = &s->ctxn;
+	struct hdr_ctx ctx;
+	const char *val;
+	int ttl = -1, smaxage = -1, vary = 0;
+
+	ct->ttl = 0;
+	ct->swr = -1;
+	if (cache.neg && ct->key) {
+		if ((txn->status == 404 || txn->status == 410) && !(ct->flags & CACHE_TXN_F_NOSTORE))
+			cache_store_neg(s, rep);
+		else
+			cache_forget_neg(s);
+	}
+
+	if (!cache.max_mem || !ct->key || (ct->flags & CACHE_TXN_F_NOSTORE))
+		goto out;
+
+	if (txn->meth != HTTP_METH_GET || txn->status != 200)
+		goto out;
+
+	if (!(txn->flags & TX_CACHEABLE) || (txn->flags & TX_SCK_PRESENT))
+		goto out;
+
+	if ((txn->rsp.flags & (HTTP_MSGF_CNT_LEN|HTTP_MSGF_TE_CHNK)) != HTTP_MSGF_CNT_LEN ||
+	    txn->rsp.body_len > cache.max_obj)
+		goto out;
+
+	ctx.idx = 0;
+	while (http_find_header2("Cache-Control", 13, rep->p, &txn->hdr_idx, &ctx)) {
+		val = ctx.line + ctx.val;
+		if (ctx.vlen > 9 && strncasecmp(val, "s-maxage=", 9) == 0)
+			smaxage = strl2ic(val + 9, ctx.vlen - 9);
+		else if (ctx.vlen > 8 && strncasecmp(val, "max-age=", 8) == 0)
+			ttl = strl2ic(val + 8, ctx.vlen - 8);
+		else if (ctx.vlen > 23 && strncasecmp(val, "stale-while-revalidate=", 23) == 0)
+			ct->swr = strl2ic(val + 23, ctx.vlen - 23);
+		else if (ctx.vlen >= 8 && strncasecmp(val, "no-cache", 8) == 0)
+			goto out;
+	}
+
+	if (smaxage >= 0)
+		ttl = smaxage;
+	if (ttl <= 0)
+		goto out;
+
+	/* cookies must never be shared between clients */
+	ctx.idx = 0;
+	if (http_find_header2("Set-Cookie", 10, rep->p, &txn->hdr_idx, &ctx))
+		goto out;
+
+	ctx.idx = 0;
+	while (http_find_header2("Vary", 4, rep->p, &txn->hdr_idx, &ctx)) {
+		if (ctx.vlen != 15 || strncasecmp(ctx.line + ctx.val, "Accept-Encoding", 15) != 0)
+			goto out;
+		vary = 1;
+	}
+
+	ct->ttl = ttl;
+	ct->vary = vary;
+	return;
+ out:
+	/* the sessions waiting for this response will not find it */
+	cache_release_fill(s);
+}
+
+/* Appends header line <ptr>..<end> followed by CRLF at <out>. Returns the
+ * number of bytes written.
+ */
+static inline int cache_add_hdr(char *out, const char *ptr, const char *end)
+{
+	memcpy(out, ptr, end - ptr);
+	out[end - ptr] = '\r';
+	out[end - ptr + 1] = '\n';
+	return end - ptr + 2;
+}
+
+/* Prepares the entry which will be filled from the response in <res> whose
+ * headers are about to be forwarded. The headers are copied except the ones
+ * related to the server connection, and the validators they hold are used to
+ * build the headers of the 304 response. Nothing is done if memory is missing.
+ */
+void cache_store_start(struct session *s, struct buffer *res)
+{
+	struct http_txn *txn = &s->txn;
+	struct http_msg *msg = &txn->rsp;
+	struct cache_txn *ct = &s->ctxn;
+	struct cache_entry *e;
+	char *cur_ptr, *cur_end, *cur_next, *nm;
+	int cur_idx, klen, hlen, nlen, val, max;
+
+	if (!ct->ttl || ct->store)
+		return;
+
+	klen = ct->vary ? ct->vlen : ct->len;
+	e = calloc(1, sizeof(*e) + klen + 1);
+	if (!e)
+		return;
+	memcpy(e->node.key, ct->key, klen);
+	e->node.key[klen] = 0;
+	e->uri = ct->uri;
+	e->hash = hash_mem(ct->key, ct->len);
+	e->be = s->be;
+	e->obj.mtime = -1;
+
+	/* lines may only grow by the CR added to bare LFs */
+	max = msg->sov + txn->hdr_idx.used + 2;
+	e->obj.hdr = malloc(max);
+	nm = malloc(strlen(HTTP_304) + max);
+	if (!e->obj.hdr || !nm || cache_alloc_body(&e->obj, txn->rsp.body_len) < 0)
+		goto fail;
+
+	hlen = cache_add_hdr(e->obj.hdr, res->p, res->p + msg->sl.st.l);
+	nlen = strlen(HTTP_304);
+	memcpy(nm, HTTP_304, nlen);
+
+	cur_idx = 0;
+	cur_next = res->p + hdr_idx_first_pos(&txn->hdr_idx);
+	while ((cur_idx = txn->hdr_idx.v[cur_idx].next)) {
+		struct hdr_idx_elem *cur_hdr = &txn->hdr_idx.v[cur_idx];
+
+		cur_ptr  = cur_next;
+		cur_end  = cur_ptr + cur_hdr->len;
+		cur_next = cur_end + cur_hdr->cr + 1;
+
+		if (http_header_match2(cur_ptr, cur_end, "Connection", 10) ||
+		    http_header_match2(cur_ptr, cur_end, "Proxy-Connection", 16) ||
+		    http_header_match2(cur_ptr, cur_end, "Keep-Alive", 10))
+			continue;
+
+		if ((val = http_header_match2(cur_ptr, cur_end, "ETag", 4))) {
+			e->obj.etag = e->obj.hdr + hlen + val;
+			e->obj.etag_len = cur_end - cur_ptr - val;
+		}
+		else if ((val = http_header_match2(cur_ptr, cur_end, "Last-Modified", 13)))
+			e->obj.mtime = cache_parse_date(cur_ptr + val, cur_end - cur_ptr - val);
+		else if (!http_header_match2(cur_ptr, cur_end, "Cache-Control", 13) &&
+			 !http_header_match2(cur_ptr, cur_end, "Expires", 7) &&
+			 !http_header_match2(cur_ptr, cur_end, "Vary", 4))
+			goto add_hdr;
+
+		/* the 304 response carries the validators and freshness headers */
+		nlen += cache_add_hdr(nm + nlen, cur_ptr, cur_end);
+	add_hdr:
+		hlen += cache_add_hdr(e->obj.hdr + hlen, cur_ptr, cur_end);
+	}
+	e->obj.hdr[hlen++] = '\r';
+	e->obj.hdr[hlen++] = '\n';
+	e->obj.hdr_len = hlen;
+
+	if (e->obj.etag || e->obj.mtime != -1) {
+		nm[nlen++] = '\r';
+		nm[nlen++] = '\n';
+		e->obj.nm_hdr = nm;
+		e->obj.nm_len = nlen;
+	}
+	else
+		free(nm);
+
+	ct->store = e;
+	ct->hdr_left = msg->sov - msg->sol;
+	ct->body_pos = 0;
+	return;
+ fail:
+	free(nm);
+	free(e->obj.hdr);
+	free(e);
+	cache_release_fill(s);
+}
+
+/* Inserts the completely filled entry of session <s> into the store, evicting
+ * the least recently used entries until it fits in the memory limit.
+ */
+static void cache_store_commit(struct session *s)
+{
+	struct cache_txn *ct = &s->ctxn;
+	struct cache_entry *e = ct->store;
+	struct cache_entry *old = NULL;
+	struct ebmb_node *node;
+
+	ct->store = NULL;
+	e->size = sizeof(*e) + strlen((char *)e->node.key) + 1 +
+		e->obj.hdr_len + e->obj.nm_len + e->obj.body_len;
+
+	/* a fresher response replaces the stored one */
+	node = ebst_lookup(&cache.store, (char *)e->node.key);
+	if (node)
+		old = ebmb_entry(node, struct cache_entry, node);
+
+	if (e->size > cache.max_mem ||
+	    (!(cache.flags & CACHE_F_ADMIT_ALL) && !cache_admit(e, old))) {
+		if (e->size <= cache.max_mem)
+			cache.rejected++;
+		logging(TRACE, "[cache_store_commit][key:%s][size:%u][rejected]",
+			(char *)e->node.key, e->size);
+		cache_free_entry(e);
+		cache_release_fill(s);
+		return;
+	}
+
+	if (old)
+		cache_unlink_entry(old);
+
+	while (cache.mem_used + e->size > cache.max_mem) {
+		cache_unlink_entry(LIST_ELEM(cache.lru.n, struct cache_entry *, lru));
+		cache.evictions++;
+	}
+
+	/* pages referenced by a pipe must never change once spliced */
+	if (e->obj.flags & CACHE_OBJ_F_MMAP)
+		mprotect(e->obj.body, e->obj.body_len, PROT_READ);
+
+	e->expire = tick_add(now_ms, MS_TO_TICKS(ct->ttl * 1000));
+	e->stale = tick_add(e->expire, MS_TO_TICKS(ct->swr >= 0 ? ct->swr * 1000 : cache.swr));
+
+	ebst_insert(&cache.store, &e->node);
+	LIST_ADDQ(&cache.lru, &e->lru);
+	cache.mem_used += e->size;
+	cache.entries++;
+	cache_release_fill(s);
+
+	logging(TRACE, "[cache_store_commit][key:%s][size:%u][ttl:%d][entries:%u][mem:%llu]",
+		(char *)e->node.key, e->size, ct->ttl, cache.entries, cache.mem_used);
+}
+
+/* Forwards up to <len> bytes of the response in <res> which is being stored
+ * in the cache. Only the bytes present in the buffer are forwarded, once the
+ * body bytes among them have been copied to the entry. The entry is inserted
+ * into the store once complete. Returns the number of bytes forwarded.
+ */
+unsigned long long cache_store_data(struct session *s, struct buffer *res, unsigned long long len)
+{
+	struct cache_txn *ct = &s->ctxn;
+	struct cache_entry *e = ct->store;
+	unsigned int fwd, skip, copy, max;
+	char *src;
+
+	fwd = (len < res->i) ? len : res->i;
+	skip = (fwd < ct->hdr_left) ? fwd : ct->hdr_left;
+	ct->hdr_left -= skip;
+	copy = fwd - skip;
+
+	if (copy > e->obj.body_len - ct->body_pos) {
+		/* more data than announced, don't keep anything */
+		ct->store = NULL;
+		cache_free_entry(e);
+		cache_release_fill(s);
+		return buffer_forward(res, len);
+	}
+
+	/* the input data may wrap at the end of the buffer */
+	src = b_ptr(res, skip);
+	while (copy) {
+		max = res->data + res->size - src;
+		if (max > copy)
+			max = copy;
+		memcpy(e->obj.body + ct->body_pos, src, max);
+		ct->body_pos += max;
+		copy -= max;
+		src = res->data;
+	}
+
+	buffer_forward(res, fwd);
+	if (!ct->hdr_left && ct->body_pos == e->obj.body_len)
+		cache_store_commit(s);
+	return fwd;
+}
+
+/* Releases the cache context of session <s>'s transaction : the reference to
+ * the object being sent, the key, an incomplete entry and the fill it owns or
+ * waits for. It is called at the end of each transaction.
+ */
+void cache_end_txn(struct session *s)
+{
+	struct cache_txn *ct = &s->ctxn;
+
+	if (ct->flags & CACHE_TXN_F_WAITING)
+		LIST_DEL(&ct->wait);
+	cache_release_fill(s);
+
+	/* a failed refresh may be attempted again by the next hit */
+	if (ct->refresh) {
+		ct->refresh->flags &= ~CACHE_ENT_F_REFRESH;
+		cache_release_entry(ct->refresh);
+	}
+
+	if (s->centry)
+		cache_release_entry(s->centry);
+	s->centry = NULL;
+	if (s->ctable)
+		cache_release_table(s->ctable);
+	s->ctable = NULL;
+	s->cobj = NULL;
+
+	if (ct->store)
+		cache_free_entry(ct->store);
+	pool_free2(pool2_cache_key, ct->key);
+	pool_free2(pool2_cache_gen, ct->gen);
+	memset(ct, 0, sizeof(*ct));
+}
+
+/* Returns non-zero if content coding <name> is accepted by the request of
+ * session <s>, according to the normalized Accept-Encoding header kept after
+ * its cache key. Codings with a null quality value are refused.
+ */
+static int cache_accept_enc(struct session *s, const char *name)
+{
+	struct cache_txn *ct = &s->ctxn;
+	const char *p = ct->key + ct->len + 1;
+	const char *end = ct->key + ct->vlen;
+	const char *tok, *q;
+	int len = strlen(name);
+
+	while (p < end) {
+		for (tok = p; p < end && *p != ',' && *p != ';'; p++)
+			;
+		if ((p - tok == len && strncmp(tok, name, len) == 0) ||
+		    (p - tok == 1 && *tok == '*')) {
+			/* look for a null quality value */
+			for (q = p; p < end && *p != ','; p++)
+				;
+			if (p - q >= 4 && strncmp(q, ";q=0", 4) == 0) {
+				for (q += 4; q < p && (*q == '.' || *q == '0'); q++)
+					;
+				if (q == p)
+					return 0;
+			}
+			return 1;
+		}
+		while (p < end && *p != ',')
+			p++;
+		p++;
+	}
+	return 0;
+}
+
+/* Returns the preferred variant of static object <obj> accepted by the request
+ * of session <s>, or <obj> itself.
+ */
+static struct cache_obj *cache_select_variant(struct session *s, struct cache_obj *obj)
+{
+	int enc;
+
+	for (enc = 0; enc < CACHE_ENC_MAX; enc++)
+		if (obj->variant[enc] && !(obj->variant[enc]->flags & CACHE_OBJ_F_PENDING) &&
+		    cache_accept_enc(s, cache_enc[enc].name))
+			return obj->variant[enc];
+	return obj;
+}
+
+/* The refreshes are not client traffic, they are never logged */
+static void cache_refresh_log(struct session *s)
+{
+}
+
+/* Starts an internal session which fetches again the expired entry <e> found
+ * by the request of session <s>. It is attached to the frontend of <s>, with
+ * the same addresses, and goes straight to the backend which stored <e>,
+ * without the frontend's rules. Its client side is the refresh applet which
+ * sends a GET request for the entry without looking the cache up, and drops
+ * the response once the HTTP analysers have stored it in place of <e>. It is
+ * neither counted on the listener nor on the frontend. Only one refresh runs
+ * per entry. Nothing is done if the backend is stopped or memory is missing.
+ */
+static void cache_refresh_entry(struct session *s, struct cache_entry *e)
+{
+	struct proxy *p = s->fe;
+	struct session *rs;
+	struct task *t;
+
+	if (!e->be || e->be->state == PR_STSTOPPED)
+		return;
+
+	if ((rs = pool_alloc2(pool2_session)) == NULL)
+		return;
+	memset(rs, 0, sizeof(*rs));
+
+	if ((t = task_new()) == NULL)
+		goto out_free_session;
+
+	t->process = s->listener->handler;
+	t->context = rs;
+	t->nice = s->listener->nice;
+	t->expire = TICK_ETERNITY;
+
+	rs->task = t;
+	rs->listener = s->listener;
+	rs->be = rs->fe = p;
+	rs->flags = SN_INTERNAL;
+	rs->uniq_id = totalconn;
+
+	rs->logs.accept_date = date;
+	rs->logs.tv_accept = now;
+	rs->logs.t_queue = rs->logs.t_connect = rs->logs.t_data = -1;
+	rs->do_log = cache_refresh_log;
+	rs->srv_error = default_srv_error;
+
+	/* the client side is the applet, on behalf of the client of <s> */
+	rs->si[0].conn.t.sock.fd = -1;
+	rs->si[0].owner = t;
+	rs->si[0].state = rs->si[0].prev_state = SI_ST_EST;
+	rs->si[0].err_type = SI_ET_NONE;
+	rs->si[0].addr = s->si[0].addr;
+	rs->si[0].flags = s->si[0].flags & (SI_FL_FROM_SET|SI_FL_TO_SET);
+	if (p->options2 & PR_O2_INDEPSTR)
+		rs->si[0].flags |= SI_FL_INDEP_STR;
+	rs->si[0].exp = TICK_ETERNITY;
+	stream_int_register_handler(&rs->si[0], &cache_refresh_applet);
+	rs->si[0].conn.data_ctx = rs;
+
+	if (session_init_buffers(rs) < 0)
+		goto out_free_task;
+
+	rs->txn.hdr_idx.size = global.tune.max_http_hdr;
+	if ((rs->txn.hdr_idx.v = pool_alloc2(pool2_hdr_idx)) == NULL)
+		goto out_free_buffers;
+
+	/* the headers are parsed with the frontend's captures */
+	if (p->nb_req_cap > 0 && (rs->txn.req.cap = pool_alloc2(p->req_cap_pool)) == NULL)
+		goto out_free_idx;
+
+	if (p->nb_rsp_cap > 0 && (rs->txn.rsp.cap = pool_alloc2(p->rsp_cap_pool)) == NULL)
+		goto out_free_reqcap;
+
+	http_init_txn(rs);
+
+	/* this cannot fail since the header index is allocated */
+	session_set_backend(rs, e->be);
+
+	/* only the request parsing is kept from the frontend, then the
+	 * backend which stored the entry processes it.
+	 */
+	rs->req->analysers = AN_REQ_WAIT_HTTP | e->be->be_req_ana;
+
+	LIST_ADDQ(&sessions, &rs->list);
+	LIST_INIT(&rs->back_refs);
+
+	/* the request must reach a server, and its response may be stored */
+	rs->ctxn.flags = CACHE_TXN_F_NOLOOKUP;
+	rs->ctxn.refresh = e;
+	e->refcnt++;
+	e->flags |= CACHE_ENT_F_REFRESH;
+
+	jobs++;
+	cache.refreshes++;
+
+	logging(TRACE, "[cache_refresh_entry][key:%s][backend:%s]", (char *)e->node.key, e->be->id);
+	task_wakeup(t, TASK_WOKEN_INIT);
+	return;
+
+	/* Error unrolling */
+ out_free_reqcap:
+	pool_free2(p->req_cap_pool, rs->txn.req.cap);
+ out_free_idx:
+	pool_free2(pool2_hdr_idx, rs->txn.hdr_idx.v);
+ out_free_buffers:
+	pool_free2(pool2_buffer, rs->rep);
+	pool_free2(pool2_buffer, rs->req);
+ out_free_task:
+	task_free(t);
+ out_free_session:
+	pool_free2(pool2_session, rs);
+}
+
+/* Looks the request of session <s> up, first among the static files then among
+ * the stored responses if its backend has "option http-cache", and returns the
+ * object to send or NULL. A reference is taken on the stored responses found.
+ */
+static struct cache_obj *cache_lookup(struct session *s)
+{
+	struct cache_txn *ct = &s->ctxn;
+	struct cache_entry *e;
+	hash_elt_t *elt;
+	char *path, c;
+
+	if (!ct->key)
+		return NULL;
+
+	if (cache.table && cache.table->hash) {
+		path = ct->key + ct->uri;
+		c = path[ct->path_len];
+		path[ct->path_len] = 0;
+		elt = hap_hash_find(cache.table->hash, hap_hash_key((u_char *)path, ct->path_len + 1),
+				    (u_char *)path, ct->path_len + 1);
+		path[ct->path_len] = c;
+		/* files not read yet are left to the servers */
+		if (elt && !(((struct cache_obj *)elt->value)->flags & CACHE_OBJ_F_PENDING)) {
+			/* the table must survive a reload while the object is sent */
+			cache.table->refcnt++;
+			s->ctable = cache.table;
+			ct->root = ((struct cache_obj *)elt->value)->root;
+			return cache_select_variant(s, elt->value);
+		}
+	}
+
+	/* only the backends storing responses may serve them */
+	if (!cache.max_mem || !(s->be->options2 & PR_O2_HTTP_CACHE))
+		return NULL;
+
+	/* the requests for responses which may be stored are counted, except
+	 * the ones refreshing them. A request looked up again after waiting for
+	 * another one's fill is only counted once.
+	 */
+	if (cache.sketch && !ct->refresh && !(ct->flags & CACHE_TXN_F_COUNTED)) {
+		cache_sketch_add(hash_mem(ct->key, ct->len));
+		ct->flags |= CACHE_TXN_F_COUNTED;
+	}
+
+	if (ct->flags & CACHE_TXN_F_NOLOOKUP)
+		return NULL;
+
+	/* the variant for the request's encodings first, then the entry
+	 * which does not vary.
+	 */
+	e = cache_lookup_entry(ct->key);
+	if (!e) {
+		ct->key[ct->len] = 0;
+		e = cache_lookup_entry(ct->key);
+		ct->key[ct->len] = '\n';
+		if (!e)
+			return NULL;
+	}
+
+	e->refcnt++;
+	LIST_DEL(&e->lru);
+	LIST_ADDQ(&cache.lru, &e->lru);
+	s->centry = e;
+
+	/* an expired entry is served while it is being fetched again */
+	if (tick_is_expired(e->expire, now_ms) && !(e->flags & CACHE_ENT_F_REFRESH))
+		cache_refresh_entry(s, e);
+	return &e->obj;
+}
+
+/* Appends a segment of <len> bytes at <ptr> to the response of session <s>.
+ * <body> is non-zero if it points to an object's body.
+ */
+static inline void cache_add_seg(struct session *s, const char *ptr, unsigned int len, int body)
+{
+	struct cache_seg *seg = &s->ctxn.segs[s->ctxn.nb_segs++];
+
+	seg->ptr = ptr;
+	seg->len = len;
+	seg->body = body;
+	s->size += len;
+}
+
+/* Appends the <len> bytes of headers at <ptr>, which end with an empty line,
+ * to the response of session <s>, followed by the current Date if the object
+ * being sent has none, and by the Connection header chosen for the transaction
+ * if any. Both come from the prebuilt cache.date.
+ */
+static inline void cache_add_head(struct session *s, const char *ptr, unsigned int len)
+{
+	int conn = s->ctxn.conn;
+
+	if (s->cobj->flags & CACHE_OBJ_F_DATE) {
+		cache_add_seg(s, ptr, len - 2, 0);
+		cache_add_seg(s, cache.date[conn], cache.date_len[conn], 0);
+	}
+	else if (conn != CACHE_CONN_NONE) {
+		cache_add_seg(s, ptr, len - 2, 0);
+		cache_add_seg(s, cache_conn_hdr[conn], strlen(cache_conn_hdr[conn]), 0);
+	}
+	else
+		cache_add_seg(s, ptr, len, 0);
+}
+
+/* Returns non-zero if the If-Range condition of the request of session <s>,
+ * if any, is met by object <obj>, meaning that the requested ranges may be
+ * sent. Entity tags use the strong comparison function.
+ */
+static int cache_if_range_match(struct session *s, struct cache_obj *obj)
+{
+	struct cache_txn *ct = &s->ctxn;
+	const char *val = ct->key + ct->if_range;
+
+	if (!ct->if_range)
+		return 1;
+
+	if (*val == '"' || *val == 'W')
+		return obj->etag && ct->if_range_len == obj->etag_len &&
+			*val == '"' && memcmp(val, obj->etag, obj->etag_len) == 0;
+
+	return obj->mtime != -1 && cache_parse_date(val, ct->if_range_len) == obj->mtime;
+}
+
+/* Parses one position of a byte range at <*p> without going beyond <end>.
+ * Returns non-zero on success, with <*p> pointing after the digits.
+ */
+static int cache_parse_pos(const char **p, const char *end, unsigned long long *pos)
+{
+	const char *start = *p;
+
+	*pos = 0;
+	while (*p < end && **p >= '0' && **p <= '9') {
+		if (*pos > (~0ULL - 9) / 10)
+			return 0;
+		*pos = *pos * 10 + *(*p)++ - '0';
+	}
+	return *p > start;
+}
+
+/* Parses the Range header of the request of session <s> against a body of
+ * <size> bytes, and fills <rng> with the satisfiable ranges. Returns their
+ * number, which may be zero, or -1 if the header is invalid or lists too many
+ * ranges, in which case it must be ignored.
+ */
+static int cache_parse_ranges(struct session *s, unsigned int size, struct cache_range *rng)
+{
+	struct cache_txn *ct = &s->ctxn;
+	const char *p = ct->key + ct->range;
+	const char *end = p + ct->range_len;
+	unsigned long long first, last;
+	int nb = 0;
+
+	if (ct->range_len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+		return -1;
+
+	for (p += 6; p < end; p++) {
+		while (p < end && HTTP_IS_SPHT(*p))
+			p++;
+		if (p == end || *p == ',')
+			continue;
+
+		if (*p == '-') {
+			/* suffix range : the last bytes */
+			p++;
+			if (!cache_parse_pos(&p, end, &last))
+				return -1;
+			if (!last || !size)
+				goto next;
+			first = (last < size) ? size - last : 0;
+			last = size - 1;
+		}
+		else {
+			if (!cache_parse_pos(&p, end, &first) || p == end || *p++ != '-')
+				return -1;
+			if (p < end && *p >= '0' && *p <= '9') {
+				if (!cache_parse_pos(&p, end, &last) || last < first)
+					return -1;
+			}
+			else
+				last = ~0ULL;
+			if (first >= size)
+				goto next;
+			if (last >= size)
+				last = size - 1;
+		}
+
+		if (nb == CACHE_MAX_RANGES)
+			return -1;
+		rng[nb].start = first;
+		rng[nb].len = last - first + 1;
+		nb++;
+	next:
+		while (p < end && HTTP_IS_SPHT(*p))
+			p++;
+		if (p < end && *p != ',')
+			return -1;
+	}
+	return nb;
+}
+
+/* Prepares the segments of the response to a range request for object <obj>
+ * on session <s> : a 206 response with one range or a multipart/byteranges
+ * body for several ones, or a 416 response if no range is satisfiable. The
+ * 206 headers are made of the object's ones with the status line, the
+ * Content-Length and, for multiple ranges, the Content-Type replaced. Returns
+ * 1 if the segments were prepared, or 0 if the whole object must be sent.
+ */
+static int cache_prepare_ranges(struct session *s, struct cache_obj *obj)
+{
+	struct cache_txn *ct = &s->ctxn;
+	struct cache_range rng[CACHE_MAX_RANGES];
+	const char *line, *eol, *end, *ctype = NULL;
+	int part[CACHE_MAX_RANGES + 1];
+	unsigned long long total;
+	int nb, i, len, plen, clen = 0, size = global.tune.bufsize;
+	char *gen;
+
+	if (!ct->range || !cache_if_range_match(s, obj))
+		return 0;
+
+	nb = cache_parse_ranges(s, obj->body_len, rng);
+	if (nb < 0)
+		return 0;
+
+	gen = ct->gen = pool_alloc2(pool2_cache_gen);
+	if (!gen)
+		return 0;
+
+	if (!nb) {
+		len = snprintf(gen, size, "%s%u\r\n\r\n", HTTP_416, obj->body_len);
+		s->txn.status = 416;
+		cache_add_head(s, gen, len);
+		return 1;
+	}
+
+	/* copy the headers except the ones we rebuild */
+	len = snprintf(gen, size, "HTTP/1.1 206 Partial Content\r\n");
+	end = obj->hdr + obj->hdr_len - 2;
+	line = memchr(obj->hdr, '\n', obj->hdr_len) + 1;
+	for (; line < end; line = eol + 2) {
+		eol = line;
+		while (eol < end && *eol != '\r')
+			eol++;
+
+		if (http_header_match2(line, eol, "Content-Length", 14))
+			continue;
+		if ((i = http_header_match2(line, eol, "Content-Type", 12))) {
+			ctype = line + i;
+			clen = eol - ctype;
+			if (nb > 1)
+				continue;
+		}
+		if (len + (eol - line) + 2 > size)
+			goto full;
+		memcpy(gen + len, line, eol - line + 2);
+		len += eol - line + 2;
+	}
+
+	if (nb == 1) {
+		i = snprintf(gen + len, size - len,
+			     "Content-Range: bytes %u-%u/%u\r\nContent-Length: %u\r\n\r\n",
+			     rng[0].start, rng[0].start + rng[0].len - 1, obj->body_len, rng[0].len);
+		if (i >= size - len)
+			goto full;
+		s->txn.status = 206;
+		cache_add_head(s, gen, len + i);
+		cache_add_seg(s, obj->body + rng[0].start, rng[0].len, 1);
+		return 1;
+	}
+
+	/* each part is preceeded by its own headers, which are first built
+	 * in the trash to know the body length.
+	 */
+	plen = 0;
+	total = 0;
+	for (i = 0; i <= nb; i++) {
+		part[i] = plen;
+		if (i < nb)
+			plen += snprintf(trash + plen, trashlen - plen,
+					 "\r\n--%08x%08x\r\nContent-Type: %.*s\r\nContent-Range: bytes %u-%u/%u\r\n\r\n",
+					 s->uniq_id, (unsigned int)now.tv_usec, clen, ctype ? ctype : "application/octet-stream",
+					 rng[i].start, rng[i].start + rng[i].len - 1, obj->body_len);
+		else
+			plen += snprintf(trash + plen, trashlen - plen, "\r\n--%08x%08x--\r\n",
+					 s->uniq_id, (unsigned int)now.tv_usec);
+		if (plen >= trashlen)
+			goto full;
+		if (i < nb)
+			total += rng[i].len;
+	}
+	total += plen;
+
+	i = snprintf(gen + len, size - len,
+		     "Content-Type: multipart/byteranges; boundary=%08x%08x\r\nContent-Length: %llu\r\n\r\n",
+		     s->uniq_id, (unsigned int)now.tv_usec, total);
+	if (i >= size - len || len + i + plen > size)
+		goto full;
+	len += i;
+	memcpy(gen + len, trash, plen);
+
+	s->txn.status = 206;
+	cache_add_head(s, gen, len);
+	for (i = 0; i < nb; i++) {
+		cache_add_seg(s, gen + len + part[i], part[i + 1] - part[i], 0);
+		cache_add_seg(s, obj->body + rng[i].start, rng[i].len, 1);
+	}
+	cache_add_seg(s, gen + len + part[nb], plen - part[nb], 0);
+	return 1;
+
+ full:
+	/* the headers do not fit, let's send the whole object */
+	pool_free2(pool2_cache_gen, gen);
+	ct->gen = NULL;
+	return 0;
+}
+
+#if defined(CONFIG_HAP_LINUX_SPLICE)
+/* Feeds the current segment of session <s>, which is part of the mapped body
+ * of object <obj>, to the client through a pipe attached to the response
+ * buffer. The pages are vmspliced, so the data are never copied to user space
+ * buffers. Returns 1 if the segment is being taken care of, or 0 if the caller
+ * must copy it instead (no splicing, no pipe available or vmsplice not
+ * supported).
+ */
+static int cache_splice_body(struct session *s, struct cache_obj *obj)
+{
+	struct buffer *rsp = s->txn.rsp.buf;
+	struct cache_txn *ct = &s->ctxn;
+	struct cache_seg *seg = &ct->segs[ct->cur_seg];
+	struct iovec iov;
+	int ret;
+
+	if (!(obj->flags & CACHE_OBJ_F_SPLICE) || !(global.tune.options & GTUNE_USE_SPLICE))
+		return 0;
+
+	/* the headers must have left the buffer before the pipe is fed */
+	if (rsp->o || rsp->i)
+		return 1;
+
+	if (!rsp->pipe &&
+	    (pipes_used >= global.maxpipes || !(rsp->pipe = get_pipe())))
+		return 0;
+
+	while (ct->seg_pos < seg->len) {
+		iov.iov_base = (char *)seg->ptr + ct->seg_pos;
+		iov.iov_len  = seg->len - ct->seg_pos;
+		ret = vmsplice(rsp->pipe->prod, &iov, 1, SPLICE_F_NONBLOCK);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0 && errno == EAGAIN)
+				break; /* pipe full */
+
+			/* vmsplice is not usable, wait for the pipe to drain
+			 * and fall back to copies.
+			 */
+			if (rsp->pipe->data)
+				return 1;
+			put_pipe(rsp->pipe);
+			rsp->pipe = NULL;
+			return 0;
+		}
+		s->offset += ret;
+		ct->seg_pos += ret;
+		rsp->pipe->data += ret;
+		rsp->total += ret;
+		if (rsp->to_forward != BUF_INFINITE_FORWARD)
+			rsp->to_forward -= ret;
+		rsp->flags |= BF_READ_PARTIAL;
+		rsp->flags &= ~BF_OUT_EMPTY;
+	}
+	return 1;
+}
+#else
+static inline int cache_splice_body(struct session *s, struct cache_obj *obj)
+{
+	return 0;
+}
+#endif
+
+/* Sends as much as possible of the segments of the session's response to the
+ * client, starting at the current one. Headers and small bodies are copied
+ * into the response buffer while mapped bodies are spliced. Data are only
+ * copied once the pipe is empty so that they are sent in order.
+ */
+static void cache_send_obj(struct session *s)
+{
+	struct cache_obj *obj = s->cobj;
+	struct cache_txn *ct = &s->ctxn;
+	struct buffer *rsp = s->rep;
+	struct cache_seg *seg;
+	int max, len;
+
+	while (ct->cur_seg < ct->nb_segs) {
+		seg = &ct->segs[ct->cur_seg];
+		if (ct->seg_pos >= seg->len) {
+			ct->cur_seg++;
+			ct->seg_pos = 0;
+			continue;
+		}
+
+		if (seg->body && cache_splice_body(s, obj)) {
+			if (ct->seg_pos < seg->len)
+				break;
+			continue;
+		}
+
+		if (rsp->pipe && rsp->pipe->data)
+			break;
+
+		len = seg->len - ct->seg_pos;
+		max = bi_avail(rsp);
+		if (!max) {
+			rsp->flags |= BF_FULL;
+			rsp->prod->flags |= SI_FL_WAIT_ROOM;
+			break;
+		}
+
+		/* let's realign the buffer to optimize I/O, then only
+		 * consider the contiguous free space.
+		 */
+		if (buffer_empty(rsp))
+			rsp->p = rsp->data;
+		if (max > rsp->data + rsp->size - bi_end(rsp))
+			max = rsp->data + rsp->size - bi_end(rsp);
+		if (max > len)
+			max = len;
+
+		memcpy(bi_end(rsp), seg->ptr + ct->seg_pos, max);
+		rsp->i += max;
+		rsp->total += max;
+		rsp->flags |= BF_READ_PARTIAL;
+		rsp->flags &= ~BF_OUT_EMPTY;
+		s->offset += max;
+		ct->seg_pos += max;
+
+		/* if we're allowed to directly forward data, we must update ->o */
+		if (rsp->to_forward && !(rsp->flags & (BF_SHUTW|BF_SHUTW_NOW))) {
+			unsigned long fwd = max;
+			if (rsp->to_forward != BUF_INFINITE_FORWARD) {
+				if (fwd > rsp->to_forward)
+					fwd = rsp->to_forward;
+				rsp->to_forward -= fwd;
+			}
+			b_adv(rsp, fwd);
+		}
+	}
+}
+
+/* Copies at once the whole response of session <s> into the response buffer,
+ * which must already have it scheduled for forwarding. This is only done when
+ * nothing else is pending there and the response fits in the free space, so
+ * that pipelined hits get answered back-to-back in the same buffer without an
+ * applet. Returns non-zero if the response was copied, otherwise zero.
+ */
+static int cache_copy_resp(struct session *s)
+{
+	struct cache_txn *ct = &s->ctxn;
+	struct buffer *rsp = s->rep;
+	int i;
+
+	if (rsp->i || (rsp->pipe && rsp->pipe->data) || buffer_input_closed(rsp))
+		return 0;
+
+	if (buffer_empty(rsp))
+		rsp->p = rsp->data;
+
+	if (s->size > buffer_max_len(rsp) - buffer_len(rsp))
+		return 0;
+
+	for (i = 0; i < ct->nb_segs; i++)
+		bi_putblk(rsp, ct->segs[i].ptr, ct->segs[i].len);
+
+	ct->cur_seg = ct->nb_segs;
+	s->offset = s->size;
+	if (rsp->o)
+		rsp->flags &= ~BF_OUT_EMPTY;
+	return 1;
+}
+
+/* Sets the Connection header of the response to the request of session <s>,
+ * which is about to be answered from the cache. No server is involved, so the
+ * client's connection is kept alive as in server-close mode unless the client
+ * or the configuration asks for a close. The transaction's connection mode is
+ * updated accordingly.
+ */
+static void cache_set_conn_mode(struct session *s)
+{
+	struct http_txn *txn = &s->txn;
+	struct http_msg *msg = &txn->req;
+	struct cache_txn *ct = &s->ctxn;
+	int px = !!(txn->flags & TX_USE_PX_CONN);
+
+	/* the header is parsed without being changed since the request is
+	 * not forwarded.
+	 */
+	http_parse_connection_header(txn, msg, 0);
+
+	if ((txn->flags & TX_CON_WANT_MSK) == TX_CON_WANT_CLO ||
+	    (txn->flags & TX_HDR_CONN_CLO) ||
+	    (!(msg->flags & HTTP_MSGF_VER_11) && !(txn->flags & TX_HDR_CONN_KAL)) ||
+	    ((s->fe->options|s->be->options) & PR_O_HTTP_CLOSE) ||
+	    s->fe->state == PR_STSTOPPED) {
+		txn->flags = (txn->flags & ~TX_CON_WANT_MSK) | TX_CON_WANT_CLO;
+		ct->conn = px ? CACHE_CONN_PX_CLO : CACHE_CONN_CLO;
+		return;
+	}
+
+	txn->flags = (txn->flags & ~TX_CON_WANT_MSK) | TX_CON_WANT_SCL;
+	ct->conn = (msg->flags & HTTP_MSGF_VER_11) ? CACHE_CONN_NONE :
+		   px ? CACHE_CONN_PX_KAL : CACHE_CONN_KAL;
+}
+
+/* Accounts for the request of session <s> which is left to the servers, on
+ * the first root whose prefix it matches if any. The refreshes are not counted.
+ */
+static void cache_count_miss(struct session *s)
+{
+	struct cache_txn *ct = &s->ctxn;
+	struct cache_root *root;
+
+	if (ct->flags & CACHE_TXN_F_NOLOOKUP)
+		return;
+
+	list_for_each_entry(root, &cache.roots, list) {
+		if (ct->path_len >= root->prefix_len &&
+		    memcmp(ct->key + ct->uri, root->prefix, root->prefix_len) == 0) {
+			root->misses++;
+			return;
+		}
+	}
+	cache.misses++;
+}
+
+/* This analyser is called once the frontend and backend HTTP processing is
+ * done on a request. It looks the request up in the cache and on a hit, eats
+ * the request and either copies a small response at once into the response
+ * buffer or attaches the cache applet to the server side stream interface,
+ * which produces the response. No server connection is involved,
+ * and the transaction ends as in server-close mode so that the next requests
+ * on the same connection, pipelined or not, are processed normally. A server
+ * connection left idle by the previous transaction is closed first. Requests
+ * with a body are left to the servers.
+ *
+ * On a miss, a request for a response which another session is fetching and
+ * may store waits for it, until it is stored, or the other session learns it
+ * will not be, or "lock-timeout" strikes. The request is then looked up again
+ * and is forwarded on a new miss. It returns 0 while waiting, otherwise 1.
+ */
+int cache_process_request(struct session *s, struct buffer *req, int an_bit)
+{
+	struct http_txn *txn = &s->txn;
+	struct http_msg *msg = &txn->req;
+	struct stream_interface *si = req->cons;
+	struct cache_obj *obj;
+
+	if (s->ctxn.flags & CACHE_TXN_F_WAITING) {
+		if (!(req->flags & (BF_SHUTR|BF_READ_ERROR)) &&
+		    !tick_is_expired(req->analyse_exp, now_ms)) {
+			buffer_dont_connect(req);
+			return 0;
+		}
+		/* the client left or waited too long */
+		LIST_DEL(&s->ctxn.wait);
+		s->ctxn.flags &= ~CACHE_TXN_F_WAITING;
+	}
+
+	req->analysers &= ~an_bit;
+	req->analyse_exp = TICK_ETERNITY;
+
+	if (!s->ctxn.key || !(msg->flags & HTTP_MSGF_XFER_LEN) ||
+	    (msg->flags & HTTP_MSGF_TE_CHNK) || msg->body_len)
+		return 1;
+
+	obj = cache_lookup(s);
+	if (!obj)
+		obj = cache_lookup_neg(s);
+	if (!obj) {
+		if (!cache_wait_fill(s)) {
+			cache_count_miss(s);
+			return 1;
+		}
+		req->analysers |= an_bit;
+		buffer_dont_connect(req);
+		return 0;
+	}
+
+	if (si->state != SI_ST_INI)
+		http_close_server_conn(s);
+
+	cache_set_conn_mode(s);
+
+	s->cobj = obj;
+	s->offset = 0;
+	s->size = 0;
+	txn->status = 200;
+	if (obj->flags & CACHE_OBJ_F_NEG) {
+		txn->status = (obj == &cache_neg_obj[CACHE_NEG_410]) ? 410 : 404;
+		cache_add_head(s, obj->hdr, obj->hdr_len);
+	}
+	else if (cache_not_modified(s, obj)) {
+		s->ctxn.flags |= CACHE_TXN_F_NOT_MOD;
+		txn->status = 304;
+		cache_add_head(s, obj->nm_hdr, obj->nm_len);
+	}
+	else if (txn->meth == HTTP_METH_HEAD)
+		cache_add_head(s, obj->hdr, obj->hdr_len);
+	else if (!cache_prepare_ranges(s, obj)) {
+		cache_add_head(s, obj->hdr, obj->hdr_len);
+		cache_add_seg(s, obj->body, obj->body_len, 1);
+	}
+	logging(TRACE, "[cache_process_request][hit:%s][size:%ld][segs:%d]",
+		s->ctxn.key, s->size, s->ctxn.nb_segs);
+
+	if (s->ctxn.root) {
+		s->ctxn.root->hits++;
+		s->ctxn.root->bytes_out += s->size;
+	}
+	else if (obj->flags & CACHE_OBJ_F_NEG)
+		cache.neg_hits++;
+	else {
+		cache.hits++;
+		cache.bytes_out += s->size;
+	}
+
+	s->logs.tv_request = now;
+
+	/* "eat" the request */
+	bi_fast_delete(req, msg->sov);
+	msg->sov = 0;
+	req->analysers = AN_REQ_HTTP_XFER_BODY;
+	txn->req.msg_state = HTTP_MSG_CLOSED;
+
+	s->rep->analysers = AN_RES_HTTP_XFER_BODY;
+	txn->rsp.sol = txn->rsp.sov = txn->rsp.next = 0;
+	txn->rsp.chunk_len = 0;
+	buffer_forward(s->rep, s->size);
+
+	/* In keep-alive, a response which fits in the buffer is copied there
+	 * and the transaction ends as soon as the body analysers resync, so
+	 * that the next pipelined request is processed within the same pass.
+	 */
+	if ((txn->flags & TX_CON_WANT_MSK) == TX_CON_WANT_SCL && cache_copy_resp(s)) {
+		txn->rsp.msg_state = HTTP_MSG_DONE;
+		set_target_applet(&s->target, &cache_applet); // for logging only
+		si->conn_retries = s->be->conn_retries;       // no retry to report
+		return 1;
+	}
+
+	/* otherwise the response body analyser ends the transaction once the
+	 * applet has produced the <size> bytes scheduled for forwarding.
+	 */
+	txn->rsp.msg_state = HTTP_MSG_DATA;
+	stream_int_register_handler(si, &cache_applet);
+	buffer_auto_connect(req); /* the previous transaction may have ended in this pass */
+	copy_target(&s->target, &si->target); // for logging only
+	si->conn.data_ctx = s;
+	si->applet.st0 = si->applet.st1 = 0;
+	return 1;
+}
+
+/* I/O handler of the cache applet, which sends the object found by
+ * cache_process_request() to the client.
+ */
+static void cache_io_handler(struct stream_interface *si)
+{
+	struct session *s = si->conn.data_ctx;
+	struct buffer *req = si->ob;
+	struct buffer *res = si->ib;
+
+	if (unlikely(si->state == SI_ST_DIS || si->state == SI_ST_CLO))
+		return;
+
+	/* check that the output is not closed */
+	if (res->flags & (BF_SHUTW|BF_SHUTW_NOW))
+		si->applet.st0 = 1;
+
+	if (!si->applet.st0) {
+		cache_send_obj(s);
+		if (s->offset >= s->size)
+			si->applet.st0 = 1;
+	}
+
+	if ((res->flags & BF_SHUTR) && (si->state == SI_ST_EST))
+		si_shutw(si);
+
+	if ((req->flags & BF_SHUTW) && (si->state == SI_ST_EST) && si->applet.st0) {
+		si_shutr(si);
+		res->flags |= BF_READ_NULL;
+	}
+
+	/* update all other flags and resync with the other side */
+	si_update(si);
+
+	/* we don't want to expire timeouts while we're processing requests */
+	si->ib->rex = TICK_ETERNITY;
+	si->ob->wex = TICK_ETERNITY;
+}
+
+struct si_applet cache_applet = {
+	.name = "<CACHE>", /* used for logging */
+	.fct = cache_io_handler,
+	.release = NULL,
+};
+
+/* Writes the request refreshing entry <e> into buffer <buf>, rebuilt from the
+ * entry's key : the Host header, the URI, and the Accept-Encoding header for
+ * responses varying on it. The server connection is not kept alive. Returns
+ * the number of bytes written, or -1 if the request does not fit.
+ */
+static int cache_refresh_request(struct buffer *buf, struct cache_entry *e)
+{
+	const char *key = (const char *)e->node.key;
+	const char *uri = key + e->uri;
+	const char *enc = strchr(uri, '\n');
+	int len, ulen;
+
+	ulen = enc ? enc - uri : strlen(uri);
+	len = snprintf(trash, trashlen, "GET %.*s HTTP/1.1\r\n", ulen, uri);
+	if (e->uri && len < trashlen)
+		len += snprintf(trash + len, trashlen - len, "Host: %.*s\r\n", e->uri, key);
+	if (enc && enc[1] && len < trashlen)
+		len += snprintf(trash + len, trashlen - len, "Accept-Encoding: %s\r\n", enc + 1);
+	if (len < trashlen)
+		len += snprintf(trash + len, trashlen - len, "Connection: close\r\n\r\n");
+	if (len >= trashlen || len > buffer_max_len(buf))
+		return -1;
+	return bi_putblk(buf, trash, len);
+}
+
+/* I/O handler of the refresh applet, which acts as the client of the internal
+ * sessions started by cache_refresh_entry(). It sends the request once, then
+ * drops the response bytes, and closes once the response was forwarded.
+ */
+static void cache_refresh_io_handler(struct stream_interface *si)
+{
+	struct session *s = si->conn.data_ctx;
+	struct buffer *req = si->ib;
+	struct buffer *res = si->ob;
+
+	if (unlikely(si->state == SI_ST_DIS || si->state == SI_ST_CLO))
+		return;
+
+	if (!si->applet.st0) {
+		if (!s->ctxn.refresh || cache_refresh_request(req, s->ctxn.refresh) < 0)
+			goto close;
+		si->applet.st0 = 1;
+	}
+
+	/* the response was stored by the analysers if it could be */
+	if (res->o)
+		bo_skip(res, res->o);
+
+	/* the session closes our side once the response was forwarded */
+	if (res->flags & (BF_SHUTW|BF_SHUTW_NOW))
+		goto close;
+
+	si_update(si);
+	res->flags |= BF_READ_DONTWAIT;
+	req->rex = TICK_ETERNITY;
+	res->wex = TICK_ETERNITY;
+	return;
+ close:
+	si_shutw(si);
+	si_shutr(si);
+	req->flags |= BF_READ_NULL;
+}
+
+static struct si_applet cache_refresh_applet = {
+	.name = "<CACHE-REFRESH>", /* used for logging */
+	.fct = cache_refresh_io_handler,
+	.release = NULL,
+};
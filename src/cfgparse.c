@@ -28,6 +28,7 @@
 #include <common/cfgparse.h>
 #include <common/config.h>
 #include <common/errors.h>
+#include <common/logging.h>
 #include <common/memory.h>
 #include <common/standard.h>
 #include <common/time.h>
@@ -41,6 +42,7 @@
 #include <proto/auth.h>
 #include <proto/backend.h>
 #include <proto/buffers.h>
+#include <proto/cache.h>
 #include <proto/checks.h>
 #include <proto/dumpstats.h>
 #include <proto/frontend.h>
@@ -163,6 +165,7 @@ static const struct cfg_opt cfg_opts2[] =
 	{ "independant-streams",          PR_O2_INDEPSTR,  PR_CAP_FE|PR_CAP_BE, 0, 0 },
 	{ "http-use-proxy-header",        PR_O2_USE_PXHDR, PR_CAP_FE, 0, PR_MODE_HTTP },
 	{ "http-pretend-keepalive",       PR_O2_FAKE_KA,   PR_CAP_FE|PR_CAP_BE, 0, PR_MODE_HTTP },
+	{ "http-cache",                   PR_O2_HTTP_CACHE, PR_CAP_BE, 0, PR_MODE_HTTP },
 	{ "http-no-delay",                PR_O2_NODELAY,   PR_CAP_FE|PR_CAP_BE, 0, PR_MODE_HTTP },
 	{ NULL, 0, 0, 0 }
 };
@@ -951,7 +954,22 @@ int cfg_parse_global(const char *file, int linenum, char **args, int kwm)
 			}
 		}
 
-		if (args[1][0] == '/') {
+		if (strncmp(args[1], "file@", 5) == 0) {
+			if (!args[1][5]) {
+				Alert("parsing [%s:%d] : '%s' expects a path after 'file@'.\n", file, linenum, args[0]);
+				err_code |= ERR_ALERT | ERR_FATAL;
+				free(logsrv);
+				goto out;
+			}
+			logsrv->file = log_file_get(args[1] + 5);
+			if (!logsrv->file) {
+				Alert("parsing [%s:%d] : out of memory.\n", file, linenum);
+				err_code |= ERR_ALERT | ERR_FATAL;
+				free(logsrv);
+				goto out;
+			}
+		}
+		else if (args[1][0] == '/') {
 			struct sockaddr_storage *sk = (struct sockaddr_storage *)str2sun(args[1]);
 			if (!sk) {
 				Alert("parsing [%s:%d] : Socket path '%s' too long (max %d)\n", file, linenum,
@@ -976,6 +994,41 @@ int cfg_parse_global(const char *file, int linenum, char **args, int kwm)
 
 		LIST_ADDQ(&global.logsrvs, &logsrv->list);
 	}
+	else if (!strcmp(args[0], "log-file-size")) {
+		const char *err;
+
+		if (*(args[1]) == 0) {
+			Alert("parsing [%s:%d] : '%s' expects a size as argument.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		err = parse_size_err(args[1], &log_file_size);
+		if (err) {
+			Alert("parsing [%s:%d] : unexpected character '%c' in '%s' argument.\n",
+			      file, linenum, *err, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		if (log_file_size < LOG_FILE_MIN_SIZE) {
+			Alert("parsing [%s:%d] : '%s' must be at least %d bytes.\n",
+			      file, linenum, args[0], LOG_FILE_MIN_SIZE);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+	}
+	else if (!strcmp(args[0], "log-file-count")) {
+		if (*(args[1]) == 0) {
+			Alert("parsing [%s:%d] : '%s' expects an integer argument.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		log_file_count = atol(args[1]);
+		if (log_file_count < 1 || log_file_count > 1000) {
+			Alert("parsing [%s:%d] : '%s' expects a value between 1 and 1000.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+	}
 	else if (!strcmp(args[0], "log-send-hostname")) { /* set the hostname in syslog header */
 		char *name;
 		int len;
@@ -1007,6 +1060,42 @@ int cfg_parse_global(const char *file, int linenum, char **args, int kwm)
 		free(global.log_tag);
 		global.log_tag = strdup(args[1]);
 	}
+	else if (!strcmp(args[0], "logging-level")) {
+		int level;
+
+		if (*(args[1]) == 0) {
+			Alert("parsing [%s:%d] : '%s' expects a level name argument.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		level = logging_parse_level(args[1]);
+		if (level < 0) {
+			Alert("parsing [%s:%d] : unknown level '%s' for '%s', expects 'trace', 'debug', 'info', "
+			      "'warn', 'error', 'fatal' or 'silent'.\n", file, linenum, args[1], args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		if (level < CONFIG_HAP_LOGGING_LEVEL)
+			Warning("parsing [%s:%d] : messages below level '%s' are not built in, '%s %s' will not enable them.\n",
+				file, linenum, logging_level_name(CONFIG_HAP_LOGGING_LEVEL), args[0], args[1]);
+		logging_level = level;
+	}
+	else if (!strcmp(args[0], "logging-ring-size")) {
+		const char *err;
+
+		if (*(args[1]) == 0) {
+			Alert("parsing [%s:%d] : '%s' expects a size as argument.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		err = parse_size_err(args[1], &logging_ring_size);
+		if (err) {
+			Alert("parsing [%s:%d] : unexpected character '%c' in '%s' argument.\n",
+			      file, linenum, *err, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+	}
 	else if (!strcmp(args[0], "spread-checks")) {  /* random time between checks (0-50) */
 		if (global.spread_checks != 0) {
 			Alert("parsing [%s:%d]: spread-checks already specified. Continuing.\n", file, linenum);
@@ -1334,6 +1423,269 @@ out:
 	return err_code;
 }
 
+/* Parses the size argument of cache keyword <args[0]> into <val>. Returns the
+ * error code, 0 if OK.
+ */
+static int cfg_parse_cache_size(const char *file, int linenum, char **args, unsigned int *val)
+{
+	const char *err;
+
+	if (!*args[1]) {
+		Alert("parsing [%s:%d] : '%s' expects a size as argument.\n",
+		      file, linenum, args[0]);
+		return ERR_ALERT | ERR_FATAL;
+	}
+
+	err = parse_size_err(args[1], val);
+	if (err) {
+		Alert("parsing [%s:%d] : unexpected character '%c' in '%s' argument.\n",
+		      file, linenum, *err, args[0]);
+		return ERR_ALERT | ERR_FATAL;
+	}
+	return 0;
+}
+
+/* Parses the time argument of cache keyword <args[0]> into <val>, in
+ * milliseconds. Returns the error code, 0 if OK.
+ */
+static int cfg_parse_cache_time(const char *file, int linenum, char **args, unsigned int *val)
+{
+	const char *err;
+
+	if (!*args[1]) {
+		Alert("parsing [%s:%d] : '%s' expects a time as argument.\n",
+		      file, linenum, args[0]);
+		return ERR_ALERT | ERR_FATAL;
+	}
+
+	err = parse_time_err(args[1], val, TIME_UNIT_MS);
+	if (err) {
+		Alert("parsing [%s:%d] : unexpected character '%c' in '%s' argument.\n",
+		      file, linenum, *err, args[0]);
+		return ERR_ALERT | ERR_FATAL;
+	}
+	return 0;
+}
+
+/*
+ * Parse a line in a <cache> section.
+ * Returns the error code, 0 if OK, or any combination of :
+ *  - ERR_ABORT: must abort ASAP
+ *  - ERR_FATAL: we can continue parsing but not start the service
+ *  - ERR_WARN: a warning has been emitted
+ *  - ERR_ALERT: an alert has been emitted
+ * Only the two first ones can stop processing, the two others are just
+ * indicators.
+ */
+int cfg_parse_cache(const char *file, int linenum, char **args, int kwm)
+{
+	struct cache_root *root;
+	const char *err;
+	int err_code = 0;
+	int cur_arg, len;
+
+	if (strcmp(args[0], "cache") == 0) { /* new cache section */
+		if (*args[1]) {
+			Alert("parsing [%s:%d] : '%s' does not take any argument.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+		}
+	}
+	else if (strcmp(args[0], "root") == 0) { /* URI prefix to directory mapping */
+		if (!*args[2]) {
+			Alert("parsing [%s:%d] : '%s' expects <uri-prefix> and <directory> as arguments.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+
+		if (*args[1] != '/') {
+			Alert("parsing [%s:%d] : '%s' : URI prefix '%s' must start with a '/'.\n",
+			      file, linenum, args[0], args[1]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+
+		if ((root = (struct cache_root *)calloc(1, sizeof(struct cache_root))) == NULL) {
+			Alert("parsing [%s:%d] : out of memory.\n", file, linenum);
+			err_code |= ERR_ALERT | ERR_ABORT;
+			goto out;
+		}
+
+		/* the prefix always ends with a '/' and the directory never does */
+		len = strlen(args[1]);
+		if (args[1][len - 1] == '/')
+			root->prefix = strdup(args[1]);
+		else
+			root->prefix = memprintf(NULL, "%s/", args[1]);
+
+		len = strlen(args[2]);
+		while (len > 1 && args[2][len - 1] == '/')
+			len--;
+		root->dir = my_strndup(args[2], len);
+
+		if (!root->prefix || !root->dir) {
+			Alert("parsing [%s:%d] : out of memory.\n", file, linenum);
+			free(root->prefix);
+			free(root->dir);
+			free(root);
+			err_code |= ERR_ALERT | ERR_ABORT;
+			goto out;
+		}
+		root->prefix_len = strlen(root->prefix);
+		root->dir_fd = -1;
+		root->conf.file = file;
+		root->conf.line = linenum;
+
+		cur_arg = 3;
+		while (*args[cur_arg]) {
+			unsigned int *val;
+
+			if (strcmp(args[cur_arg], "compress") == 0) {
+#ifdef USE_ZLIB
+				root->flags |= CACHE_ROOT_F_COMPRESS;
+#else
+				Alert("parsing [%s:%d] : '%s' : '%s' is not supported without USE_ZLIB.\n",
+				      file, linenum, args[0], args[cur_arg]);
+				err_code |= ERR_ALERT | ERR_FATAL;
+#endif
+				cur_arg++;
+				continue;
+			}
+			else if (strcmp(args[cur_arg], "max-age") == 0) {
+				if (!*args[cur_arg + 1]) {
+					Alert("parsing [%s:%d] : '%s' : '%s' expects a time as argument.\n",
+					      file, linenum, args[0], args[cur_arg]);
+					err_code |= ERR_ALERT | ERR_FATAL;
+					break;
+				}
+				err = parse_time_err(args[cur_arg + 1], &root->max_age, TIME_UNIT_S);
+				if (err) {
+					Alert("parsing [%s:%d] : '%s' : unexpected character '%c' in '%s' argument.\n",
+					      file, linenum, args[0], *err, args[cur_arg]);
+					err_code |= ERR_ALERT | ERR_FATAL;
+					break;
+				}
+				root->flags |= CACHE_ROOT_F_MAX_AGE;
+				cur_arg += 2;
+				continue;
+			}
+			else if (strcmp(args[cur_arg], "max-size") == 0)
+				val = &root->max_size;
+			else if (strcmp(args[cur_arg], "max-file-size") == 0)
+				val = &root->max_file;
+			else {
+				Alert("parsing [%s:%d] : '%s' only supports 'compress', 'max-age', 'max-size' and 'max-file-size', got '%s'.\n",
+				      file, linenum, args[0], args[cur_arg]);
+				err_code |= ERR_ALERT | ERR_FATAL;
+				break;
+			}
+
+			if (!*args[cur_arg + 1]) {
+				Alert("parsing [%s:%d] : '%s' : '%s' expects a size as argument.\n",
+				      file, linenum, args[0], args[cur_arg]);
+				err_code |= ERR_ALERT | ERR_FATAL;
+				break;
+			}
+
+			err = parse_size_err(args[cur_arg + 1], val);
+			if (err) {
+				Alert("parsing [%s:%d] : '%s' : unexpected character '%c' in '%s' argument.\n",
+				      file, linenum, args[0], *err, args[cur_arg]);
+				err_code |= ERR_ALERT | ERR_FATAL;
+				break;
+			}
+			cur_arg += 2;
+		}
+
+		LIST_ADDQ(&cache.roots, &root->list);
+	}
+	else if (strcmp(args[0], "mime-types") == 0) { /* extension to Content-Type mapping */
+		char *errmsg = NULL;
+
+		if (!*args[1] || *args[2]) {
+			Alert("parsing [%s:%d] : '%s' expects a file name as the only argument.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		if (cache_load_mime_types(args[1], &errmsg) < 0) {
+			Alert("parsing [%s:%d] : '%s' : %s.\n", file, linenum, args[0], errmsg);
+			free(errmsg);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+	}
+	else if (strcmp(args[0], "snapshot") == 0) { /* persistent copy of the files */
+		if (!*args[1] || *args[2]) {
+			Alert("parsing [%s:%d] : '%s' expects a file name as the only argument.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		free(cache.snap_path);
+		cache.snap_path = strdup(args[1]);
+	}
+	else if (strcmp(args[0], "watch") == 0) { /* reload the roots on changes */
+		if (*args[1]) {
+			Alert("parsing [%s:%d] : '%s' does not take any argument.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+#ifdef CONFIG_HAP_LINUX_INOTIFY
+		cache.flags |= CACHE_F_WATCH;
+#else
+		Alert("parsing [%s:%d] : '%s' is not supported without USE_LINUX_INOTIFY.\n",
+		      file, linenum, args[0]);
+		err_code |= ERR_ALERT | ERR_FATAL;
+#endif
+	}
+	else if (strcmp(args[0], "max-memory") == 0) { /* memory for stored responses */
+		err_code |= cfg_parse_cache_size(file, linenum, args, &cache.max_mem);
+	}
+	else if (strcmp(args[0], "max-object-size") == 0) { /* largest stored response body */
+		err_code |= cfg_parse_cache_size(file, linenum, args, &cache.max_obj);
+	}
+	else if (strcmp(args[0], "negative-entries") == 0) { /* slots of the negative cache */
+		if (!*args[1] || *args[2] || atol(args[1]) <= 0 || atol(args[1]) > (1 << 24)) {
+			Alert("parsing [%s:%d] : '%s' expects a number between 1 and %d as the only argument.\n",
+			      file, linenum, args[0], 1 << 24);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		cache.neg_entries = atol(args[1]);
+	}
+	else if (strcmp(args[0], "admission") == 0) { /* which responses may evict others */
+		if (strcmp(args[1], "all") == 0 && !*args[2])
+			cache.flags |= CACHE_F_ADMIT_ALL;
+		else if (strcmp(args[1], "frequency") == 0 && !*args[2])
+			cache.flags &= ~CACHE_F_ADMIT_ALL;
+		else {
+			Alert("parsing [%s:%d] : '%s' expects 'all' or 'frequency' as the only argument.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+	}
+	else if (strcmp(args[0], "lock-timeout") == 0) { /* max wait for a pending response */
+		err_code |= cfg_parse_cache_time(file, linenum, args, &cache.lock_timeout);
+	}
+	else if (strcmp(args[0], "negative-ttl") == 0) { /* lifetime of the 404 and 410 responses */
+		err_code |= cfg_parse_cache_time(file, linenum, args, &cache.neg_ttl);
+	}
+	else if (strcmp(args[0], "stale-while-revalidate") == 0) { /* expired responses still served */
+		err_code |= cfg_parse_cache_time(file, linenum, args, &cache.swr);
+	}
+	else if (*args[0] != 0) {
+		Alert("parsing [%s:%d] : unknown keyword '%s' in '%s' section\n", file, linenum, args[0], cursection);
+		err_code |= ERR_ALERT | ERR_FATAL;
+	}
+
+ out:
+	return err_code;
+}
+
 
 int cfg_parse_listen(const char *file, int linenum, char **args, int kwm)
 {
@@ -4754,7 +5106,20 @@ stats_error_parsing:
 				}
 			}
 
-			if (args[1][0] == '/') {
+			if (strncmp(args[1], "file@", 5) == 0) {
+				if (!args[1][5]) {
+					Alert("parsing [%s:%d] : '%s' expects a path after 'file@'.\n", file, linenum, args[0]);
+					err_code |= ERR_ALERT | ERR_FATAL;
+					goto out;
+				}
+				logsrv->file = log_file_get(args[1] + 5);
+				if (!logsrv->file) {
+					Alert("parsing [%s:%d] : out of memory.\n", file, linenum);
+					err_code |= ERR_ALERT | ERR_FATAL;
+					goto out;
+				}
+			}
+			else if (args[1][0] == '/') {
 				struct sockaddr_storage *sk = (struct sockaddr_storage *)str2sun(args[1]);
 				if (!sk) {
 					Alert("parsing [%s:%d] : Socket path '%s' too long (max %d)\n", file, linenum,
@@ -5667,6 +6032,11 @@ int readcfgfile(const char *file)
 			free(cursection);
 			cursection = strdup(args[0]);
 		}
+		else if (!strcmp(args[0], "cache")) {
+			confsect = CFG_CACHE;
+			free(cursection);
+			cursection = strdup(args[0]);
+		}
 
 		/* else it's a section keyword */
 
@@ -5683,6 +6053,9 @@ int readcfgfile(const char *file)
 		case CFG_PEERS:
 			err_code |= cfg_parse_peers(file, linenum, args, kwm);
 			break;
+		case CFG_CACHE:
+			err_code |= cfg_parse_cache(file, linenum, args, kwm);
+			break;
 		default:
 			Alert("parsing [%s:%d]: unknown keyword '%s' out of section.\n", file, linenum, args[0]);
 			err_code |= ERR_ALERT | ERR_FATAL;
@@ -6255,6 +6628,18 @@ out_uri_auth_compat:
 		if (curproxy->uniqueid_format_string)
 			parse_logformat_string(curproxy->uniqueid_format_string, curproxy, &curproxy->format_unique_id, PR_MODE_HTTP);
 
+		if (!LIST_ISEMPTY(&curproxy->logformat) &&
+		    !(curproxy->logformat_prog = compile_logformat(&curproxy->logformat))) {
+			Alert("Proxy '%s': out of memory while compiling the log format.\n", curproxy->id);
+			cfgerr++;
+		}
+
+		if (!LIST_ISEMPTY(&curproxy->format_unique_id) &&
+		    !(curproxy->format_unique_id_prog = compile_logformat(&curproxy->format_unique_id))) {
+			Alert("Proxy '%s': out of memory while compiling the unique-id format.\n", curproxy->id);
+			cfgerr++;
+		}
+
 		/* first, we will invert the servers list order */
 		newsrv = NULL;
 		while (curproxy->srv) {
@@ -6519,6 +6904,10 @@ out_uri_auth_compat:
 			if (curproxy->mode == PR_MODE_HTTP) {
 				curproxy->fe_req_ana |= AN_REQ_WAIT_HTTP | AN_REQ_HTTP_PROCESS_FE;
 				curproxy->fe_rsp_ana |= AN_RES_WAIT_HTTP | AN_RES_HTTP_PROCESS_FE;
+
+				/* every request may be answered from the cache */
+				if (!LIST_ISEMPTY(&cache.roots) || cache.max_mem || cache.neg_ttl)
+					curproxy->fe_req_ana |= AN_REQ_CACHE_LOOKUP;
 			}
 
 			/* both TCP and HTTP must check switching rules */
@@ -1300,9 +1300,6 @@ static struct task *server_warmup(struct task *t)
  */
 static struct task *process_chk(struct task *t)
 {
-	/*haproxy-second*/
-	logging(TRACE, "[process_chk]");
-	/*haproxy-second*/
 	int attempts = 0;
 	struct server *s = t->context;
 	struct sockaddr_storage sa;
@@ -29,6 +29,7 @@
 #include <common/compat.h>
 #include <common/config.h>
 #include <common/debug.h>
+#include <common/logging.h>
 #include <common/memory.h>
 #include <common/mini-clist.h>
 #include <common/standard.h>
@@ -41,6 +42,7 @@
 
 #include <proto/backend.h>
 #include <proto/buffers.h>
+#include <proto/cache.h>
 #include <proto/checks.h>
 #include <proto/dumpstats.h>
 #include <proto/fd.h>
@@ -63,6 +65,7 @@ static int stats_dump_errors_to_buffer(struct stream_interface *si);
 static int stats_table_request(struct stream_interface *si, bool show);
 static int stats_dump_proxy(struct stream_interface *si, struct proxy *px, struct uri_auth *uri);
 static int stats_dump_http(struct stream_interface *si, struct uri_auth *uri);
+static int stats_dump_cache(struct stream_interface *si, struct uri_auth *uri);
 
 static struct si_applet cli_applet;
 
@@ -83,9 +86,14 @@ static const char stats_sock_usage_msg[] =
 	"  set timeout    : change a timeout setting\n"
 	"  set maxconn    : change a maxconn setting\n"
 	"  set rate-limit : change a rate limiting value\n"
+	"  set logging-level : change the level of the internal debug messages\n"
 	"  disable        : put a server or frontend in maintenance mode\n"
 	"  enable         : re-enable a server or frontend which is in maintenance mode\n"
 	"  shutdown       : kill a session or a frontend (eg:to release listening ports)\n"
+	"  show cache     : report the cache's counters for each root\n"
+	"  purge cache    : remove stored responses by URI or URI prefix ending with '*'\n"
+	"  reload cache   : reload the files of the cache's roots\n"
+	"  save cache     : write the cache's snapshot file\n"
 	"";
 
 static const char stats_permission_denied_msg[] =
@@ -98,6 +106,7 @@ enum {
 	STAT_ST_HEAD,
 	STAT_ST_INFO,
 	STAT_ST_LIST,
+	STAT_ST_CACHE,
 	STAT_ST_END,
 	STAT_ST_FIN,
 };
@@ -342,6 +351,7 @@ static int print_csv_header(struct chunk *msg)
 			    "hrsp_1xx,hrsp_2xx,hrsp_3xx,hrsp_4xx,hrsp_5xx,hrsp_other,hanafail,"
 			    "req_rate,req_rate_max,req_tot,"
 			    "cli_abrt,srv_abrt,"
+			    "cache_hit,cache_miss,cache_evict,cache_mem,cache_load,"
 			    "\n");
 }
 
@@ -826,6 +836,15 @@ static int stats_sock_parse_request(struct stream_interface *si, char *line)
 		else if (strcmp(args[1], "table") == 0) {
 			stats_sock_table_request(si, args, true);
 		}
+		else if (strcmp(args[1], "cache") == 0) {
+			if (!cache.table && !cache.max_mem && !cache.neg) {
+				si->applet.ctx.cli.msg = "No cache is configured.\n";
+				si->applet.st0 = STAT_CLI_PRINT;
+				return 1;
+			}
+			si->applet.ctx.stats.px_st = STAT_PX_ST_INIT;
+			si->applet.st0 = STAT_CLI_O_CACHE; // stats_dump_cache
+		}
 		else { /* neither "stat" nor "info" nor "sess" nor "errors" nor "table" */
 			return 0;
 		}
@@ -1151,6 +1170,31 @@ static int stats_sock_parse_request(struct stream_interface *si, char *line)
 				return 1;
 			}
 		}
+		else if (strcmp(args[1], "logging-level") == 0) {
+			int level;
+
+			if (s->listener->perm.ux.level < ACCESS_LVL_ADMIN) {
+				si->applet.ctx.cli.msg = stats_permission_denied_msg;
+				si->applet.st0 = STAT_CLI_PRINT;
+				return 1;
+			}
+
+			level = logging_parse_level(args[2]);
+			if (level < 0) {
+				si->applet.ctx.cli.msg = "Expects 'trace', 'debug', 'info', 'warn', 'error', 'fatal' or 'silent'.\n";
+				si->applet.st0 = STAT_CLI_PRINT;
+				return 1;
+			}
+
+			if (level < CONFIG_HAP_LOGGING_LEVEL) {
+				si->applet.ctx.cli.msg = "This level is not built in.\n";
+				si->applet.st0 = STAT_CLI_PRINT;
+				return 1;
+			}
+
+			logging_level = level;
+			return 1;
+		}
 		else { /* unknown "set" parameter */
 			return 0;
 		}
@@ -1346,6 +1390,83 @@ static int stats_sock_parse_request(struct stream_interface *si, char *line)
 			return 1;
 		}
 	}
+	else if (strcmp(args[0], "save") == 0) {
+		if (strcmp(args[1], "cache") == 0) {
+			if (s->listener->perm.ux.level < ACCESS_LVL_ADMIN) {
+				si->applet.ctx.cli.msg = stats_permission_denied_msg;
+				si->applet.st0 = STAT_CLI_PRINT;
+				return 1;
+			}
+
+			if (!cache.snap_path) {
+				si->applet.ctx.cli.msg = "No snapshot file is configured in the cache section.\n";
+				si->applet.st0 = STAT_CLI_PRINT;
+				return 1;
+			}
+
+			if (cache_save_snapshot() < 0) {
+				si->applet.ctx.cli.msg = "Failed to save the cache snapshot, check the logs.\n";
+				si->applet.st0 = STAT_CLI_PRINT;
+			}
+			return 1;
+		}
+		else { /* unknown "save" parameter */
+			si->applet.ctx.cli.msg = "'save' only supports 'cache'.\n";
+			si->applet.st0 = STAT_CLI_PRINT;
+			return 1;
+		}
+	}
+	else if (strcmp(args[0], "purge") == 0) {
+		if (strcmp(args[1], "cache") == 0) {
+			if (s->listener->perm.ux.level < ACCESS_LVL_ADMIN) {
+				si->applet.ctx.cli.msg = stats_permission_denied_msg;
+				si->applet.st0 = STAT_CLI_PRINT;
+				return 1;
+			}
+
+			if (!*args[2]) {
+				si->applet.ctx.cli.msg = "Require an URI, or an URI prefix followed by '*'.\n";
+				si->applet.st0 = STAT_CLI_PRINT;
+				return 1;
+			}
+
+			snprintf(trash, trashlen, "%d responses purged.\n", cache_purge(args[2]));
+			si->applet.ctx.cli.msg = trash;
+			si->applet.st0 = STAT_CLI_PRINT;
+			return 1;
+		}
+		else { /* unknown "purge" parameter */
+			si->applet.ctx.cli.msg = "'purge' only supports 'cache'.\n";
+			si->applet.st0 = STAT_CLI_PRINT;
+			return 1;
+		}
+	}
+	else if (strcmp(args[0], "reload") == 0) {
+		if (strcmp(args[1], "cache") == 0) {
+			if (s->listener->perm.ux.level < ACCESS_LVL_ADMIN) {
+				si->applet.ctx.cli.msg = stats_permission_denied_msg;
+				si->applet.st0 = STAT_CLI_PRINT;
+				return 1;
+			}
+
+			if (!cache.table) {
+				si->applet.ctx.cli.msg = "No root is configured in the cache section.\n";
+				si->applet.st0 = STAT_CLI_PRINT;
+				return 1;
+			}
+
+			if (cache_reload() < 0) {
+				si->applet.ctx.cli.msg = "Failed to reload the cache, check the logs.\n";
+				si->applet.st0 = STAT_CLI_PRINT;
+			}
+			return 1;
+		}
+		else { /* unknown "reload" parameter */
+			si->applet.ctx.cli.msg = "'reload' only supports 'cache'.\n";
+			si->applet.st0 = STAT_CLI_PRINT;
+			return 1;
+		}
+	}
 	else { /* not "show" nor "clear" nor "get" nor "set" nor "enable" nor "disable" */
 		return 0;
 	}
@@ -1484,6 +1605,10 @@ static void cli_io_handler(struct stream_interface *si)
 				if (stats_table_request(si, false))
 					si->applet.st0 = STAT_CLI_PROMPT;
 				break;
+			case STAT_CLI_O_CACHE:
+				if (stats_dump_cache(si, NULL))
+					si->applet.st0 = STAT_CLI_PROMPT;
+				break;
 			default: /* abnormal state */
 				si->applet.st0 = STAT_CLI_PROMPT;
 				break;
@@ -1611,6 +1736,7 @@ static int stats_dump_raw_to_buffer(struct stream_interface *si)
 				     "Tasks: %d\n"
 				     "Run_queue: %d\n"
 				     "Idle_pct: %d\n"
+				     "LogDrops: %u\n"
 				     "node: %s\n"
 				     "description: %s\n"
 				     "",
@@ -1625,6 +1751,7 @@ static int stats_dump_raw_to_buffer(struct stream_interface *si)
 				     actconn, pipes_used, pipes_free,
 				     read_freq_ctr(&global.conn_per_sec), global.cps_lim, global.cps_max,
 				     nb_tasks_cur, run_queue_cur, idle_pct,
+				     log_drops,
 				     global.node, global.desc?global.desc:""
 				     );
 			if (bi_putchk(si->ib, &msg) == -1)
@@ -1655,6 +1782,15 @@ static int stats_dump_raw_to_buffer(struct stream_interface *si)
 			/* here, we just have reached the last proxy */
 		}
 
+		si->conn.data_st = STAT_ST_CACHE;
+		/* fall through */
+
+	case STAT_ST_CACHE:
+		if (si->applet.ctx.stats.flags & STAT_SHOW_STAT) {
+			if (stats_dump_cache(si, NULL) == 0)
+				return 0;
+		}
+
 		si->conn.data_st = STAT_ST_END;
 		/* fall through */
 
@@ -2119,6 +2255,13 @@ static int stats_dump_http(struct stream_interface *si, struct uri_auth *uri)
 		}
 		/* here, we just have reached the last proxy */
 
+		si->conn.data_st = STAT_ST_CACHE;
+		/* fall through */
+
+	case STAT_ST_CACHE:
+		if (stats_dump_cache(si, uri) == 0)
+			return 0;
+
 		si->conn.data_st = STAT_ST_END;
 		/* fall through */
 
@@ -2407,6 +2550,9 @@ static int stats_dump_proxy(struct stream_interface *si, struct proxy *px, struc
 				/* errors: cli_aborts, srv_aborts */
 				chunk_printf(&msg, ",,");
 
+				/* cache: hits, misses, evictions, memory, load time */
+				chunk_printf(&msg, ",,,,,");
+
 				/* finish with EOL */
 				chunk_printf(&msg, "\n");
 			}
@@ -2536,6 +2682,8 @@ static int stats_dump_proxy(struct stream_interface *si, struct proxy *px, struc
 				     ",,,"
 				     /* errors: cli_aborts, srv_aborts */
 				     ",,"
+				     /* cache: hits, misses, evictions, memory, load time */
+				     ",,,,,"
 				     "\n",
 				     px->id, l->name,
 				     l->nbconn, l->counters->conn_max,
@@ -2954,6 +3102,9 @@ static int stats_dump_proxy(struct stream_interface *si, struct proxy *px, struc
 				chunk_printf(&msg, "%lld,%lld,",
 					     sv->counters.cli_aborts, sv->counters.srv_aborts);
 
+				/* cache: hits, misses, evictions, memory, load time */
+				chunk_printf(&msg, ",,,,,");
+
 				/* finish with EOL */
 				chunk_printf(&msg, "\n");
 			}
@@ -3148,6 +3299,9 @@ static int stats_dump_proxy(struct stream_interface *si, struct proxy *px, struc
 				chunk_printf(&msg, "%lld,%lld,",
 					     px->be_counters.cli_aborts, px->be_counters.srv_aborts);
 
+				/* cache: hits, misses, evictions, memory, load time */
+				chunk_printf(&msg, ",,,,,");
+
 				/* finish with EOL */
 				chunk_printf(&msg, "\n");
 
@@ -3199,6 +3353,202 @@ static int stats_dump_proxy(struct stream_interface *si, struct proxy *px, struc
 	}
 }
 
+/* Appends to <msg> the cache counters of row <name> in the format of the dump
+ * in progress on <si> : CSV if STAT_FMT_CSV is set, HTML if <uri> is set, and
+ * text for "show cache" otherwise. <max> is the memory limit or 0, <evict> and
+ * <load> are -1 when they do not apply to the row, and <sid> numbers the row.
+ */
+static void stats_dump_cache_row(struct stream_interface *si, struct chunk *msg,
+				 struct uri_auth *uri, const char *name, int sid,
+				 unsigned int objs, unsigned long long mem, unsigned long long max,
+				 unsigned long long hits, unsigned long long misses,
+				 unsigned long long bytes, int evict, int load)
+{
+	unsigned int ratio = hits + misses ? hits * 100 / (hits + misses) : 0;
+
+	if (si->applet.ctx.stats.flags & STAT_FMT_CSV) {
+		chunk_printf(msg,
+			     /* pxname, svname, queue, sessions */
+			     "cache,%s,,,,,,,"
+			     /* bytes: in, out */
+			     ",%llu,"
+			     /* denied, errors, warnings, server status */
+			     ",,,,,,,,,,,"
+			     /* rest of server: nothing */
+			     ",,,,,"
+			     /* pid, iid, sid, throttle, lbtot, tracked, type */
+			     "%d,0,%d,,,,%d,"
+			     /* rate, check, http responses, failed health analyses */
+			     ",,,,,,,,,,,,,"
+			     /* requests : req_rate, req_rate_max, req_tot, */
+			     ",,%llu,"
+			     /* errors: cli_aborts, srv_aborts */
+			     ",,"
+			     /* cache: hits, misses, evictions, memory, load time */
+			     "%llu,%llu,%s,%llu,%s,"
+			     "\n",
+			     name, bytes, relative_pid, sid, STATS_TYPE_CA,
+			     hits + misses, hits, misses,
+			     evict >= 0 ? U2A0(evict) : "", mem,
+			     load >= 0 ? U2A1(load) : "");
+	}
+	else if (uri) {
+		chunk_printf(msg,
+			     "<tr class=\"%s\"><td class=ac>%s</td>"
+			     "<td>%s</td><td>%s</td><td>%s</td>"
+			     "<td>%s</td><td>%s</td><td>%s%%</td>"
+			     "<td>%s</td><td>%s</td><td>%s%s</td></tr>\n",
+			     sid ? "frontend" : "backend", name,
+			     U2H0(objs), U2H1(mem), max ? U2H2(max) : "-",
+			     U2H3(hits), U2H4(misses), U2H5(ratio),
+			     evict >= 0 ? U2H6(evict) : "-", U2H7(bytes),
+			     load >= 0 ? U2H8(load) : "-", load >= 0 ? " ms" : "");
+	}
+	else {
+		chunk_printf(msg,
+			     "# %s: objects:%u, mem:%llu, max:%llu, hits:%llu, misses:%llu, "
+			     "hit_ratio:%u%%, bytes_out:%llu, evictions:%s, load_ms:%s\n",
+			     name, objs, mem, max, hits, misses, ratio, bytes,
+			     evict >= 0 ? U2A0(evict) : "-", load >= 0 ? U2A1(load) : "-");
+	}
+}
+
+/* Dumps the cache counters after the proxies : one row per root, one for the
+ * stored responses and one for the totals, in the format of the dump in
+ * progress on <si> (see stats_dump_cache_row()). Nothing is dumped without a
+ * cache, within a limited scope, or when the dump is bound to other types.
+ * It returns 0 if the output buffer is full and it needs to be called again,
+ * otherwise non-zero. The position is kept in applet.ctx.stats.px_st and
+ * applet.ctx.stats.root.
+ */
+static int stats_dump_cache(struct stream_interface *si, struct uri_auth *uri)
+{
+	struct buffer *rep = si->ib;
+	struct cache_root *root;
+	struct chunk msg;
+	unsigned long long hits, misses, bytes, mem;
+	unsigned int objs;
+	int sid;
+
+	chunk_init(&msg, trash, trashlen);
+
+	switch (si->applet.ctx.stats.px_st) {
+	case STAT_PX_ST_INIT:
+		if (!cache.table && !cache.max_mem && !cache.neg)
+			return 1;
+
+		if (uri && uri->scope)
+			return 1;
+
+		if ((si->applet.ctx.stats.flags & STAT_BOUND) &&
+		    ((si->applet.ctx.stats.iid != -1 && si->applet.ctx.stats.iid != 0) ||
+		     !(si->applet.ctx.stats.type & (1 << STATS_TYPE_CA))))
+			return 1;
+
+		si->applet.ctx.stats.root = LIST_ELEM(cache.roots.n, struct cache_root *, list);
+		si->applet.ctx.stats.px_st = STAT_PX_ST_TH;
+		/* fall through */
+
+	case STAT_PX_ST_TH:
+		if (si->applet.ctx.stats.flags & STAT_FMT_CSV)
+			;
+		else if (uri) {
+			chunk_printf(&msg,
+				     "<table class=\"tbl\" width=\"100%%\">\n"
+				     "<tr class=\"titre\">"
+				     "<th class=\"pxname\" width=\"10%%\"><a name=\"cache\"></a>"
+				     "<a class=px href=\"#cache\">cache</a></th>"
+				     "<th class=\"empty\" width=\"90%%\"></th>"
+				     "</tr>\n"
+				     "</table>\n"
+				     "<table class=\"tbl\" width=\"100%%\">\n"
+				     "<tr class=\"titre\">"
+				     "<th rowspan=2></th>"
+				     "<th colspan=3>Memory</th><th colspan=4>Requests</th>"
+				     "<th>Bytes</th><th rowspan=2>Load</th>"
+				     "</tr>\n"
+				     "<tr class=\"titre\">"
+				     "<th>Objects</th><th>Used</th><th>Max</th>"
+				     "<th>Hits</th><th>Misses</th><th>Ratio</th><th>Evict</th>"
+				     "<th>Out</th>"
+				     "</tr>\n");
+		}
+		else {
+			chunk_printf(&msg,
+				     "# cache: reloads:%u, refreshes:%u, rejected:%u, purged:%u, "
+				     "neg_hits:%llu, warm_ms:%u\n",
+				     cache.reloads, cache.refreshes, cache.rejected,
+				     cache.purged, cache.neg_hits, cache.warm_time);
+		}
+
+		if (msg.len && bi_putchk(rep, &msg) == -1)
+			return 0;
+
+		si->applet.ctx.stats.px_st = STAT_PX_ST_SV;
+		/* fall through */
+
+	case STAT_PX_ST_SV:
+		sid = 1;
+		list_for_each_entry(root, &cache.roots, list) {
+			if (root == si->applet.ctx.stats.root)
+				break;
+			sid++;
+		}
+
+		while (&si->applet.ctx.stats.root->list != &cache.roots) {
+			root = si->applet.ctx.stats.root;
+			stats_dump_cache_row(si, &msg, uri, root->prefix, sid++,
+					     root->files, root->size, root->max_size,
+					     root->hits, root->misses, root->bytes_out,
+					     -1, root->load_time);
+			if (bi_putchk(rep, &msg) == -1)
+				return 0;
+			si->applet.ctx.stats.root = LIST_ELEM(root->list.n, struct cache_root *, list);
+		}
+
+		si->applet.ctx.stats.px_st = STAT_PX_ST_BE;
+		/* fall through */
+
+	case STAT_PX_ST_BE:
+		stats_dump_cache_row(si, &msg, uri, "STORE", 0,
+				     cache.entries, cache.mem_used, cache.max_mem,
+				     cache.hits, cache.misses, cache.bytes_out,
+				     cache.evictions, -1);
+
+		objs = cache.entries;
+		mem = cache.mem_used;
+		hits = cache.hits;
+		misses = cache.misses;
+		bytes = cache.bytes_out;
+		list_for_each_entry(root, &cache.roots, list) {
+			objs += root->files;
+			mem += root->size;
+			hits += root->hits;
+			misses += root->misses;
+			bytes += root->bytes_out;
+		}
+		stats_dump_cache_row(si, &msg, uri, "TOTAL", 0, objs, mem, 0,
+				     hits, misses, bytes, cache.evictions,
+				     cache.load_time + cache.warm_time);
+
+		if (uri && !(si->applet.ctx.stats.flags & STAT_FMT_CSV))
+			chunk_printf(&msg, "</table><p>\n");
+
+		if (bi_putchk(rep, &msg) == -1)
+			return 0;
+
+		si->applet.ctx.stats.px_st = STAT_PX_ST_FIN;
+		/* fall through */
+
+	case STAT_PX_ST_FIN:
+		return 1;
+
+	default:
+		/* unknown state, we should put an abort() here ! */
+		return 1;
+	}
+}
+
 /* This function dumps a complete session state onto the stream intreface's
  * read buffer. The data_ctx must have been zeroed first, and the flags
  * properly set. The session has to be set in data_ctx.sess.target. It returns
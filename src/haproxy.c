@@ -56,6 +56,7 @@
 #include <common/config.h>
 #include <common/defaults.h>
 #include <common/errors.h>
+#include <common/logging.h>
 #include <common/memory.h>
 #include <common/mini-clist.h>
 #include <common/regex.h>
@@ -74,6 +75,7 @@
 #include <proto/acl.h>
 #include <proto/backend.h>
 #include <proto/buffers.h>
+#include <proto/cache.h>
 #include <proto/checks.h>
 #include <proto/fd.h>
 #include <proto/hdr_idx.h>
@@ -591,6 +593,13 @@ void init(int argc, char **argv)
 	if (have_appsession)
 		appsession_init();
 
+	/* the debug messages file is shared by all processes */
+	logging_open();
+
+	/* load the static cache before the chroot so that roots are found */
+	if (init_cache_file() < 0)
+		exit(1);
+
 	if (start_checks() < 0)
 		exit(1);
 
@@ -613,7 +622,9 @@ void init(int argc, char **argv)
 		int nbfe = 0, nbbe = 0;
 
 		for (cur = proxy; cur; cur = cur->next) {
-			if (cur->options2 & (PR_O2_SPLIC_ANY)) {
+			/* the static cache splices its large objects to the clients */
+			if ((cur->options2 & (PR_O2_SPLIC_ANY)) ||
+			    (cache.mapped && (cur->cap & PR_CAP_FE))) {
 				if (cur->cap & PR_CAP_FE)
 					nbfe += cur->maxconn;
 				if (cur->cap & PR_CAP_BE)
@@ -945,6 +956,8 @@ void deinit(void)
 			LIST_DEL(&lf->list);
 			free(lf);
 		}
+		free_logformat_prog(p->logformat_prog);
+		free_logformat_prog(p->format_unique_id_prog);
 
 		deinit_tcp_rules(&p->tcp_req.inspect_rules);
 		deinit_tcp_rules(&p->tcp_req.l4_rules);
@@ -1036,6 +1049,9 @@ void deinit(void)
 
 	userlist_free(userlist);
 
+	deinit_cache_file();
+	log_files_deinit();
+
 	protocol_unbind_all();
 
 	free(global.log_send_hostname); global.log_send_hostname = NULL;
@@ -1092,8 +1108,12 @@ static int tell_old_pids(int sig)
 void run_poll_loop()
 {
 	int next;
-	init_cache_file();
+
 	tv_update_date(0,1);
+
+	/* log lines are now sent once per loop */
+	log_batch = 1;
+
 	while (1) {
 		/* check if we caught some signals and process them */
 		signal_process_queue();
@@ -1104,6 +1124,9 @@ void run_poll_loop()
 		/* Process a few tasks */
 		process_runnable_tasks(&next);
 
+		/* Send the log lines emitted by these tasks */
+		log_flush();
+
 		/* stop when there's nothing left to do */
 		if (jobs == 0)
 			break;
@@ -1278,6 +1301,13 @@ int main(int argc, char **argv)
 		pidfile = fdopen(pidfd, "w");
 	}
 
+	if (log_files_init() < 0) {
+		if (nb_oldpids)
+			tell_old_pids(SIGTTIN);
+		protocol_unbind_all();
+		exit(1);
+	}
+
 #ifdef CONFIG_HAP_CTTPROXY
 	if (global.last_checks & LSTCHK_CTTPROXY) {
 		int ret;
@@ -1407,6 +1437,11 @@ int main(int argc, char **argv)
 		fork_poller();
 	}
 
+	if (logging_start() < 0)
+		Warning("[%s.main()] Cannot open the debug messages file, they will be lost.\n", argv[0]);
+
+	cache_start();
+
 	protocol_enable_all();
 	/*
 	 * That's it : the central polling loop. Run until we stop.
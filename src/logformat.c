@@ -0,0 +1,1095 @@
+/*
+ * Log-format parsing, compilation and log line construction.
+ *
+ * Copyright 2000-2012 Willy Tarreau <w@1wt.eu>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <common/config.h>
+#include <common/standard.h>
+#include <common/time.h>
+
+#include <types/global.h>
+#include <types/log.h>
+
+#include <proto/log.h>
+#include <proto/stream_interface.h>
+
+const char sess_term_cond[16] = "-cCsSPRIDKUIIIII"; /* normal, CliTo, CliErr, SrvTo, SrvErr, PxErr, Resource, Internal, Down, Killed, Up, -- */
+const char sess_fin_state[8]  = "-RCHDLQT";	/* cliRequest, srvConnect, srvHeader, Data, Last, Queue, Tarpit */
+
+/* log_format   */
+struct logformat_type {
+	char *name;
+	int type;
+	int mode;
+	int lw; /* logwait bitsfield */
+	int (*config_callback)(struct logformat_node *node, struct proxy *curproxy);
+};
+
+int prepare_addrsource(struct logformat_node *node, struct proxy *curproxy);
+
+/* log_format variable names */
+static const struct logformat_type logformat_keywords[] = {
+	{ "o", LOG_FMT_GLOBAL, PR_MODE_TCP, 0, NULL },  /* global option */
+	{ "Ci", LOG_FMT_CLIENTIP, PR_MODE_TCP, LW_CLIP, NULL },  /* client ip */
+	{ "Cp", LOG_FMT_CLIENTPORT, PR_MODE_TCP, LW_CLIP, NULL }, /* client port */
+	{ "Bp", LOG_FMT_BACKENDPORT, PR_MODE_TCP, LW_BCKIP, prepare_addrsource }, /* backend source port */
+	{ "Bi", LOG_FMT_BACKENDIP, PR_MODE_TCP, LW_BCKIP, prepare_addrsource }, /* backend source ip */
+	{ "Fp", LOG_FMT_FRONTENDPORT, PR_MODE_TCP, LW_FRTIP, NULL }, /* frontend port */
+	{ "Fi", LOG_FMT_FRONTENDIP, PR_MODE_TCP, LW_FRTIP, NULL }, /* frontend ip */
+	{ "Sp", LOG_FMT_SERVERPORT, PR_MODE_TCP, LW_SVIP, NULL }, /* server destination port */
+	{ "Si", LOG_FMT_SERVERIP, PR_MODE_TCP, LW_SVIP, NULL }, /* server destination ip */
+	{ "t", LOG_FMT_DATE, PR_MODE_TCP, LW_INIT, NULL },      /* date */
+	{ "T", LOG_FMT_DATEGMT, PR_MODE_TCP, LW_INIT, NULL },   /* date GMT */
+	{ "Ts", LOG_FMT_TS, PR_MODE_TCP, LW_INIT, NULL },   /* timestamp GMT */
+	{ "ms", LOG_FMT_MS, PR_MODE_TCP, LW_INIT, NULL },       /* accept date millisecond */
+	{ "f", LOG_FMT_FRONTEND, PR_MODE_TCP, LW_INIT, NULL },  /* frontend */
+	{ "b", LOG_FMT_BACKEND, PR_MODE_TCP, LW_INIT, NULL },   /* backend */
+	{ "s", LOG_FMT_SERVER, PR_MODE_TCP, LW_SVID, NULL },    /* server */
+	{ "B", LOG_FMT_BYTES, PR_MODE_TCP, LW_BYTES, NULL },     /* bytes read */
+	{ "Tq", LOG_FMT_TQ, PR_MODE_HTTP, LW_BYTES, NULL },       /* Tq */
+	{ "Tw", LOG_FMT_TW, PR_MODE_TCP, LW_BYTES, NULL },       /* Tw */
+	{ "Tc", LOG_FMT_TC, PR_MODE_TCP, LW_BYTES, NULL },       /* Tc */
+	{ "Tr", LOG_FMT_TR, PR_MODE_HTTP, LW_BYTES, NULL },       /* Tr */
+	{ "Tt", LOG_FMT_TT, PR_MODE_TCP, LW_BYTES, NULL },       /* Tt */
+	{ "st", LOG_FMT_STATUS, PR_MODE_HTTP, LW_RESP, NULL },   /* status code */
+	{ "cc", LOG_FMT_CCLIENT, PR_MODE_HTTP, LW_REQHDR, NULL },  /* client cookie */
+	{ "cs", LOG_FMT_CSERVER, PR_MODE_HTTP, LW_RSPHDR, NULL },  /* server cookie */
+	{ "ts", LOG_FMT_TERMSTATE, PR_MODE_TCP, LW_BYTES, NULL },/* termination state */
+	{ "tsc", LOG_FMT_TERMSTATE_CK, PR_MODE_TCP, LW_INIT, NULL },/* termination state */
+	{ "ac", LOG_FMT_ACTCONN, PR_MODE_TCP, LW_BYTES, NULL },  /* actconn */
+	{ "fc", LOG_FMT_FECONN, PR_MODE_TCP, LW_BYTES, NULL },   /* feconn */
+	{ "bc", LOG_FMT_BECONN, PR_MODE_TCP, LW_BYTES, NULL },   /* beconn */
+	{ "sc", LOG_FMT_SRVCONN, PR_MODE_TCP, LW_BYTES, NULL },  /* srv_conn */
+	{ "rc", LOG_FMT_RETRIES, PR_MODE_TCP, LW_BYTES, NULL },  /* retries */
+	{ "sq", LOG_FMT_SRVQUEUE, PR_MODE_TCP, LW_BYTES, NULL  }, /* srv_queue */
+	{ "bq", LOG_FMT_BCKQUEUE, PR_MODE_TCP, LW_BYTES, NULL }, /* backend_queue */
+	{ "hr", LOG_FMT_HDRREQUEST, PR_MODE_HTTP, LW_REQHDR, NULL }, /* header request */
+	{ "hs", LOG_FMT_HDRRESPONS, PR_MODE_HTTP, LW_RSPHDR, NULL },  /* header response */
+	{ "hrl", LOG_FMT_HDRREQUESTLIST, PR_MODE_HTTP, LW_REQHDR, NULL }, /* header request list */
+	{ "hsl", LOG_FMT_HDRRESPONSLIST, PR_MODE_HTTP, LW_RSPHDR, NULL },  /* header response list */
+	{ "r", LOG_FMT_REQ, PR_MODE_HTTP, LW_REQ, NULL },  /* request */
+	{ "pid", LOG_FMT_PID, PR_MODE_TCP, LW_INIT, NULL }, /* log pid */
+	{ "rt", LOG_FMT_COUNTER, PR_MODE_HTTP, LW_REQ, NULL }, /* HTTP request counter */
+	{ "H", LOG_FMT_HOSTNAME, PR_MODE_TCP, LW_INIT, NULL }, /* Hostname */
+	{ "ID", LOG_FMT_UNIQUEID, PR_MODE_HTTP, LW_BYTES, NULL }, /* Unique ID */
+	{ 0, 0, 0, 0, NULL }
+};
+
+char default_http_log_format[] = "%Ci:%Cp [%t] %f %b/%s %Tq/%Tw/%Tc/%Tr/%Tt %st %B %cc %cs %tsc %ac/%fc/%bc/%sc/%rc %sq/%bq %hr %hs %{+Q}r"; // default format
+char clf_http_log_format[] = "%{+Q}o %{-Q}Ci - - [%T] %r %st %B \"\" \"\" %Cp %ms %f %b %s %Tq %Tw %Tc %Tr %Tt %tsc %ac %fc %bc %sc %rc %sq %bq %cc %cs %hrl %hsl";
+char default_tcp_log_format[] = "%Ci:%Cp [%t] %f %b/%s %Tw/%Tc/%Tt %B %ts %ac/%fc/%bc/%sc/%rc %sq/%bq";
+char *log_format = NULL;
+
+struct logformat_var_args {
+	char *name;
+	int mask;
+};
+
+struct logformat_var_args var_args_list[] = {
+// global
+	{ "M", LOG_OPT_MANDATORY },
+	{ "Q", LOG_OPT_QUOTE },
+	{ "X", LOG_OPT_HEXA },
+	{  0,  0 }
+};
+
+/*
+ * callback used to configure addr source retrieval
+ */
+int prepare_addrsource(struct logformat_node *node, struct proxy *curproxy)
+{
+	curproxy->options2 |= PR_O2_SRC_ADDR;
+
+	return 0;
+}
+
+
+/*
+ * Parse args in a logformat_var
+ */
+int parse_logformat_var_args(char *args, struct logformat_node *node)
+{
+	int i = 0;
+	int end = 0;
+	int flags = 0;  // 1 = +  2 = -
+	char *sp = NULL; // start pointer
+
+	if (args == NULL)
+		return 1;
+
+	while (1) {
+		if (*args == '\0')
+			end = 1;
+
+		if (*args == '+') {
+			// add flag
+			sp = args + 1;
+			flags = 1;
+		}
+		if (*args == '-') {
+			// delete flag
+			sp = args + 1;
+			flags = 2;
+		}
+
+		if (*args == '\0' || *args == ',') {
+			*args = '\0';
+			for (i = 0; var_args_list[i].name; i++) {
+				if (strcmp(sp, var_args_list[i].name) == 0) {
+					if (flags == 1) {
+						node->options |= var_args_list[i].mask;
+						break;
+					} else if (flags == 2) {
+						node->options &= ~var_args_list[i].mask;
+						break;
+					}
+				}
+			}
+			sp = NULL;
+			if (end)
+				break;
+		}
+	args++;
+	}
+	return 0;
+}
+
+/*
+ * Parse a variable '%varname' or '%{args}varname' in logformat
+ *
+ */
+int parse_logformat_var(char *str, size_t len, struct proxy *curproxy, struct list *list_format, int *defoptions)
+{
+	int i, j;
+	char *arg = NULL; // arguments
+	int fparam = 0;
+	char *name = NULL;
+	struct logformat_node *node = NULL;
+	char varname[255] = { 0 }; // variable name
+
+	for (i = 1; i < len; i++) { // escape first char %
+		if (!arg && str[i] == '{') {
+			arg = str + i;
+			fparam = 1;
+		} else if (arg && str[i] == '}') {
+			char *tmp = arg;
+			arg = calloc(str + i - tmp, 1); // without {}
+			strncpy(arg, tmp + 1, str + i - tmp - 1); // copy without { and }
+			arg[str + i - tmp - 1] = '\0';
+			fparam = 0;
+		} else if (!name && !fparam) {
+			strncpy(varname, str + i, len - i + 1);
+			varname[len - i] = '\0';
+			for (j = 0; logformat_keywords[j].name; j++) { // search a log type
+				if (strcmp(varname, logformat_keywords[j].name) == 0) {
+					if (!((logformat_keywords[j].mode == PR_MODE_HTTP) && (curproxy->mode == PR_MODE_TCP))) {
+						node = calloc(1, sizeof(struct logformat_node));
+						node->type = logformat_keywords[j].type;
+						node->options = *defoptions;
+						node->arg = arg;
+						parse_logformat_var_args(node->arg, node);
+						if (node->type == LOG_FMT_GLOBAL) {
+							*defoptions = node->options;
+							free(node);
+						} else {
+							if (logformat_keywords[j].config_callback != NULL) {
+								if (logformat_keywords[j].config_callback(node, curproxy) != 0) {
+									return -1;
+								 }
+							}
+							curproxy->to_log |= logformat_keywords[j].lw;
+							LIST_ADDQ(list_format, &node->list);
+						}
+						return 0;
+					} else {
+						Warning("Warning: No such variable name '%s' in this log mode\n", varname);
+						if (arg)
+							free(arg);
+						return -1;
+					}
+				}
+			}
+			Warning("Warning: No such variable name '%s' in logformat\n", varname);
+			if (arg)
+				free(arg);
+			return -1;
+		}
+	}
+	return -1;
+}
+
+/*
+ *  push to the logformat linked list
+ *
+ *  start: start pointer
+ *  end: end text pointer
+ *  type: string type
+ *  list_format: destination list
+ *
+ *  LOG_TEXT: copy chars from start to end excluding end.
+ *
+*/
+void add_to_logformat_list(char *start, char *end, int type, struct list *list_format)
+{
+	char *str;
+
+	if (type == LOG_FMT_TEXT) { /* type text */
+		struct logformat_node *node = calloc(1, sizeof(struct logformat_node));
+		str = calloc(end - start + 1, 1);
+		strncpy(str, start, end - start);
+		str[end - start] = '\0';
+		node->arg = str;
+		node->type = LOG_FMT_TEXT; // type string
+		LIST_ADDQ(list_format, &node->list);
+	} else if (type == LOG_FMT_SEPARATOR) {
+		struct logformat_node *node = calloc(1, sizeof(struct logformat_node));
+		node->type = LOG_FMT_SEPARATOR;
+		LIST_ADDQ(list_format, &node->list);
+	}
+}
+
+/*
+ * Parse the log_format string and fill a linked list.
+ * Variable name are preceded by % and composed by characters [a-zA-Z0-9]* : %varname
+ * You can set arguments using { } : %{many arguments}varname
+ *
+ *  str: the string to parse
+ *  curproxy: the proxy affected
+ *  list_format: the destination list
+ *  capabilities: PR_MODE_TCP_ | PR_MODE_HTTP
+ */
+void parse_logformat_string(char *str, struct proxy *curproxy, struct list *list_format, int capabilities)
+{
+	char *sp = str; /* start pointer */
+	int cformat = -1; /* current token format : LOG_TEXT, LOG_SEPARATOR, LOG_VARIABLE */
+	int pformat = -1; /* previous token format */
+	struct logformat_node *tmplf, *back;
+	int options = 0;
+
+	curproxy->to_log = LW_INIT;
+
+	/* flush the list first. */
+	list_for_each_entry_safe(tmplf, back, list_format, list) {
+		LIST_DEL(&tmplf->list);
+		free(tmplf);
+	}
+
+	while (1) {
+
+		// push the variable only if formats are different, not
+		// within a variable, and not the first iteration
+		if ((cformat != pformat && cformat != -1 && pformat != -1) || *str == '\0') {
+			if (((pformat != LF_STARTVAR && cformat != LF_VAR) &&
+			    (pformat != LF_STARTVAR && cformat != LF_STARG) &&
+			    (pformat != LF_STARG && cformat !=  LF_VAR)) || *str == '\0') {
+				if (pformat > LF_VAR) // unfinished string
+					pformat = LF_TEXT;
+				if (pformat == LF_VAR)
+					parse_logformat_var(sp, str - sp, curproxy, list_format, &options);
+				else
+					add_to_logformat_list(sp, str, pformat, list_format);
+				sp = str;
+				if (*str == '\0')
+					break;
+			    }
+		}
+
+		if (cformat != -1)
+			str++; // consume the string, except on the first tour
+
+		pformat = cformat;
+
+		if (*str == '\0') {
+			cformat = LF_STARTVAR; // for breaking in all cases
+			continue;
+		}
+
+		if (pformat == LF_STARTVAR) { // after a %
+			if ( (*str >= 'a' && *str <= 'z') || // parse varname
+			     (*str >= 'A' && *str <= 'Z') ||
+			     (*str >= '0' && *str <= '9')) {
+				cformat = LF_VAR; // varname
+				continue;
+			} else if (*str == '{') {
+				cformat = LF_STARG; // variable arguments
+				continue;
+			} else { // another unexpected token
+				pformat = LF_TEXT; // redefine the format of the previous token to TEXT
+				cformat = LF_TEXT;
+				continue;
+			}
+
+		} else if (pformat == LF_VAR) { // after a varname
+			if ( (*str >= 'a' && *str <= 'z') || // parse varname
+			     (*str >= 'A' && *str <= 'Z') ||
+			     (*str >= '0' && *str <= '9')) {
+				cformat = LF_VAR;
+				continue;
+			}
+		} else if (pformat  == LF_STARG) { // inside variable arguments
+			if (*str == '}') { // end of varname
+				cformat = LF_EDARG;
+				continue;
+			} else { // all tokens are acceptable within { }
+				cformat = LF_STARG;
+				continue;
+			}
+		} else if (pformat == LF_EDARG) { //  after arguments
+			if ( (*str >= 'a' && *str <= 'z') || // parse a varname
+			     (*str >= 'A' && *str <= 'Z') ||
+			     (*str >= '0' && *str <= '9')) {
+				cformat = LF_VAR;
+				continue;
+			} else { // if no varname after arguments, transform in TEXT
+				pformat = LF_TEXT;
+				cformat = LF_TEXT;
+			}
+		}
+
+		// others tokens that don't match previous conditions
+		if (*str == '%') {
+			cformat = LF_STARTVAR;
+		} else if (*str == ' ') {
+			cformat = LF_SEPARATOR;
+		} else {
+			cformat = LF_TEXT;
+		}
+	}
+}
+
+/*
+ * Write a string in the log string
+ * Take cares of quote options
+ *
+ * Return the adress of the \0 character, or NULL on error
+ */
+char *lf_text(char *dst, char *src, size_t size, int options)
+{
+	int n;
+
+	if (src == NULL || *src == '\0') {
+		if (options & LOG_OPT_QUOTE) {
+			if (size > 2) {
+				*(dst++) = '"';
+				*(dst++) = '"';
+				*dst = '\0';
+			} else {
+				dst = NULL;
+				return dst;
+			}
+		} else {
+			if (size > 1) {
+				*(dst++) = '-';
+				*dst = '\0';
+			} else { // error no space available
+				dst = NULL;
+				return dst;
+			}
+		}
+	} else {
+		if (options & LOG_OPT_QUOTE) {
+			if (size-- > 1 ) {
+				*(dst++) = '"';
+			} else {
+				dst = NULL;
+				return NULL;
+			}
+			n = strlcpy2(dst, src, size);
+			size -= n;
+			dst += n;
+			if (size > 1) {
+				*(dst++) = '"';
+				*dst = '\0';
+			} else {
+				dst = NULL;
+			}
+		} else {
+			dst += strlcpy2(dst, src, size);
+		}
+	}
+	return dst;
+}
+
+/*
+ * Write a IP adress to the log string
+ * +X option write in hexadecimal notation, most signifant byte on the left
+ */
+char *lf_ip(char *dst, struct sockaddr *sockaddr, size_t size, int options)
+{
+	char pn[INET6_ADDRSTRLEN];
+
+	if (options & LOG_OPT_HEXA)
+		return uxtoa_o(ntohl(((struct sockaddr_in *)sockaddr)->sin_addr.s_addr), dst, size, 8);
+
+	/* IPv4 addresses are directly written unless quoted */
+	if (sockaddr->sa_family == AF_INET && !(options & LOG_OPT_QUOTE))
+		return ip4toa_o(&((struct sockaddr_in *)sockaddr)->sin_addr, dst, size);
+
+	addr_to_str((struct sockaddr_storage *)sockaddr, pn, sizeof(pn));
+	return lf_text(dst, pn, size, options);
+}
+
+/*
+ * Write a port to the log
+ * +X option write in hexadecimal notation, most signifant byte on the left
+ */
+char *lf_port(char *dst, struct sockaddr *sockaddr, size_t size, int options)
+{
+	char *ret = dst;
+
+	if (options & LOG_OPT_HEXA) {
+		ret = uxtoa_o(ntohs(((struct sockaddr_in *)sockaddr)->sin_port), dst, size, 4);
+		if (ret == NULL)
+			return NULL;
+	} else {
+		ret = ltoa_o(get_host_port((struct sockaddr_storage *)sockaddr), dst, size);
+		if (ret == NULL)
+			return NULL;
+	}
+	return ret;
+}
+
+extern fd_set hdr_encode_map[];
+extern fd_set url_encode_map[];
+
+
+const char sess_cookie[8]     = "NIDVEOU7";	/* No cookie, Invalid cookie, cookie for a Down server, Valid cookie, Expired cookie, Old cookie, Unused, unknown */
+const char sess_set_cookie[8] = "NPDIRU67";	/* No set-cookie, Set-cookie found and left unchanged (passive),
+						   Set-cookie Deleted, Set-Cookie Inserted, Set-cookie Rewritten,
+						   Set-cookie Updated, unknown, unknown */
+
+/*
+ * try to write a character if there is enough space, or return NULL. It is
+ * used by the emitters below, which must have set <end> to the last byte
+ * available, which is reserved for the trailing zero.
+ */
+#define LOGCHAR(x) do { \
+			if (dst >= end) \
+				return NULL; \
+			*(dst++) = (x); \
+		} while(0)
+
+/* Per-line context of the emitters of a compiled log-format */
+struct logformat_ctx {
+	struct session *s;
+	int t_request;			/* -2 until computed */
+	int last_isspace;		/* 1 if the last character is a separator */
+};
+
+/* Returns the request time of the session, computing it on first use */
+static inline int lf_t_request(struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	if (ctx->t_request == -2) {
+		ctx->t_request = -1;
+		if (tv_isge(&s->logs.tv_request, &s->logs.tv_accept))
+			ctx->t_request = tv_ms_elapsed(&s->logs.tv_accept, &s->logs.tv_request);
+	}
+	return ctx->t_request;
+}
+
+/*
+ * The emitters below write one element of a log line at <dst>, where <size>
+ * bytes including the trailing zero are available. They return the new end
+ * of the line, or NULL if the element does not fit, in which case the line
+ * ends before it. There is one of them per type of field, so that the choice
+ * is made once when the log-format is compiled by compile_logformat().
+ */
+
+/* constant text, merged with the separators known to be printed */
+static char *lf_emit_text(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	if (insn->len >= size)
+		return NULL;
+	memcpy(dst, insn->text, insn->len);
+	ctx->last_isspace = insn->options;
+	return dst + insn->len;
+}
+
+/* separator following a field which may print nothing */
+static char *lf_emit_separator(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	if (!ctx->last_isspace) {
+		if (size <= 1)
+			return NULL;
+		*(dst++) = ' ';
+		ctx->last_isspace = 1;
+	}
+	return dst;
+}
+
+/* signed integer, the value is returned by <val> */
+#define LF_EMIT_LONG(name, val)								\
+static char *name(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx) \
+{											\
+	dst = ltoa_o((val), dst, size);							\
+	ctx->last_isspace = 0;								\
+	return dst;									\
+}
+
+/* integer printed in hexadecimal on <digits> digits with the "X" option */
+#define LF_EMIT_HEXA(name, val, digits)							\
+static char *name(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx) \
+{											\
+	if (insn->options & LOG_OPT_HEXA)						\
+		dst = uxtoa_o((val), dst, size, (digits));				\
+	else										\
+		dst = ltoa_o((val), dst, size);						\
+	ctx->last_isspace = 0;								\
+	return dst;									\
+}
+
+/* string which may be quoted, "-" when empty */
+#define LF_EMIT_TEXT(name, val)								\
+static char *name(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx) \
+{											\
+	dst = lf_text(dst, (val), size, insn->options);					\
+	ctx->last_isspace = 0;								\
+	return dst;									\
+}
+
+LF_EMIT_LONG(lf_emit_tq, lf_t_request(ctx))
+LF_EMIT_LONG(lf_emit_tw, (ctx->s->logs.t_queue >= 0) ? ctx->s->logs.t_queue - lf_t_request(ctx) : -1)
+LF_EMIT_LONG(lf_emit_tc, (ctx->s->logs.t_connect >= 0) ? ctx->s->logs.t_connect - ctx->s->logs.t_queue : -1)
+LF_EMIT_LONG(lf_emit_tr, (ctx->s->logs.t_data >= 0) ? ctx->s->logs.t_data - ctx->s->logs.t_connect : -1)
+LF_EMIT_LONG(lf_emit_status, ctx->s->txn.status)
+LF_EMIT_LONG(lf_emit_actconn, actconn)
+LF_EMIT_LONG(lf_emit_feconn, ctx->s->fe->feconn)
+LF_EMIT_LONG(lf_emit_beconn, ctx->s->be->beconn)
+LF_EMIT_LONG(lf_emit_srvqueue, ctx->s->logs.srv_queue_size)
+LF_EMIT_LONG(lf_emit_bckqueue, ctx->s->logs.prx_queue_size)
+
+LF_EMIT_HEXA(lf_emit_ts, (unsigned int)ctx->s->logs.accept_date.tv_sec, 4)
+LF_EMIT_HEXA(lf_emit_counter, global.req_count, 4)
+LF_EMIT_HEXA(lf_emit_pid, pid, 4)
+
+LF_EMIT_TEXT(lf_emit_frontend, ctx->s->fe->id)
+LF_EMIT_TEXT(lf_emit_backend, ctx->s->be->id)
+LF_EMIT_TEXT(lf_emit_cclient, ctx->s->txn.cli_cookie)
+LF_EMIT_TEXT(lf_emit_cserver, ctx->s->txn.srv_cookie)
+LF_EMIT_TEXT(lf_emit_hostname, hostname)
+LF_EMIT_TEXT(lf_emit_uniqueid, ctx->s->unique_id)
+
+static char *lf_emit_clientip(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	ctx->last_isspace = 0;
+	return lf_ip(dst, (struct sockaddr *)&s->req->prod->addr.from, size, insn->options);
+}
+
+static char *lf_emit_clientport(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	ctx->last_isspace = 0;
+	if (s->req->prod->addr.from.ss_family == AF_UNIX)
+		return ltoa_o(s->listener->luid, dst, size);
+	return lf_port(dst, (struct sockaddr *)&s->req->prod->addr.from, size, insn->options);
+}
+
+static char *lf_emit_frontendip(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	si_get_to_addr(s->req->prod);
+	ctx->last_isspace = 0;
+	return lf_ip(dst, (struct sockaddr *)&s->req->prod->addr.to, size, insn->options);
+}
+
+static char *lf_emit_frontendport(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	si_get_to_addr(s->req->prod);
+	ctx->last_isspace = 0;
+	if (s->req->prod->addr.to.ss_family == AF_UNIX)
+		return ltoa_o(s->listener->luid, dst, size);
+	return lf_port(dst, (struct sockaddr *)&s->req->prod->addr.to, size, insn->options);
+}
+
+static char *lf_emit_backendip(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	ctx->last_isspace = 0;
+	return lf_ip(dst, (struct sockaddr *)&s->req->cons->addr.from, size, insn->options);
+}
+
+static char *lf_emit_backendport(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	ctx->last_isspace = 0;
+	return lf_port(dst, (struct sockaddr *)&s->req->cons->addr.from, size, insn->options);
+}
+
+static char *lf_emit_serverip(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	ctx->last_isspace = 0;
+	return lf_ip(dst, (struct sockaddr *)&s->req->cons->addr.to, size, insn->options);
+}
+
+static char *lf_emit_serverport(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	ctx->last_isspace = 0;
+	return lf_port(dst, (struct sockaddr *)&s->req->cons->addr.to, size, insn->options);
+}
+
+/* The broken-down accept date only changes once a second for all sessions,
+ * so the last one is kept for the local and the GMT date.
+ */
+static char *lf_emit_date(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	static time_t last = -1;
+	static struct tm tm;
+	struct session *s = ctx->s;
+
+	if (s->logs.accept_date.tv_sec != last) {
+		last = s->logs.accept_date.tv_sec;
+		get_localtime(last, &tm);
+	}
+	ctx->last_isspace = 0;
+	return date2str_log(dst, &tm, &s->logs.accept_date, size);
+}
+
+static char *lf_emit_dategmt(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	static time_t last = -1;
+	static struct tm tm;
+	struct session *s = ctx->s;
+
+	if (s->logs.accept_date.tv_sec != last) {
+		last = s->logs.accept_date.tv_sec;
+		get_gmtime(last, &tm);
+	}
+	ctx->last_isspace = 0;
+	return gmt2str_log(dst, &tm, size);
+}
+
+static char *lf_emit_ms(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+	unsigned int ms = (unsigned int)s->logs.accept_date.tv_usec / 1000;
+
+	ctx->last_isspace = 0;
+	if (insn->options & LOG_OPT_HEXA)
+		return uxtoa_o(ms, dst, size, 2);
+	if (size < 4)
+		return NULL;
+	return utoa_pad(ms, dst, 4);
+}
+
+static char *lf_emit_server(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+	const char *svid;
+
+	/* FIXME: let's limit ourselves to frontend logging for now. */
+	if (!(s->fe->to_log & LW_SVID))
+		svid = "-";
+	else switch (s->target.type) {
+	case TARG_TYPE_SERVER:
+		svid = s->target.ptr.s->id;
+		break;
+	case TARG_TYPE_APPLET:
+		svid = s->target.ptr.a->name;
+		break;
+	default:
+		svid = "<NOSRV>";
+		break;
+	}
+
+	ctx->last_isspace = 0;
+	return lf_text(dst, (char *)svid, size, insn->options);
+}
+
+static char *lf_emit_tt(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+	char *end = dst + size - 1;
+
+	if (!(s->fe->to_log & LW_BYTES))
+		LOGCHAR('+');
+	ctx->last_isspace = 0;
+	return ltoa_o(s->logs.t_close, dst, end - dst + 1);
+}
+
+static char *lf_emit_bytes(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+	char *end = dst + size - 1;
+
+	if (!(s->fe->to_log & LW_BYTES))
+		LOGCHAR('+');
+	ctx->last_isspace = 0;
+	return lltoa(s->logs.bytes_out, dst, end - dst + 1);
+}
+
+static char *lf_emit_termstate(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+	char *end = dst + size - 1;
+
+	LOGCHAR(sess_term_cond[(s->flags & SN_ERR_MASK) >> SN_ERR_SHIFT]);
+	LOGCHAR(sess_fin_state[(s->flags & SN_FINST_MASK) >> SN_FINST_SHIFT]);
+	ctx->last_isspace = 0;
+	return dst;
+}
+
+static char *lf_emit_termstate_ck(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+	struct http_txn *txn = &s->txn;
+	char *end = dst + size - 1;
+
+	LOGCHAR(sess_term_cond[(s->flags & SN_ERR_MASK) >> SN_ERR_SHIFT]);
+	LOGCHAR(sess_fin_state[(s->flags & SN_FINST_MASK) >> SN_FINST_SHIFT]);
+	LOGCHAR((s->be->ck_opts & PR_CK_ANY) ? sess_cookie[(txn->flags & TX_CK_MASK) >> TX_CK_SHIFT] : '-');
+	LOGCHAR((s->be->ck_opts & PR_CK_ANY) ? sess_set_cookie[(txn->flags & TX_SCK_MASK) >> TX_SCK_SHIFT] : '-');
+	ctx->last_isspace = 0;
+	return dst;
+}
+
+static char *lf_emit_srvconn(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	ctx->last_isspace = 0;
+	return ultoa_o(target_srv(&s->target) ? target_srv(&s->target)->cur_sess : 0, dst, size);
+}
+
+static char *lf_emit_retries(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+	char *end = dst + size - 1;
+
+	if (s->flags & SN_REDISP)
+		LOGCHAR('+');
+	ctx->last_isspace = 0;
+	return ltoa_o((s->req->cons->conn_retries > 0) ?
+		      (s->be->conn_retries - s->req->cons->conn_retries) :
+		      s->be->conn_retries, dst, end - dst + 1);
+}
+
+/* Captured headers between braces, separated by '|' */
+static char *lf_hdr_block(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx,
+			  char **cap, int nb_cap)
+{
+	char *end = dst + size - 1;
+	int hdr;
+
+	if (insn->options & LOG_OPT_QUOTE)
+		LOGCHAR('"');
+	LOGCHAR('{');
+	for (hdr = 0; hdr < nb_cap; hdr++) {
+		if (hdr)
+			LOGCHAR('|');
+		if (cap[hdr] != NULL) {
+			dst = encode_string(dst, end + 1, '#', hdr_encode_map, cap[hdr]);
+			if (dst == NULL || *dst != '\0')
+				return NULL;
+		}
+	}
+	LOGCHAR('}');
+	if (insn->options & LOG_OPT_QUOTE)
+		LOGCHAR('"');
+	ctx->last_isspace = 0;
+	return dst;
+}
+
+/* Captured headers separated by spaces, "-" when missing */
+static char *lf_hdr_list(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx,
+			 char **cap, int nb_cap)
+{
+	char *end = dst + size - 1;
+	int hdr;
+
+	for (hdr = 0; hdr < nb_cap; hdr++) {
+		if (hdr > 0)
+			LOGCHAR(' ');
+		if (insn->options & LOG_OPT_QUOTE)
+			LOGCHAR('"');
+		if (cap[hdr] != NULL) {
+			dst = encode_string(dst, end + 1, '#', hdr_encode_map, cap[hdr]);
+			if (dst == NULL || *dst != '\0')
+				return NULL;
+		} else if (!(insn->options & LOG_OPT_QUOTE))
+			LOGCHAR('-');
+		if (insn->options & LOG_OPT_QUOTE)
+			LOGCHAR('"');
+		ctx->last_isspace = 0;
+	}
+	return dst;
+}
+
+static char *lf_emit_hdrrequest(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	if (!(s->fe->to_log & LW_REQHDR) || !s->txn.req.cap)
+		return dst;
+	return lf_hdr_block(dst, size, insn, ctx, s->txn.req.cap, s->fe->nb_req_cap);
+}
+
+static char *lf_emit_hdrrespons(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	if (!(s->fe->to_log & LW_RSPHDR) || !s->txn.rsp.cap)
+		return dst;
+	return lf_hdr_block(dst, size, insn, ctx, s->txn.rsp.cap, s->fe->nb_rsp_cap);
+}
+
+static char *lf_emit_hdrrequestlist(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	if (!(s->fe->to_log & LW_REQHDR) || !s->txn.req.cap)
+		return dst;
+	return lf_hdr_list(dst, size, insn, ctx, s->txn.req.cap, s->fe->nb_req_cap);
+}
+
+static char *lf_emit_hdrresponslist(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+
+	if (!(s->fe->to_log & LW_RSPHDR) || !s->txn.rsp.cap)
+		return dst;
+	return lf_hdr_list(dst, size, insn, ctx, s->txn.rsp.cap, s->fe->nb_rsp_cap);
+}
+
+static char *lf_emit_req(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx)
+{
+	struct session *s = ctx->s;
+	char *end = dst + size - 1;
+
+	if (insn->options & LOG_OPT_QUOTE)
+		LOGCHAR('"');
+	dst = encode_string(dst, end + 1, '#', url_encode_map, s->txn.uri ? s->txn.uri : "<BADREQ>");
+	if (dst == NULL || *dst != '\0')
+		return NULL;
+	if (insn->options & LOG_OPT_QUOTE)
+		LOGCHAR('"');
+	ctx->last_isspace = 0;
+	return dst;
+}
+
+/* Emitters of the fields, indexed by their LOG_FMT_* type. The ones of the
+ * fields which may print nothing are marked with LF_EMIT_F_OPTIONAL so that
+ * the following separator is still checked at runtime.
+ */
+#define LF_EMIT_F_OPTIONAL 0x1
+
+static const struct {
+	char *(*emit)(char *dst, size_t size, const struct logformat_insn *insn, struct logformat_ctx *ctx);
+	int flags;
+} lf_emitters[] = {
+	[LOG_FMT_CLIENTIP]       = { lf_emit_clientip,       0 },
+	[LOG_FMT_CLIENTPORT]     = { lf_emit_clientport,     0 },
+	[LOG_FMT_BACKENDIP]      = { lf_emit_backendip,      0 },
+	[LOG_FMT_BACKENDPORT]    = { lf_emit_backendport,    0 },
+	[LOG_FMT_FRONTENDIP]     = { lf_emit_frontendip,     0 },
+	[LOG_FMT_FRONTENDPORT]   = { lf_emit_frontendport,   0 },
+	[LOG_FMT_SERVERPORT]     = { lf_emit_serverport,     0 },
+	[LOG_FMT_SERVERIP]       = { lf_emit_serverip,       0 },
+	[LOG_FMT_COUNTER]        = { lf_emit_counter,        0 },
+	[LOG_FMT_PID]            = { lf_emit_pid,            0 },
+	[LOG_FMT_DATE]           = { lf_emit_date,           0 },
+	[LOG_FMT_DATEGMT]        = { lf_emit_dategmt,        0 },
+	[LOG_FMT_TS]             = { lf_emit_ts,             0 },
+	[LOG_FMT_MS]             = { lf_emit_ms,             0 },
+	[LOG_FMT_FRONTEND]       = { lf_emit_frontend,       0 },
+	[LOG_FMT_BACKEND]        = { lf_emit_backend,        0 },
+	[LOG_FMT_SERVER]         = { lf_emit_server,         0 },
+	[LOG_FMT_BYTES]          = { lf_emit_bytes,          0 },
+	[LOG_FMT_TQ]             = { lf_emit_tq,             0 },
+	[LOG_FMT_TW]             = { lf_emit_tw,             0 },
+	[LOG_FMT_TC]             = { lf_emit_tc,             0 },
+	[LOG_FMT_TR]             = { lf_emit_tr,             0 },
+	[LOG_FMT_TT]             = { lf_emit_tt,             0 },
+	[LOG_FMT_STATUS]         = { lf_emit_status,         0 },
+	[LOG_FMT_CCLIENT]        = { lf_emit_cclient,        0 },
+	[LOG_FMT_CSERVER]        = { lf_emit_cserver,        0 },
+	[LOG_FMT_TERMSTATE]      = { lf_emit_termstate,      0 },
+	[LOG_FMT_TERMSTATE_CK]   = { lf_emit_termstate_ck,   0 },
+	[LOG_FMT_ACTCONN]        = { lf_emit_actconn,        0 },
+	[LOG_FMT_FECONN]         = { lf_emit_feconn,         0 },
+	[LOG_FMT_BECONN]         = { lf_emit_beconn,         0 },
+	[LOG_FMT_SRVCONN]        = { lf_emit_srvconn,        0 },
+	[LOG_FMT_RETRIES]        = { lf_emit_retries,        0 },
+	[LOG_FMT_SRVQUEUE]       = { lf_emit_srvqueue,       0 },
+	[LOG_FMT_BCKQUEUE]       = { lf_emit_bckqueue,       0 },
+	[LOG_FMT_HDRREQUEST]     = { lf_emit_hdrrequest,     LF_EMIT_F_OPTIONAL },
+	[LOG_FMT_HDRRESPONS]     = { lf_emit_hdrrespons,     LF_EMIT_F_OPTIONAL },
+	[LOG_FMT_HDRREQUESTLIST] = { lf_emit_hdrrequestlist, LF_EMIT_F_OPTIONAL },
+	[LOG_FMT_HDRRESPONSLIST] = { lf_emit_hdrresponslist, LF_EMIT_F_OPTIONAL },
+	[LOG_FMT_REQ]            = { lf_emit_req,            0 },
+	[LOG_FMT_HOSTNAME]       = { lf_emit_hostname,       0 },
+	[LOG_FMT_UNIQUEID]       = { lf_emit_uniqueid,       0 },
+};
+
+/*
+ * Compiles the log-format <list_format> into a flat array of emitters. The
+ * consecutive texts are merged together with the separators which are known
+ * to be printed, and the other separators are dropped, so that only the ones
+ * following fields which may print nothing remain. Returns the program, or
+ * NULL if there is not enough memory.
+ */
+struct logformat_prog *compile_logformat(struct list *list_format)
+{
+	struct logformat_prog *prog;
+	struct logformat_insn *insn;
+	struct logformat_node *tmp;
+	char *text = NULL;
+	int len = 0;
+	int nb = 0;
+	int state = 1;	/* 0: no space, 1: space, 2: unknown until runtime */
+
+	/* one instruction per node is enough since merging only removes some */
+	list_for_each_entry(tmp, list_format, list)
+		nb++;
+
+	prog = calloc(1, sizeof(*prog) + nb * sizeof(*insn));
+	if (!prog)
+		return NULL;
+
+	insn = prog->insn;
+	list_for_each_entry(tmp, list_format, list) {
+		if (tmp->type == LOG_FMT_TEXT || (tmp->type == LOG_FMT_SEPARATOR && state == 0)) {
+			const char *src = (tmp->type == LOG_FMT_TEXT) ? tmp->arg : " ";
+			char *new = realloc(text, len + strlen(src) + 1);
+
+			if (!new)
+				goto fail;
+			text = new;
+			strcpy(text + len, src);
+			len += strlen(src);
+			state = (tmp->type == LOG_FMT_SEPARATOR);
+			continue;
+		}
+
+		if (tmp->type == LOG_FMT_SEPARATOR && state == 1)
+			continue;
+
+		if (tmp->type != LOG_FMT_SEPARATOR &&
+		    (tmp->type >= sizeof(lf_emitters) / sizeof(lf_emitters[0]) || !lf_emitters[tmp->type].emit))
+			continue;
+
+		if (text) {
+			insn->emit = lf_emit_text;
+			insn->text = text;
+			insn->len = len;
+			insn->options = state;
+			insn++;
+			text = NULL;
+			len = 0;
+		}
+
+		if (tmp->type == LOG_FMT_SEPARATOR) {
+			insn->emit = lf_emit_separator;
+			state = 1;
+		}
+		else {
+			insn->emit = lf_emitters[tmp->type].emit;
+			insn->options = tmp->options;
+			if (!(lf_emitters[tmp->type].flags & LF_EMIT_F_OPTIONAL))
+				state = 0;
+			else if (state == 1)
+				state = 2;
+		}
+		insn++;
+	}
+
+	if (text) {
+		insn->emit = lf_emit_text;
+		insn->text = text;
+		insn->len = len;
+		insn->options = state;
+		insn++;
+	}
+
+	prog->nb_insn = insn - prog->insn;
+	return prog;
+
+ fail:
+	free(text);
+	free_logformat_prog(prog);
+	return NULL;
+}
+
+/* Releases a program returned by compile_logformat() */
+void free_logformat_prog(struct logformat_prog *prog)
+{
+	int i;
+
+	if (!prog)
+		return;
+
+	for (i = 0; i < prog->nb_insn; i++)
+		free(prog->insn[i].text);
+	free(prog);
+}
+
+/*
+ * Builds the log line of session <s> in <dst> using the compiled log-format
+ * <prog>. At most <maxsize> bytes are written including the trailing zero,
+ * and the line is truncated before the first element which does not fit.
+ * Returns the length of the line including the trailing zero, or 0 if the
+ * log-format is empty.
+ */
+int build_logline(struct session *s, char *dst, size_t maxsize, const struct logformat_prog *prog)
+{
+	const struct logformat_insn *insn, *last;
+	struct logformat_ctx ctx;
+	char *tmplog = dst;
+	char *ret;
+
+	if (!prog || !prog->nb_insn)
+		return 0;
+
+	ctx.s = s;
+	ctx.t_request = -2;
+	ctx.last_isspace = 1;
+
+	for (insn = prog->insn, last = insn + prog->nb_insn; insn < last; insn++) {
+		ret = insn->emit(tmplog, dst + maxsize - tmplog, insn, &ctx);
+		if (ret == NULL)
+			break;
+		tmplog = ret;
+	}
+
+	/* *tmplog is a unused character */
+	*tmplog = '\0';
+
+	return tmplog - dst + 1;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ * End:
+ */
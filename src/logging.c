@@ -1,57 +1,308 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 #include <common/logging.h>
 
-static FILE *log_file = NULL;
+/* Ring shared between the process and its drain. The producer only moves
+ * <head> and the drain only moves <tail>, both grow forever and are masked
+ * with size - 1 to get an offset in <data>. A message which does not fit is
+ * dropped and counted instead of waiting for the drain. The drain sets
+ * <sleeping> before waiting on the pipe for the producer to wake it up.
+ */
+struct logging_ring {
+	volatile unsigned int head;
+	volatile unsigned int tail;
+	volatile unsigned int drops;
+	volatile unsigned int sleeping;
+	unsigned int size;
+	char data[0];
+};
 
-void logtest()
+static int log_fd = -1;
+static int log_wake = -1;		/* write side of the drain's pipe */
+static int log_armed = 0;		/* the drain may be started */
+static struct logging_ring *log_ring = NULL;
+
+int logging_level = LOGGING_DEF_LEVEL;
+unsigned int logging_ring_size = LOGGING_DEF_RING_SIZE;
+
+static const char *logging_levels[SILENT + 1] = {
+	[TRACE]  = "trace",
+	[DEBUG]  = "debug",
+	[INFO]   = "info",
+	[WARN]   = "warn",
+	[ERROR]  = "error",
+	[FATAL]  = "fatal",
+	[SILENT] = "silent",
+};
+
+static const char *logging_prefix[SILENT] = {
+	[TRACE]  = "[TRACE]",
+	[DEBUG]  = "[DEBUG]",
+	[INFO]   = "[INFO]",
+	[WARN]   = "[WARN]",
+	[ERROR]  = "[ERROR]",
+	[FATAL]  = "[FATAL]",
+};
+
+/* Returns the level matching <name>, or -1 if it is unknown. */
+int logging_parse_level(const char *name)
+{
+	int level;
+
+	for (level = TRACE; level <= SILENT; level++)
+		if (strcmp(name, logging_levels[level]) == 0)
+			return level;
+	return -1;
+}
+
+const char *logging_level_name(int level)
+{
+	if (level < TRACE || level > SILENT)
+		return "unknown";
+	return logging_levels[level];
+}
+
+/* Opens the file the messages are written to if it is not already. It is
+ * called before the chroot and the fork so that all processes share it.
+ */
+void logging_open()
+{
+	if (log_fd < 0)
+		log_fd = open("../log.txt", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+}
+
+/* Copies the <len> bytes of <msg> to the ring, or counts a drop if there is
+ * not enough room left.
+ */
+static void logging_ring_put(const char *msg, unsigned int len)
+{
+	struct logging_ring *ring = log_ring;
+	unsigned int head = ring->head;
+	unsigned int ofs = head & (ring->size - 1);
+	unsigned int room = ring->size - ofs;
+
+	if (len > ring->size - (head - ring->tail)) {
+		ring->drops++;
+		return;
+	}
+
+	if (len <= room)
+		memcpy(ring->data + ofs, msg, len);
+	else {
+		memcpy(ring->data + ofs, msg, room);
+		memcpy(ring->data, msg + room, len - room);
+	}
+	/* the data must be visible before the drain sees the new head */
+	__sync_synchronize();
+	ring->head = head + len;
+
+	/* the new head must be visible before the flag is checked, so that
+	 * a drain going to sleep either sees it or is woken up.
+	 */
+	__sync_synchronize();
+	if (ring->sleeping) {
+		ring->sleeping = 0;
+		if (write(log_wake, "", 1) < 0)
+			;
+	}
+}
+
+/* Writes the pending contents of the ring to the file. Returns the number of
+ * bytes which were consumed.
+ */
+static unsigned int logging_ring_flush(struct logging_ring *ring)
+{
+	unsigned int head = ring->head;
+	unsigned int tail = ring->tail;
+	unsigned int ofs, len;
+
+	__sync_synchronize();
+	if (head == tail)
+		return 0;
+
+	ofs = tail & (ring->size - 1);
+	len = head - tail;
+	if (len > ring->size - ofs)
+		len = ring->size - ofs;
+
+	/* nothing better to do with the errors than dropping the messages */
+	if (write(log_fd, ring->data + ofs, len) < 0)
+		;
+
+	/* the data must have been read before the producer may reuse it */
+	__sync_synchronize();
+	ring->tail = tail + len;
+	return len;
+}
+
+/* Main loop of the drain process. It copies the ring to the file, then sleeps
+ * on pipe <wake> until more messages are queued. Once its parent is gone, the
+ * pipe is closed, so it flushes what is left and exits.
+ */
+static void logging_drain(int wake)
 {
+	unsigned int drops = 0;
+	char msg[64];
+	int last = 0;
+	int ret;
+
+	while (1) {
+		while (logging_ring_flush(log_ring))
+			;
+
+		if (log_ring->drops != drops) {
+			drops = log_ring->drops;
+			snprintf(msg, sizeof(msg), "[WARN][logging][dropped:%u]\n", drops);
+			if (write(log_fd, msg, strlen(msg)) < 0)
+				;
+		}
+
+		if (last)
+			_exit(0);
+
+		/* the flag must be visible before the ring is checked again, so
+		 * that a message queued meanwhile is either seen or wakes us up.
+		 */
+		log_ring->sleeping = 1;
+		__sync_synchronize();
+		if (log_ring->head != log_ring->tail) {
+			log_ring->sleeping = 0;
+			continue;
+		}
+
+		ret = read(wake, msg, sizeof(msg));
+		log_ring->sleeping = 0;
+
+		/* one last pass in case the parent queued messages before leaving */
+		if (ret == 0 || (ret < 0 && errno != EINTR))
+			last = 1;
+	}
 }
 
-void logging(int level, const char *format, ...) 
+/* Allocates the ring and forks the drain process which writes its contents
+ * to the file. It is only done for the first message queued once the process
+ * is started, so that processes which never emit any do not hold a drain.
+ * Returns 0 on success or -1 on failure.
+ */
+static int logging_start_drain()
 {
-	if (level == TRACE) {
-	//	return;
+	static const int sigs[] = { SIGHUP, SIGINT, SIGQUIT, SIGUSR1, SIGUSR2,
+				    SIGPIPE, SIGTERM, SIGTTIN, SIGTTOU };
+	struct logging_ring *ring;
+	struct rlimit limit;
+	unsigned int size;
+	int pipefd[2];
+	int fd;
+
+	for (size = 4096; size < logging_ring_size && size < (1U << 31); size <<= 1)
+		;
+
+	ring = mmap(NULL, sizeof(*ring) + size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+		return -1;
+	ring->head = ring->tail = ring->drops = ring->sleeping = 0;
+	ring->size = size;
+
+	if (pipe(pipefd) < 0) {
+		munmap(ring, sizeof(*ring) + size);
+		return -1;
 	}
+
+	switch (fork()) {
+	case -1:
+		close(pipefd[0]);
+		close(pipefd[1]);
+		munmap(ring, sizeof(*ring) + size);
+		return -1;
+	case 0:
+		/* the drain must not hold the listening sockets nor react to
+		 * the signals sent to haproxy, it leaves with its parent.
+		 */
+		for (fd = 0; fd < sizeof(sigs) / sizeof(sigs[0]); fd++)
+			signal(sigs[fd], SIG_IGN);
+		limit.rlim_cur = 0;
+		getrlimit(RLIMIT_NOFILE, &limit);
+		for (fd = 0; fd < limit.rlim_cur; fd++)
+			if (fd != log_fd && fd != pipefd[0])
+				close(fd);
+		log_ring = ring;
+		logging_drain(pipefd[0]);
+	}
+
+	/* the producer must never block on a drain which lags behind */
+	close(pipefd[0]);
+	fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
+	fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+	log_wake = pipefd[1];
+	log_ring = ring;
+	return 0;
+}
+
+/* Opens the file and lets the first message queued start the drain process.
+ * It must be called by each process after the fork. Until then, messages are
+ * directly written to the file. Returns 0 on success or -1 if the file cannot
+ * be opened.
+ */
+int logging_start()
+{
+	if (CONFIG_HAP_LOGGING_LEVEL >= SILENT)
+		return 0;
+
+	logging_open();
+	if (log_fd < 0)
+		return -1;
+
+	log_armed = 1;
+	return 0;
+}
+
+/* Formats and queues the message. It is only called through the logging()
+ * macro once the level has been checked against the thresholds. Messages
+ * emitted before logging_start(), or if the drain cannot be started, are
+ * directly written to the file.
+ */
+void __logging(int level, const char *format, ...)
+{
 	va_list argp;
 	char dataptr[1024];
-	int data_len;
+	int len, ret;
 
-	if (level < 0 || format == NULL)
+	if (level < TRACE || level >= SILENT || format == NULL)
 		return;
 
+	len = strlen(logging_prefix[level]);
+	memcpy(dataptr, logging_prefix[level], len);
+
 	va_start(argp, format);
-	data_len += vsnprintf(dataptr, sizeof(dataptr) - 1 - data_len, format, argp);
+	ret = vsnprintf(dataptr + len, sizeof(dataptr) - len - 1, format, argp);
 	va_end(argp);
-	if (!log_file) {
-		log_file = freopen("../log.txt","w",stderr);
-	}
-	switch(level) {
-	case TRACE:
-		fprintf(log_file, "[TRACE]%s\n", dataptr);
-		break;
-	case DEBUG:
-		fprintf(log_file, "[DEBUG]%s\n", dataptr);
-		break;
-	case INFO:
-		fprintf(log_file, "[INFO]%s\n", dataptr);
-		break;
-	case WARN:
-		fprintf(log_file, "[WARN]%s\n", dataptr);
-		break;
-	case ERROR:
-		fprintf(log_file, "[ERROR]%s\n", dataptr);
-		break;
-	case FATAL:
-		fprintf(log_file, "[FATAL]%s\n", dataptr);
-		break;
+	if (ret < 0)
+		return;
+	len += ret;
+	if (len > sizeof(dataptr) - 2)
+		len = sizeof(dataptr) - 2;
+	dataptr[len++] = '\n';
 
+	if (!log_ring && log_armed && logging_start_drain() < 0)
+		log_armed = 0;
+
+	if (log_ring) {
+		logging_ring_put(dataptr, len);
+		return;
 	}
-	//setvbuf(log_file, dataptr, _IOFBF, data_len);
-	
-	//fflush(log_file);
-	//fprintf(stderr, "%s\n", dataptr);
 
+	logging_open();
+	if (log_fd < 0)
+		return;
+	if (write(log_fd, dataptr, len) < 0)
+		;
 }
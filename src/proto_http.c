@@ -47,6 +47,7 @@
 #include <proto/auth.h>
 #include <proto/backend.h>
 #include <proto/buffers.h>
+#include <proto/cache.h>
 #include <proto/checks.h>
 #include <proto/dumpstats.h>
 #include <proto/fd.h>
@@ -76,10 +77,7 @@ const char *HTTP_200 =
 	"HTTP/1.1 200 OK\r\n"
 	"Accept-Ranges: bytes\r\n"
 	"Server: Apache-Coyote/1.1\r\n"
-	"Last-Modified: Fri, 14 Mar 2014 08:03:20 GMT\r\n"
-	//"Content-Type: image/bmp\r\n"
-	"Date: Tue, 01 Apr 2014 08:23:08 GMT\r\n"
-	"Content-Length: ";
+	"Content-Length: "; /* not terminated, the cache adds the length and the other headers */
 
 
 /* Warning: no "connection" header is provided with the 3xx messages below */
@@ -102,6 +100,14 @@ const char *HTTP_303 =
 	"Content-length: 0\r\n"
 	"Location: "; /* not terminated since it will be concatenated with the URL */
 
+const char *HTTP_304 =
+	"HTTP/1.1 304 Not Modified\r\n"; /* not terminated, the validators follow */
+
+const char *HTTP_416 =
+	"HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+	"Content-Length: 0\r\n"
+	"Content-Range: bytes */"; /* not terminated since it will be concatenated with the size */
+
 /* Warning: this one is an sprintf() fmt string, with <realm> as its only argument */
 const char *HTTP_401_fmt =
 	"HTTP/1.0 401 Unauthorized\r\n"
@@ -2351,10 +2357,6 @@ int http_wait_for_request(struct session *s, struct buffer *req, int an_bit)
 	 * Note: we cannot log anymore if the request has been
 	 * classified as invalid.
 	 */
-	/*haproxy-second*/
-	//get uri
-	s->logs.logwait |= LW_REQ;
-	/*haproxy-second end*/
 	if (unlikely(s->logs.logwait & LW_REQ)) {
 		/* we have a complete HTTP request that we must log */
 		if ((txn->uri = pool_alloc2(pool2_requri)) != NULL) {
@@ -2411,6 +2413,10 @@ int http_wait_for_request(struct session *s, struct buffer *req, int an_bit)
 		capture_headers(req->p, &txn->hdr_idx,
 				txn->req.cap, s->fe->req_cap);
 
+	/* the cache key is needed before any server is involved */
+	if (cache.table || cache.max_mem || cache.neg)
+		cache_prepare_request(s, req);
+
 	/* 6: determine the transfer-length.
 	 * According to RFC2616 #4.4, amended by the HTTPbis working group,
 	 * the presence of a message-body in a REQUEST and its transfer length
@@ -3311,7 +3317,7 @@ int http_process_request(struct session *s, struct buffer *req, int an_bit)
 	/* add unique-id if "header-unique-id" is specified */
 
 	if (!LIST_ISEMPTY(&s->fe->format_unique_id))
-		build_logline(s, s->unique_id, UNIQUEID_LEN, &s->fe->format_unique_id);
+		build_logline(s, s->unique_id, UNIQUEID_LEN, s->fe->format_unique_id_prog);
 
 	if (s->fe->header_unique_id && s->unique_id) {
 		int ret = snprintf(trash, global.tune.bufsize, "%s: %s", s->fe->header_unique_id, s->unique_id);
@@ -3756,6 +3762,47 @@ int http_send_name_header(struct http_txn *txn, struct proxy* be, const char* sr
 	return 0;
 }
 
+/* Closes the server connection left open by a previous transaction of session
+ * <s> so that the current one may be processed without it, eg: answered from
+ * the cache. The backend remains assigned.
+ */
+void http_close_server_conn(struct session *s)
+{
+	struct stream_interface *si = s->req->cons;
+
+	si->flags |= SI_FL_NOLINGER | SI_FL_NOHALF;
+	si_shutr(si);
+	si_shutw(si);
+
+	if (unlikely(s->srv_conn))
+		sess_change_server(s, NULL);
+
+	if (target_srv(&s->target)) {
+		if (s->flags & SN_CURR_SESS) {
+			s->flags &= ~SN_CURR_SESS;
+			target_srv(&s->target)->cur_sess--;
+		}
+		if (may_dequeue_tasks(target_srv(&s->target), s->be))
+			process_srv_queue(target_srv(&s->target));
+	}
+
+	clear_target(&s->target);
+	clear_target(&si->target);
+
+	si->state     = si->prev_state = SI_ST_INI;
+	si->conn.t.sock.fd = -1;
+	si->err_type  = SI_ET_NONE;
+	si->conn_retries = 0;
+	si->err_loc   = NULL;
+	si->exp       = TICK_ETERNITY;
+	si->flags     = SI_FL_NONE;
+	s->req->flags &= ~(BF_SHUTW|BF_SHUTW_NOW|BF_WRITE_ERROR|BF_STREAMER|BF_STREAMER_FAST);
+	s->rep->flags &= ~(BF_SHUTR|BF_SHUTR_NOW|BF_READ_ATTACHED|BF_READ_ERROR|BF_READ_NOEXP|BF_STREAMER|BF_STREAMER_FAST|BF_WRITE_PARTIAL);
+	s->flags &= ~(SN_DIRECT|SN_ASSIGNED|SN_ADDR_SET);
+	if (s->fe->options2 & PR_O2_INDEPSTR)
+		si->flags |= SI_FL_INDEP_STR;
+}
+
 /* Terminate current transaction and prepare a new one. This is very tricky
  * right now but it works.
  */
@@ -3837,6 +3884,8 @@ void http_end_txn_clean_session(struct session *s)
 
 	clear_target(&s->target);
 
+	/* an applet may have answered, the next request must not reuse it */
+	clear_target(&s->req->cons->target);
 	s->req->cons->state     = s->req->cons->prev_state = SI_ST_INI;
 	s->req->cons->conn.t.sock.fd = -1; /* just to help with debugging */
 	s->req->cons->err_type  = SI_ET_NONE;
@@ -4784,7 +4833,8 @@ int http_wait_for_response(struct session *s, struct buffer *rep, int an_bit)
 		 *    Cache-Control or Expires header fields."
 		 */
 		if (likely(txn->meth != HTTP_METH_POST) &&
-		    ((s->be->options & PR_O_CHK_CACHE) || (s->be->ck_opts & PR_CK_NOC)))
+		    ((s->be->options & PR_O_CHK_CACHE) || (s->be->ck_opts & PR_CK_NOC) ||
+		     (s->be->options2 & PR_O2_HTTP_CACHE)))
 			txn->flags |= TX_CACHEABLE | TX_CACHE_COOK;
 		break;
 	default:
@@ -5103,7 +5153,8 @@ int http_process_res_common(struct session *t, struct buffer *rep, int an_bit, s
 		/*
 		 * 5: check for cache-control or pragma headers if required.
 		 */
-		if ((t->be->options & PR_O_CHK_CACHE) || (t->be->ck_opts & PR_CK_NOC))
+		if ((t->be->options & PR_O_CHK_CACHE) || (t->be->ck_opts & PR_CK_NOC) ||
+		    (t->be->options2 & PR_O2_HTTP_CACHE))
 			check_response_for_cacheability(t, rep);
 
 		/*
@@ -5241,6 +5292,12 @@ int http_process_res_common(struct session *t, struct buffer *rep, int an_bit, s
 				http_change_connection_header(txn, msg, want_flags);
 		}
 
+		/*
+		 * 9: check if the response may be stored in the cache.
+		 */
+		if (t->be->options2 & PR_O2_HTTP_CACHE)
+			cache_check_response(t, rep);
+
 	skip_header_mangling:
 		if ((msg->flags & HTTP_MSGF_XFER_LEN) ||
 		    (txn->flags & TX_CON_WANT_MSK) == TX_CON_WANT_TUN)
@@ -5273,6 +5330,19 @@ int http_process_res_common(struct session *t, struct buffer *rep, int an_bit, s
 	return 1;
 }
 
+/* Schedules the forwarding of <len> bytes of the response body in <res>. When
+ * the response is being stored in the cache, only the bytes present in the
+ * buffer are forwarded once they have been copied. Returns the number of bytes
+ * scheduled.
+ */
+static inline unsigned long long http_forward_rsp_body(struct session *s, struct buffer *res,
+						       unsigned long long len)
+{
+	if (unlikely(s->ctxn.store != NULL))
+		return cache_store_data(s, res, len);
+	return buffer_forward(res, len);
+}
+
 /* This function is an analyser which forwards response body (including chunk
  * sizes if any). It is called as soon as we must forward, even if we forward
  * zero byte. The only situation where it must not be called is when we're in
@@ -5320,6 +5390,10 @@ int http_response_forward_body(struct session *s, struct buffer *res, int an_bit
 		else {
 			msg->msg_state = HTTP_MSG_DATA;
 		}
+
+		/* the headers are still there to be copied */
+		if (s->ctxn.ttl)
+			cache_store_start(s, res);
 	}
 
 	while (1) {
@@ -5330,12 +5404,12 @@ int http_response_forward_body(struct session *s, struct buffer *res, int an_bit
 			msg->sol = msg->sov;
 			msg->next -= bytes; /* will be forwarded */
 			msg->chunk_len += bytes;
-			msg->chunk_len -= buffer_forward(res, msg->chunk_len);
+			msg->chunk_len -= http_forward_rsp_body(s, res, msg->chunk_len);
 		}
 
 		if (msg->msg_state == HTTP_MSG_DATA) {
 			/* must still forward */
-			if (res->to_forward)
+			if (res->to_forward || msg->chunk_len)
 				goto missing_data;
 
 			/* nothing left to forward */
@@ -5441,7 +5515,7 @@ int http_response_forward_body(struct session *s, struct buffer *res, int an_bit
 		msg->sol = msg->sov;
 		msg->next -= bytes; /* will be forwarded */
 		msg->chunk_len += bytes;
-		msg->chunk_len -= buffer_forward(res, msg->chunk_len);
+		msg->chunk_len -= http_forward_rsp_body(s, res, msg->chunk_len);
 	}
 
 	/* When TE: chunked is used, we need to get there again to parse remaining
@@ -7449,6 +7523,7 @@ void http_end_txn(struct session *s)
 	pool_free2(pool2_capture, txn->srv_cookie);
 	pool_free2(apools.sessid, txn->sessid);
 	pool_free2(pool2_uniqueid, s->unique_id);
+	cache_end_txn(s);
 
 	s->unique_id = NULL;
 	txn->sessid = NULL;
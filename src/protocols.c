@@ -243,9 +243,6 @@ void delete_listener(struct listener *listener)
  */
 int listener_accept(int fd)
 {
-	/*haproxy-second*/
-	logging(TRACE, "[TRACE][listener_accept][fd :%d]", fd);
-	/*haproxy-second end*/
 	struct listener *l = fdtab[fd].owner;
 	struct proxy *p = l->frontend;
 	int max_accept = global.tune.maxaccept;
@@ -52,6 +52,118 @@
 struct pool_head *pool2_session;
 struct list sessions;
 
+/* Initializes the parts of session <s> which do not depend on how its client
+ * side is attached : the server stream interface in its INIT state, the
+ * request and response buffers, the HTTP transaction and the cache context.
+ * The request analysers are those of the session's listener. <s>->task,
+ * <s>->listener, <s>->fe and the client stream interface must already be set.
+ * It is used for the sessions accepted from a listener as well as for the
+ * internal ones. Returns 0 on success or -1 if memory is missing, in which
+ * case nothing is left allocated.
+ */
+int session_init_buffers(struct session *s)
+{
+	struct http_txn *txn = &s->txn;
+
+	/* pre-initialize the other side's stream interface to an INIT state. The
+	 * callbacks will be initialized before attempting to connect.
+	 */
+	s->si[1].conn.t.sock.fd = -1; /* just to help with debugging */
+	s->si[1].owner     = s->task;
+	s->si[1].state     = s->si[1].prev_state = SI_ST_INI;
+	s->si[1].err_type  = SI_ET_NONE;
+	s->si[1].conn_retries = 0;  /* used for logging too */
+	s->si[1].err_loc   = NULL;
+	s->si[1].conn.ctrl = NULL;
+	s->si[1].release   = NULL;
+	s->si[1].send_proxy_ofs = 0;
+	clear_target(&s->si[1].target);
+	stream_interface_prepare(&s->si[1], &stream_int_embedded);
+	s->si[1].exp       = TICK_ETERNITY;
+	s->si[1].flags     = SI_FL_NONE;
+
+	if (likely(s->fe->options2 & PR_O2_INDEPSTR))
+		s->si[1].flags |= SI_FL_INDEP_STR;
+
+	session_init_srv_conn(s);
+	clear_target(&s->target);
+	s->pend_pos = NULL;
+
+	/* init store persistence */
+	s->store_count = 0;
+
+	/* nothing comes from the cache yet */
+	s->cobj = NULL;
+	s->centry = NULL;
+	s->ctable = NULL;
+	memset(&s->ctxn, 0, sizeof(s->ctxn));
+	s->offset = -1;
+	s->size = -1;
+
+	if (unlikely((s->req = pool_alloc2(pool2_buffer)) == NULL))
+		return -1;
+
+	if (unlikely((s->rep = pool_alloc2(pool2_buffer)) == NULL)) {
+		pool_free2(pool2_buffer, s->req);
+		return -1;
+	}
+
+	/* initialize the request buffer */
+	s->req->size = global.tune.bufsize;
+	buffer_init(s->req);
+	s->req->prod = &s->si[0];
+	s->req->cons = &s->si[1];
+	s->si[0].ib = s->si[1].ob = s->req;
+	s->req->flags |= BF_READ_ATTACHED; /* the producer is already connected */
+
+	/* activate default analysers enabled for this listener */
+	s->req->analysers = s->listener->analysers;
+
+	s->req->wto = TICK_ETERNITY;
+	s->req->rto = TICK_ETERNITY;
+	s->req->rex = TICK_ETERNITY;
+	s->req->wex = TICK_ETERNITY;
+	s->req->analyse_exp = TICK_ETERNITY;
+
+	/* initialize response buffer */
+	s->rep->size = global.tune.bufsize;
+	buffer_init(s->rep);
+	s->rep->prod = &s->si[1];
+	s->rep->cons = &s->si[0];
+	s->si[0].ob = s->si[1].ib = s->rep;
+	s->rep->analysers = 0;
+
+	if (s->fe->options2 & PR_O2_NODELAY) {
+		s->req->flags |= BF_NEVER_WAIT;
+		s->rep->flags |= BF_NEVER_WAIT;
+	}
+
+	s->rep->rto = TICK_ETERNITY;
+	s->rep->wto = TICK_ETERNITY;
+	s->rep->rex = TICK_ETERNITY;
+	s->rep->wex = TICK_ETERNITY;
+	s->rep->analyse_exp = TICK_ETERNITY;
+
+	/* Those variables will be checked and freed if non-NULL in
+	 * session.c:session_free(). It is important that they are
+	 * properly initialized.
+	 */
+	txn->sessid = NULL;
+	txn->srv_cookie = NULL;
+	txn->cli_cookie = NULL;
+	txn->uri = NULL;
+	txn->req.cap = NULL;
+	txn->rsp.cap = NULL;
+	txn->hdr_idx.v = NULL;
+	txn->hdr_idx.size = txn->hdr_idx.used = 0;
+	txn->req.flags = 0;
+	txn->rsp.flags = 0;
+	/* the HTTP messages need to know what buffer they're associated with */
+	txn->req.buf = s->req;
+	txn->rsp.buf = s->rep;
+	return 0;
+}
+
 /* This function is called from the protocol layer accept() in order to instanciate
  * a new session on behalf of a given listener and frontend. It returns a positive
  * value upon success, 0 if the connection can be ignored, or a negative value upon
@@ -61,7 +173,6 @@ int session_accept(struct listener *l, int cfd, struct sockaddr_storage *addr)
 {
 	struct proxy *p = l->frontend;
 	struct session *s;
-	struct http_txn *txn;
 	struct task *t;
 	int ret;
 
@@ -71,13 +182,6 @@ int session_accept(struct listener *l, int cfd, struct sockaddr_storage *addr)
 	if (unlikely((s = pool_alloc2(pool2_session)) == NULL))
 		goto out_close;
 
-	s->fp = NULL;
-	s->elt = NULL;
-	s->cache = 0;
-	s->offset = -1;
-	s->size = -1;
-	s->count = 0;
-
 	/* minimum session initialization required for monitor mode below */
 	s->flags = 0;
 	s->logs.logwait = p->to_log;
@@ -193,98 +297,13 @@ int session_accept(struct listener *l, int cfd, struct sockaddr_storage *addr)
 	/* add the various callbacks */
 	stream_interface_prepare(&s->si[0], l->sock);
 
-	/* pre-initialize the other side's stream interface to an INIT state. The
-	 * callbacks will be initialized before attempting to connect.
-	 */
-	s->si[1].conn.t.sock.fd = -1; /* just to help with debugging */
-	s->si[1].owner     = t;
-	s->si[1].state     = s->si[1].prev_state = SI_ST_INI;
-	s->si[1].err_type  = SI_ET_NONE;
-	s->si[1].conn_retries = 0;  /* used for logging too */
-	s->si[1].err_loc   = NULL;
-	s->si[1].conn.ctrl = NULL;
-	s->si[1].release   = NULL;
-	s->si[1].send_proxy_ofs = 0;
-	clear_target(&s->si[1].target);
-	stream_interface_prepare(&s->si[1], &stream_int_embedded);
-	s->si[1].exp       = TICK_ETERNITY;
-	s->si[1].flags     = SI_FL_NONE;
-
-	if (likely(s->fe->options2 & PR_O2_INDEPSTR))
-		s->si[1].flags |= SI_FL_INDEP_STR;
-
-	session_init_srv_conn(s);
-	clear_target(&s->target);
-	s->pend_pos = NULL;
-
-	/* init store persistence */
-	s->store_count = 0;
-
 	/* Adjust some socket options */
 	if (unlikely(fcntl(cfd, F_SETFL, O_NONBLOCK) == -1))
 		goto out_free_task;
 
-	if (unlikely((s->req = pool_alloc2(pool2_buffer)) == NULL))
+	if (unlikely(session_init_buffers(s) < 0))
 		goto out_free_task; /* no memory */
 
-	if (unlikely((s->rep = pool_alloc2(pool2_buffer)) == NULL))
-		goto out_free_req; /* no memory */
-
-	/* initialize the request buffer */
-	s->req->size = global.tune.bufsize;
-	buffer_init(s->req);
-	s->req->prod = &s->si[0];
-	s->req->cons = &s->si[1];
-	s->si[0].ib = s->si[1].ob = s->req;
-	s->req->flags |= BF_READ_ATTACHED; /* the producer is already connected */
-
-	/* activate default analysers enabled for this listener */
-	s->req->analysers = l->analysers;
-
-	s->req->wto = TICK_ETERNITY;
-	s->req->rto = TICK_ETERNITY;
-	s->req->rex = TICK_ETERNITY;
-	s->req->wex = TICK_ETERNITY;
-	s->req->analyse_exp = TICK_ETERNITY;
-
-	/* initialize response buffer */
-	s->rep->size = global.tune.bufsize;
-	buffer_init(s->rep);
-	s->rep->prod = &s->si[1];
-	s->rep->cons = &s->si[0];
-	s->si[0].ob = s->si[1].ib = s->rep;
-	s->rep->analysers = 0;
-
-	if (s->fe->options2 & PR_O2_NODELAY) {
-		s->req->flags |= BF_NEVER_WAIT;
-		s->rep->flags |= BF_NEVER_WAIT;
-	}
-
-	s->rep->rto = TICK_ETERNITY;
-	s->rep->wto = TICK_ETERNITY;
-	s->rep->rex = TICK_ETERNITY;
-	s->rep->wex = TICK_ETERNITY;
-	s->rep->analyse_exp = TICK_ETERNITY;
-
-	txn = &s->txn;
-	/* Those variables will be checked and freed if non-NULL in
-	 * session.c:session_free(). It is important that they are
-	 * properly initialized.
-	 */
-	txn->sessid = NULL;
-	txn->srv_cookie = NULL;
-	txn->cli_cookie = NULL;
-	txn->uri = NULL;
-	txn->req.cap = NULL;
-	txn->rsp.cap = NULL;
-	txn->hdr_idx.v = NULL;
-	txn->hdr_idx.size = txn->hdr_idx.used = 0;
-	txn->req.flags = 0;
-	txn->rsp.flags = 0;
-	/* the HTTP messages need to know what buffer they're associated with */
-	txn->req.buf = s->req;
-	txn->rsp.buf = s->rep;
-
 	/* finish initialization of the accepted file descriptor */
 	fd_insert(cfd);
 	fdtab[cfd].owner = &s->si[0];
@@ -314,7 +333,6 @@ int session_accept(struct listener *l, int cfd, struct sockaddr_storage *addr)
 	/* Error unrolling */
  out_free_rep:
 	pool_free2(pool2_buffer, s->rep);
- out_free_req:
 	pool_free2(pool2_buffer, s->req);
  out_free_task:
 	p->feconn--;
@@ -437,14 +455,15 @@ void session_process_counters(struct session *s)
 		bytes = s->req->total - s->logs.bytes_in;
 		s->logs.bytes_in = s->req->total;
 		if (bytes) {
-			s->fe->fe_counters.bytes_in			+= bytes;
+			if (!(s->flags & SN_INTERNAL))
+				s->fe->fe_counters.bytes_in		+= bytes;
 
 			s->be->be_counters.bytes_in			+= bytes;
 
 			if (target_srv(&s->target))
 				target_srv(&s->target)->counters.bytes_in		+= bytes;
 
-			if (s->listener->counters)
+			if (s->listener->counters && !(s->flags & SN_INTERNAL))
 				s->listener->counters->bytes_in		+= bytes;
 
 			if (s->stkctr2_entry) {
@@ -487,14 +506,15 @@ void session_process_counters(struct session *s)
 		bytes = s->rep->total - s->logs.bytes_out;
 		s->logs.bytes_out = s->rep->total;
 		if (bytes) {
-			s->fe->fe_counters.bytes_out			+= bytes;
+			if (!(s->flags & SN_INTERNAL))
+				s->fe->fe_counters.bytes_out		+= bytes;
 
 			s->be->be_counters.bytes_out			+= bytes;
 
 			if (target_srv(&s->target))
 				target_srv(&s->target)->counters.bytes_out		+= bytes;
 
-			if (s->listener->counters)
+			if (s->listener->counters && !(s->flags & SN_INTERNAL))
 				s->listener->counters->bytes_out	+= bytes;
 
 			if (s->stkctr2_entry) {
@@ -1315,9 +1335,6 @@ static int process_store_rules(struct session *s, struct buffer *rep, int an_bit
  */
 struct task *process_session(struct task *t)
 {
-	/*haproxy-second*/
-	int cache_flag = 1; //1: cache on; 0:cache off
-	/*haproxy-second end*/
 	logging(TRACE, "[process_session]t->state");
 	struct server *srv;
 	struct session *s = t->context;
@@ -1597,6 +1614,12 @@ struct task *process_session(struct task *t)
 					UPDATE_ANALYSERS(s->req->analysers, ana_list, ana_back, AN_REQ_HTTP_PROCESS_BE);
 				}
 
+				if (ana_list & AN_REQ_CACHE_LOOKUP) {
+					if (!cache_process_request(s, s->req, AN_REQ_CACHE_LOOKUP))
+						break;
+					UPDATE_ANALYSERS(s->req->analysers, ana_list, ana_back, AN_REQ_CACHE_LOOKUP);
+				}
+
 				if (ana_list & AN_REQ_HTTP_TARPIT) {
 					if (!http_process_tarpit(s, s->req, AN_REQ_HTTP_TARPIT))
 						break;
@@ -1879,9 +1902,7 @@ struct task *process_session(struct task *t)
 		 * to the consumer (which might possibly not be connected yet).
 		 */
 		if (!(s->req->flags & (BF_SHUTR|BF_SHUTW_NOW)))
-			/*haproxy-second*/
-			;//buffer_forward(s->req, BUF_INFINITE_FORWARD);
-			/*haproxy-second end*/
+			buffer_forward(s->req, BUF_INFINITE_FORWARD);
 	}
 
 	/* check if it is wise to enable kernel splicing to forward request data */
@@ -2015,9 +2036,7 @@ struct task *process_session(struct task *t)
 		 * to the consumer.
 		 */
 		if (!(s->rep->flags & (BF_SHUTR|BF_SHUTW_NOW)))
-			/*haproxy-second*/
-			;//buffer_forward(s->rep, BUF_INFINITE_FORWARD);
-			/*haproxy-second end*/
+			buffer_forward(s->rep, BUF_INFINITE_FORWARD);
 
 		/* if we have no analyser anymore in any direction and have a
 		 * tunnel timeout set, use it now.
@@ -2116,50 +2135,6 @@ struct task *process_session(struct task *t)
 		}
 	}
 
-	/*haproxy-second*/
-	if (cache_flag || (s->rep->cons->state == SI_ST_EST && s->req->cons->state == SI_ST_EST)) {
-		struct http_txn *txn = &s->txn;
-		struct http_msg *msg_req = &txn->req;
-		struct http_msg *msg_rsp = &txn->rsp;
-		logging(TRACE, "%08x:%ssecond.cookie[%04x:%04x][time:%u]cli_cookie:%s\nsrv_cookie:%s", 
-			s->uniq_id, s->be->id,
-	        (unsigned short)si_fd(&s->si[0]),(unsigned short)si_fd(&s->si[1]),
-	        now_ms,
-			txn->cli_cookie, txn->srv_cookie);
-		if (msg_req->msg_state == HTTP_MSG_RQBEFORE
-			&& msg_rsp->msg_state == HTTP_MSG_RPBEFORE
-			&& s->cache >= 0 ) {
-			s->count++;
-			logging(TRACE, "all init");
-			EV_FD_SET(s->si[0].conn.t.sock.fd, DIR_RD);
-			EV_FD_CLR(s->si[1].conn.t.sock.fd, DIR_WR);
-			EV_FD_CLR(s->si[1].conn.t.sock.fd, DIR_RD);
-		}
-		if (msg_req->msg_state == HTTP_MSG_TUNNEL
-			&& msg_rsp->msg_state == HTTP_MSG_TUNNEL) {
-			if (!(msg_req->buf->o|msg_req->buf->i|msg_rsp->buf->o|msg_rsp->buf->i)) {
-				logging(TRACE, "%08x:%ssecond.cache[%04x:%04x][time:%u]:all tunnel[req o:%d,i:%d][rsp o:%d, i:%d]",
-					   s->uniq_id, s->be->id,
-				       (unsigned short)si_fd(&s->si[0]),(unsigned short)si_fd(&s->si[1]),
-				       now_ms,
-				       msg_req->buf->o, msg_req->buf->i, msg_rsp->buf->o, msg_rsp->buf->i);
-				http_init_txn(s);
-				if (msg_rsp && msg_rsp->buf)
-					msg_rsp->buf->to_forward = 0;
-				if (msg_req && msg_req->buf)
-					msg_req->buf->to_forward = 0;
-				s->cache = 0;
-				s->elt = NULL;
-	            s->req->flags &= ~(BF_FULL|BF_HIJACK|BF_DONT_READ);
-	            s->rep->flags &= ~(BF_FULL|BF_HIJACK|BF_DONT_READ);
-	            s->req->analysers = s->listener->analysers | AN_REQ_HTTP_XFER_BODY;
-	            s->rep->analysers = AN_RES_WAIT_HTTP | AN_RES_HTTP_PROCESS_BE | AN_RES_HTTP_XFER_BODY | AN_REQ_DECODE_PROXY;
-	            EV_FD_SET(s->si[0].conn.t.sock.fd, DIR_RD);
-			}
-			
-		}
-	}
-	/*haproxy-second end*/
 
 	if (likely((s->rep->cons->state != SI_ST_CLO) ||
 		   (s->req->cons->state > SI_ST_INI && s->req->cons->state < SI_ST_CLO))) {
@@ -2237,50 +2212,22 @@ struct task *process_session(struct task *t)
 		if (!tick_isset(t->expire))
 			ABORT_NOW();
 #endif
-		/*haproxy-second*/
-		if (cache_flag || (s->rep->cons->state == SI_ST_EST && s->req->cons->state == SI_ST_EST)) {
-			struct http_txn *txn = &s->txn;
-			struct http_msg *msg_req = &txn->req;
-			struct http_msg *msg_rsp = &txn->rsp;
-			
-			if (msg_req && msg_req->msg_state == HTTP_MSG_DONE &&
-				msg_rsp && msg_rsp->msg_state == HTTP_MSG_RPBEFORE
-				&& s->cache >= 0) {
-				logging(TRACE, "%08x:%ssecond.cache[%04x:%04x][time:%u]", 
-						s->uniq_id, s->be->id,
-				        (unsigned short)si_fd(&s->si[0]),(unsigned short)si_fd(&s->si[1]),
-				        now_ms);
-				if (!s->send_flag) {
-					//if ((s->count)%2) {
-						process_cache(s);
-				/*	} else {
-						s->cache = -1;
-					}*/
-				} else 
-					s->cache = -1;
-				if (s->cache < 0) {
-					EV_FD_COND_S(s->si[1].conn.t.sock.fd, DIR_WR);
-				}
-			}
-		}
-		logging(TRACE, "%08x:%ssecond.retchk[%04x:%04x][time:%u]si_state[%04x:%04x]si_flags[%04x:%04x]", 
-			s->uniq_id, s->be->id,
-	        (unsigned short)si_fd(&s->si[0]),(unsigned short)si_fd(&s->si[1]),
-	        now_ms,
-			s->si[0].state, s->si[1].state, s->si[0].flags, s->si[1].flags);
-		/*haproxy-second end*/
 		return t; /* nothing more to do */
 	}
 
-	s->fe->feconn--;
 	if (s->flags & SN_BE_ASSIGNED)
 		s->be->beconn--;
-	if (!(s->listener->options & LI_O_UNLIMITED))
-		actconn--;
 	jobs--;
-	s->listener->nbconn--;
-	if (s->listener->state == LI_FULL)
-		resume_listener(s->listener);
+
+	/* internal sessions were not accepted by the listener */
+	if (!(s->flags & SN_INTERNAL)) {
+		s->fe->feconn--;
+		if (!(s->listener->options & LI_O_UNLIMITED))
+			actconn--;
+		s->listener->nbconn--;
+		if (s->listener->state == LI_FULL)
+			resume_listener(s->listener);
+	}
 
 	/* Dequeues all of the listeners waiting for a resource */
 	if (!LIST_ISEMPTY(&global_listener_queue))
@@ -2309,7 +2256,7 @@ struct task *process_session(struct task *t)
 		if (n < 1 || n > 5)
 			n = 0;
 
-		if (s->fe->mode == PR_MODE_HTTP)
+		if (s->fe->mode == PR_MODE_HTTP && !(s->flags & SN_INTERNAL))
 			s->fe->fe_counters.p.http.rsp[n]++;
 
 		if ((s->flags & SN_BE_ASSIGNED) &&
@@ -14,24 +14,19 @@
  */
 
 #include <common/sessionhash.h>
+#include <common/standard.h>
 #include <string.h>
 #ifdef DEBUG_HASH
 #include <stdio.h>
 #endif
 
 /*
- * This is a bernstein hash derivate
+ * Hashes the session ID with the common word-at-a-time hash
  * returns unsigned int between 0 and (TABLESIZE - 1) inclusive
  */
 unsigned int appsession_hash_f(char *ptr)
 {
-	unsigned int h = 5381;
-
-	while (*ptr) {
-		h = (h << 5) + h + *ptr;
-		ptr++;
-	}
-	return ((h >> 16) ^ h) & TABLEMASK;
+	return hash_mem(ptr, strlen(ptr)) & TABLEMASK;
 }
 
 int appsession_hash_init(struct appsession_hash *hash,
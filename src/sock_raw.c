@@ -15,10 +15,12 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <netinet/tcp.h>
 
@@ -448,15 +450,6 @@ static int sock_raw_read(int fd)
 			goto out_error;
 		}
 	} /* while (1) */
-	/*haproxy-second*/
-	logging(WARN, "[WARN][sock_raw_read][haproxy-second:cache]FIX ME!! ");
-	struct task *t = (struct task *)si->owner;
-	struct session *s = (struct session *)t->context;
-	if (&s->si[0] == si && sum > 0) {
-		s->send_flag = 0;
-	}
-	logging(TRACE, "sock_raw_read fd :%d read:%d", fd, sum);
-	/*haproxy-second end*/
 
  out_wakeup:
 	/* We might have some data the consumer is waiting for.
@@ -594,8 +587,6 @@ static int sock_raw_write_loop(struct stream_interface *si, struct buffer *b)
 		 * sending more data after this call. We want this if :
 		 *  - we're about to close after this last send and want to merge
 		 *    the ongoing FIN with the last segment.
-		 *  - we know we can't send everything at once and must get back
-		 *    here because of unaligned data
 		 *  - there is still a finite amount of data to forward
 		 * The test is arranged so that the most common case does only 2
 		 * tests.
@@ -603,12 +594,29 @@ static int sock_raw_write_loop(struct stream_interface *si, struct buffer *b)
 
 		if (MSG_NOSIGNAL && MSG_MORE) {
 			unsigned int send_flag = MSG_DONTWAIT | MSG_NOSIGNAL;
+			struct iovec iov[2];
+			struct msghdr mh;
+
+			/* wrapping data are sent at once from both parts of
+			 * the buffer, so that several responses queued there
+			 * leave in a single call.
+			 */
+			memset(&mh, 0, sizeof(mh));
+			mh.msg_iov = iov;
+			mh.msg_iovlen = 1;
+			iov[0].iov_base = bo_ptr(b);
+			iov[0].iov_len = max;
+			if (max != b->o) {
+				iov[1].iov_base = b->data;
+				iov[1].iov_len = b->o - max;
+				mh.msg_iovlen = 2;
+				max = b->o;
+			}
 
 			if ((!(b->flags & BF_NEVER_WAIT) &&
 			    ((b->to_forward && b->to_forward != BUF_INFINITE_FORWARD) ||
 			     (b->flags & BF_EXPECT_MORE))) ||
-			    ((b->flags & (BF_SHUTW|BF_SHUTW_NOW|BF_HIJACK)) == BF_SHUTW_NOW && (max == b->o)) ||
-			    (max != b->o)) {
+			    ((b->flags & (BF_SHUTW|BF_SHUTW_NOW|BF_HIJACK)) == BF_SHUTW_NOW)) {
 				send_flag |= MSG_MORE;
 			}
 
@@ -616,7 +624,7 @@ static int sock_raw_write_loop(struct stream_interface *si, struct buffer *b)
 			if (b->flags & BF_SEND_DONTWAIT)
 				send_flag &= ~MSG_MORE;
 
-			ret = send(si_fd(si), bo_ptr(b), max, send_flag);
+			ret = sendmsg(si_fd(si), &mh, send_flag);
 		} else {
 			int skerr;
 			socklen_t lskerr = sizeof(skerr);
@@ -671,15 +679,6 @@ static int sock_raw_write_loop(struct stream_interface *si, struct buffer *b)
 			break;
 		}
 	} /* while (1) */
-	/*haproxy-second*/
-	logging(WARN, "[WARN][sock_raw_write_loop][haproxy-second:cache]FIX ME!! ");
-	struct task *t = (struct task *)si->owner;
-	struct session *s = (struct session *)t->context;
-	if (&s->si[1] == si && retval > 0) {
-		s->send_flag = 1;
-	}
-	logging(TRACE, "sock_raw_write_loop fd :%d write:%d", si->conn.t.sock.fd, sum);
-	/*haproxy-second end*/
 
 	return retval;
 }
@@ -769,10 +768,7 @@ static int sock_raw_write(int fd)
 		if (likely((b->flags & (BF_WRITE_NULL|BF_WRITE_ERROR|BF_SHUTW)) ||
 			   ((b->flags & BF_OUT_EMPTY) && !b->to_forward) ||
 			   si->state != SI_ST_EST ||
-			   b->prod->state != SI_ST_EST ||
-			   /*haproxy-second*/
-			   ((b->flags & BF_OUT_EMPTY) && !b->o))){//need to read more data from cache file
-			   /*haproxy-second end*/
+			   b->prod->state != SI_ST_EST)) {
 			logging(TRACE, "sock_raw_write task_wakeup");
 			task_wakeup(si->owner, TASK_WOKEN_IO);
 		}
@@ -358,6 +358,62 @@ char *utoa_pad(unsigned int n, char *dst, size_t size)
 	return ret;
 }
 
+/*
+ * unsigned int upper case hexadecimal ASCII representation, on at least
+ * <digits> digits (like "%0<digits>X")
+ *
+ * return the last char '\0' or NULL if no enough
+ * space in dst
+ */
+char *uxtoa_o(unsigned int n, char *dst, size_t size, int digits)
+{
+	int i;
+	char *ret;
+
+	for (i = 1; i < 8 && (n >> (4 * i)); i++)
+		;
+	if (i < digits)
+		i = digits;
+
+	if (i + 1 > size)
+		return NULL;
+
+	ret = dst + i;
+	*ret = '\0';
+	while (i--) {
+		dst[i] = "0123456789ABCDEF"[n & 0xF];
+		n >>= 4;
+	}
+	return ret;
+}
+
+/*
+ * dotted IPv4 address ASCII representation, without inet_ntop()
+ *
+ * return the last char '\0' or NULL if no enough
+ * space in dst
+ */
+char *ip4toa_o(const struct in_addr *addr, char *dst, size_t size)
+{
+	const unsigned char *b = (const unsigned char *)&addr->s_addr;
+	char *end = dst + size;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		/* the digits and a dot or the '\0' */
+		if (end - dst < (b[i] >= 100 ? 4 : b[i] >= 10 ? 3 : 2))
+			return NULL;
+		if (b[i] >= 100)
+			*dst++ = '0' + b[i] / 100;
+		if (b[i] >= 10)
+			*dst++ = '0' + b[i] / 10 % 10;
+		*dst++ = '0' + b[i] % 10;
+		*dst++ = '.';
+	}
+	*--dst = '\0';
+	return dst;
+}
+
 /*
  * copies at most <size-1> chars from <src> to <dst>. Last char is always
  * set to 0, unless <size> is 0. The number of chars copied is returned
@@ -1616,6 +1672,80 @@ unsigned int full_hash(unsigned int a)
 	return __full_hash(a);
 }
 
+/* primes used by the memory hash below, they are the ones of xxHash64 */
+#define HASH_MEM_P1 0x9E3779B185EBCA87ULL
+#define HASH_MEM_P2 0xC2B2AE3D27D4EB4FULL
+#define HASH_MEM_P3 0x165667B19E3779F9ULL
+
+/* Returns word <w> with its ASCII upper case letters turned to lower case. All
+ * bytes are processed at once : bit 7 of each byte of <m> is set when the
+ * byte is between 'A' and 'Z', and is then moved to bit 5 (0x20).
+ */
+static inline unsigned long long hash_word_lc(unsigned long long w)
+{
+	unsigned long long x = w & 0x7F7F7F7F7F7F7F7FULL;
+	unsigned long long m;
+
+	m = (x + 0x3F3F3F3F3F3F3F3FULL) & ~(x + 0x2525252525252525ULL) & ~w;
+	return w | ((m & 0x8080808080808080ULL) >> 2);
+}
+
+/* Mixes word <w> into hash <h> */
+static inline unsigned long long hash_word_mix(unsigned long long h, unsigned long long w)
+{
+	w *= HASH_MEM_P2;
+	w = (w << 31) | (w >> 33);
+	h ^= w * HASH_MEM_P1;
+	return ((h << 27) | (h >> 37)) * HASH_MEM_P1 + HASH_MEM_P3;
+}
+
+/* Hashes <len> bytes at <p> 8 bytes at a time, with the last ones padded with
+ * zeroes, then folds the result to 32 bits after a final avalanche. ASCII
+ * letters are lowered first if <lc> is set. The words are loaded in the host's
+ * byte order, so the result is stable for a given machine only.
+ */
+static inline unsigned int __hash_mem(const unsigned char *p, size_t len, int lc)
+{
+	unsigned long long h = HASH_MEM_P3 ^ (len * HASH_MEM_P1);
+	unsigned long long w;
+
+	while (len >= sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		if (lc)
+			w = hash_word_lc(w);
+		h = hash_word_mix(h, w);
+		p += sizeof(w);
+		len -= sizeof(w);
+	}
+
+	if (len) {
+		w = 0;
+		memcpy(&w, p, len);
+		if (lc)
+			w = hash_word_lc(w);
+		h = hash_word_mix(h, w);
+	}
+
+	h ^= h >> 33;
+	h *= HASH_MEM_P2;
+	h ^= h >> 29;
+	h *= HASH_MEM_P3;
+	h ^= h >> 32;
+	return (unsigned int)h;
+}
+
+/* hash <len> bytes at <data> to a 32-bit integer, one word at a time */
+unsigned int hash_mem(const void *data, size_t len)
+{
+	return __hash_mem(data, len, 0);
+}
+
+/* same as hash_mem() but ASCII letters are hashed as if they were lower case */
+unsigned int hash_mem_lc(const void *data, size_t len)
+{
+	return __hash_mem(data, len, 1);
+}
+
 /* Return non-zero if IPv4 address is part of the network,
  * otherwise zero.
  */
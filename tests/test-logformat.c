@@ -0,0 +1,645 @@
+/*
+ * Checks and microbenchmark of the log line construction. The log-formats
+ * below are parsed, compiled and run by the real parse_logformat_string(),
+ * compile_logformat() and build_logline() from src/logformat.c on a fake
+ * session, and each line is compared with the expected one. The cases cover
+ * the optional header captures, whose following separators are only decided
+ * at runtime, and lines which do not fit in the buffer. The default HTTP
+ * format is then timed, along with the former build_logline() which walked
+ * the list of nodes, kept below as a reference for the fields of this format.
+ * Both must produce the same line.
+ *
+ * It must be built with the same options as haproxy since it shares its
+ * structures, for example :
+ *   make TARGET=linux26 tests/test-logformat
+ *   tests/test-logformat [loops]
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include <common/standard.h>
+#include <common/time.h>
+
+#include <types/global.h>
+#include <types/log.h>
+#include <types/proxy.h>
+#include <types/server.h>
+#include <types/session.h>
+
+#include <proto/log.h>
+#include <proto/stream_interface.h>
+
+/* the globals used by the emitters, normally found in haproxy.c, fd.c and
+ * proto_http.c.
+ */
+struct global global;
+int pid = 4242;
+int actconn = 1;
+char hostname[MAX_HOSTNAME_LEN] = "lb1";
+fd_set hdr_encode_map[(sizeof(fd_set) > (256/8)) ? 1 : ((256/8) / sizeof(fd_set))];
+fd_set url_encode_map[(sizeof(fd_set) > (256/8)) ? 1 : ((256/8) / sizeof(fd_set))];
+
+extern const char sess_term_cond[], sess_fin_state[], sess_cookie[], sess_set_cookie[];
+
+void Warning(const char *fmt, ...)
+{
+	va_list argp;
+
+	va_start(argp, fmt);
+	vfprintf(stderr, fmt, argp);
+	va_end(argp);
+}
+
+/* same maps as http_init() */
+static void init_encode_maps()
+{
+	const char *tmp;
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		FD_SET(i, hdr_encode_map);
+		FD_SET(i, url_encode_map);
+	}
+	for (i = 127; i < 256; i++) {
+		FD_SET(i, hdr_encode_map);
+		FD_SET(i, url_encode_map);
+	}
+	for (tmp = "\"#{|}"; *tmp; tmp++)
+		FD_SET(*tmp, hdr_encode_map);
+	for (tmp = "\"#"; *tmp; tmp++)
+		FD_SET(*tmp, url_encode_map);
+}
+
+static struct proxy fe, be;
+static struct server srv;
+static struct session sess;
+static struct buffer req;
+static struct stream_interface si[2];
+static char *req_cap[2] = { "www.example.com", "a|b" };
+static char *rsp_cap[1] = { "text/html" };
+
+/* An HTTP request accepted on 17/Oct/2026:12:34:56.789 UTC and served by
+ * static/srv1.
+ */
+static void init_session()
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)&si[0].addr.from;
+
+	fe.id = "http-in";
+	fe.mode = PR_MODE_HTTP;
+	fe.feconn = 1;
+	fe.nb_req_cap = 2;
+	fe.nb_rsp_cap = 1;
+	be.id = "static";
+	be.mode = PR_MODE_HTTP;
+	be.beconn = 1;
+	be.conn_retries = 3;
+	srv.id = "srv1";
+	srv.cur_sess = 1;
+
+	sess.fe = &fe;
+	sess.be = &be;
+	sess.req = &req;
+	sess.target.type = TARG_TYPE_SERVER;
+	sess.target.ptr.s = &srv;
+	req.prod = &si[0];
+	req.cons = &si[1];
+	si[1].conn_retries = 3;
+
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(53412);
+	inet_pton(AF_INET, "192.168.10.214", &sin->sin_addr);
+
+	sess.logs.accept_date.tv_sec = 1792240496;
+	sess.logs.accept_date.tv_usec = 789000;
+	sess.logs.tv_accept.tv_sec = 1000;
+	sess.logs.tv_request.tv_sec = 1000;
+	sess.logs.tv_request.tv_usec = 10000;
+	sess.logs.t_queue = 10;
+	sess.logs.t_connect = 11;
+	sess.logs.t_data = 37;
+	sess.logs.t_close = 47;
+	sess.logs.bytes_out = 2750;
+
+	sess.txn.status = 200;
+	sess.txn.uri = "GET /images/logo.png HTTP/1.1";
+	sess.txn.req.cap = req_cap;
+	sess.txn.rsp.cap = rsp_cap;
+	global.req_count = 0x1234;
+}
+
+/*
+ * try to write a character if there is enough space, or goto out
+ */
+#define LOGCHAR(x) do { \
+			if (tmplog < dst + maxsize - 1) { \
+				*(tmplog++) = (x);                     \
+			} else {                                       \
+				goto out;                              \
+			}                                              \
+		} while(0)
+
+/* The former build_logline(), which walked the list of nodes and switched on
+ * their type for each line. Only the fields of the default HTTP format are
+ * kept, the other ones are ignored.
+ */
+static int ref_build_logline(struct session *s, char *dst, size_t maxsize, struct list *list_format)
+{
+	struct proxy *fe = s->fe;
+	struct proxy *be = s->be;
+	struct http_txn *txn = &s->txn;
+	int tolog;
+	char *uri;
+	const char *svid;
+	struct tm tm;
+	int t_request;
+	int hdr;
+	int last_isspace = 1;
+	char *tmplog;
+	char *ret;
+	int iret;
+	struct logformat_node *tmp;
+
+	tolog = fe->to_log;
+
+	if (!(tolog & LW_SVID))
+		svid = "-";
+	else switch (s->target.type) {
+	case TARG_TYPE_SERVER:
+		svid = s->target.ptr.s->id;
+		break;
+	case TARG_TYPE_APPLET:
+		svid = s->target.ptr.a->name;
+		break;
+	default:
+		svid = "<NOSRV>";
+		break;
+	}
+
+	t_request = -1;
+	if (tv_isge(&s->logs.tv_request, &s->logs.tv_accept))
+		t_request = tv_ms_elapsed(&s->logs.tv_accept, &s->logs.tv_request);
+
+	tmplog = dst;
+
+	/* fill logbuffer */
+	if (LIST_ISEMPTY(list_format))
+		return 0;
+
+	list_for_each_entry(tmp, list_format, list) {
+		char *src = NULL;
+		switch (tmp->type) {
+
+			case LOG_FMT_SEPARATOR:
+				if (!last_isspace) {
+					LOGCHAR(' ');
+					last_isspace = 1;
+				}
+				break;
+
+			case LOG_FMT_TEXT: // text
+				src = tmp->arg;
+				iret = strlcpy2(tmplog, src, dst + maxsize - tmplog);
+				if (iret == 0)
+					goto out;
+				tmplog += iret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_CLIENTIP:  // %Ci
+				ret = lf_ip(tmplog, (struct sockaddr *)&s->req->prod->addr.from,
+					    dst + maxsize - tmplog, tmp->options);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_CLIENTPORT:  // %Cp
+				if (s->req->prod->addr.from.ss_family == AF_UNIX) {
+					ret = ltoa_o(s->listener->luid, tmplog, dst + maxsize - tmplog);
+				} else {
+					ret = lf_port(tmplog, (struct sockaddr *)&s->req->prod->addr.from,
+						      dst + maxsize - tmplog, tmp->options);
+				}
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_DATE: // %t
+				get_localtime(s->logs.accept_date.tv_sec, &tm);
+				ret = date2str_log(tmplog, &tm, &(s->logs.accept_date),
+						   dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_FRONTEND: // %f
+				src = fe->id;
+				ret = lf_text(tmplog, src, dst + maxsize - tmplog, tmp->options);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_BACKEND: // %b
+				src = be->id;
+				ret = lf_text(tmplog, src, dst + maxsize - tmplog, tmp->options);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_SERVER: // %s
+				src = (char *)svid;
+				ret = lf_text(tmplog, src, dst + maxsize - tmplog, tmp->options);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_TQ: // %Tq
+				ret = ltoa_o(t_request, tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_TW: // %Tw
+				ret = ltoa_o((s->logs.t_queue >= 0) ? s->logs.t_queue - t_request : -1,
+						tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_TC: // %Tc
+				ret = ltoa_o((s->logs.t_connect >= 0) ? s->logs.t_connect - s->logs.t_queue : -1,
+						tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_TR: // %Tr
+				ret = ltoa_o((s->logs.t_data >= 0) ? s->logs.t_data - s->logs.t_connect : -1,
+						tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_TT:  // %Tt
+				if (!(tolog & LW_BYTES))
+					LOGCHAR('+');
+				ret = ltoa_o(s->logs.t_close, tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_STATUS: // %st
+				ret = ltoa_o(txn->status, tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_BYTES: // %B
+				if (!(tolog & LW_BYTES))
+					LOGCHAR('+');
+				ret = lltoa(s->logs.bytes_out, tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_CCLIENT: // %cc
+				src = txn->cli_cookie;
+				ret = lf_text(tmplog, src, dst + maxsize - tmplog, tmp->options);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_CSERVER: // %cs
+				src = txn->srv_cookie;
+				ret = lf_text(tmplog, src, dst + maxsize - tmplog, tmp->options);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_TERMSTATE_CK: // %tsc, same as TS with cookie state (for mode HTTP)
+				LOGCHAR(sess_term_cond[(s->flags & SN_ERR_MASK) >> SN_ERR_SHIFT]);
+				LOGCHAR(sess_fin_state[(s->flags & SN_FINST_MASK) >> SN_FINST_SHIFT]);
+				LOGCHAR((be->ck_opts & PR_CK_ANY) ? sess_cookie[(txn->flags & TX_CK_MASK) >> TX_CK_SHIFT] : '-');
+				LOGCHAR((be->ck_opts & PR_CK_ANY) ? sess_set_cookie[(txn->flags & TX_SCK_MASK) >> TX_SCK_SHIFT] : '-');
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_ACTCONN: // %ac
+				ret = ltoa_o(actconn, tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_FECONN:  // %fc
+				ret = ltoa_o(fe->feconn, tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_BECONN:  // %bc
+				ret = ltoa_o(be->beconn, tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_SRVCONN:  // %sc
+				ret = ultoa_o(target_srv(&s->target) ?
+				                 target_srv(&s->target)->cur_sess :
+				                 0, tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_RETRIES:  // %rq
+				if (s->flags & SN_REDISP)
+					LOGCHAR('+');
+				ret = ltoa_o((s->req->cons->conn_retries>0) ?
+				                (be->conn_retries - s->req->cons->conn_retries) :
+				                be->conn_retries, tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_SRVQUEUE: // %sq
+				ret = ltoa_o(s->logs.srv_queue_size, tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_BCKQUEUE:  // %bq
+				ret = ltoa_o(s->logs.prx_queue_size, tmplog, dst + maxsize - tmplog);
+				if (ret == NULL)
+					goto out;
+				tmplog = ret;
+				last_isspace = 0;
+				break;
+
+			case LOG_FMT_HDRREQUEST: // %hr
+				/* request header */
+				if (fe->to_log & LW_REQHDR && txn->req.cap) {
+					if (tmp->options & LOG_OPT_QUOTE)
+						LOGCHAR('"');
+					LOGCHAR('{');
+					for (hdr = 0; hdr < fe->nb_req_cap; hdr++) {
+						if (hdr)
+							LOGCHAR('|');
+						if (txn->req.cap[hdr] != NULL) {
+							ret = encode_string(tmplog, dst + maxsize,
+									       '#', hdr_encode_map, txn->req.cap[hdr]);
+							if (ret == NULL || *ret != '\0')
+								goto out;
+							tmplog = ret;
+						}
+					}
+					LOGCHAR('}');
+					if (tmp->options & LOG_OPT_QUOTE)
+						LOGCHAR('"');
+					last_isspace = 0;
+				}
+				break;
+
+			case LOG_FMT_HDRRESPONS: // %hs
+				/* response header */
+				if (fe->to_log & LW_RSPHDR &&
+				    txn->rsp.cap) {
+					if (tmp->options & LOG_OPT_QUOTE)
+						LOGCHAR('"');
+					LOGCHAR('{');
+					for (hdr = 0; hdr < fe->nb_rsp_cap; hdr++) {
+						if (hdr)
+							LOGCHAR('|');
+						if (txn->rsp.cap[hdr] != NULL) {
+							ret = encode_string(tmplog, dst + maxsize,
+							                    '#', hdr_encode_map, txn->rsp.cap[hdr]);
+							if (ret == NULL || *ret != '\0')
+								goto out;
+							tmplog = ret;
+						}
+					}
+					LOGCHAR('}');
+					last_isspace = 0;
+					if (tmp->options & LOG_OPT_QUOTE)
+						LOGCHAR('"');
+				}
+				break;
+
+			case LOG_FMT_REQ: // %r
+				/* Request */
+				if (tmp->options & LOG_OPT_QUOTE)
+					LOGCHAR('"');
+				uri = txn->uri ? txn->uri : "<BADREQ>";
+				ret = encode_string(tmplog, dst + maxsize,
+						       '#', url_encode_map, uri);
+				if (ret == NULL || *ret != '\0')
+					goto out;
+				tmplog = ret;
+				if (tmp->options & LOG_OPT_QUOTE)
+					LOGCHAR('"');
+				last_isspace = 0;
+				break;
+		}
+	}
+
+out:
+	/* *tmplog is a unused character */
+	*tmplog = '\0';
+
+	return tmplog - dst + 1;
+}
+
+/* Parses and compiles <format> for the frontend, then builds the line of the
+ * session in a buffer of <maxsize> bytes and compares it with <expected>.
+ * Returns 0 if they match, otherwise 1.
+ */
+static int check(const char *format, size_t maxsize, const char *expected)
+{
+	struct list list = LIST_HEAD_INIT(list);
+	struct logformat_prog *prog;
+	char *str = strdup(format);
+	char line[1024];
+	int len;
+
+	parse_logformat_string(str, &fe, &list, PR_MODE_HTTP);
+	prog = compile_logformat(&list);
+	if (!prog) {
+		printf("FAIL: %s\n  cannot compile\n", format);
+		return 1;
+	}
+
+	memset(line, 'x', sizeof(line));
+	len = build_logline(&sess, line, maxsize, prog);
+	free_logformat_prog(prog);
+	free(str);
+
+	if (len != strlen(expected) + 1 || strcmp(line, expected) != 0) {
+		printf("FAIL: %s (%d bytes)\n  got:      [%s] (%d)\n  expected: [%s]\n",
+		       format, (int)maxsize, line, len - 1, expected);
+		return 1;
+	}
+	printf("OK:   %s (%d bytes)\n", format, (int)maxsize);
+	return 0;
+}
+
+static double now_us()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+int main(int argc, char **argv)
+{
+	struct list list = LIST_HEAD_INIT(list);
+	struct logformat_prog *prog;
+	char line[1024], ref_line[1024];
+	int loops = 1000000;
+	int fail = 0;
+	int i, len = 0, ref_len = 0;
+	double t0, t1, t2;
+
+	if (argc > 1)
+		loops = atoi(argv[1]);
+
+	setenv("TZ", "UTC", 1);
+	tzset();
+	init_encode_maps();
+	init_session();
+
+	/* all the captures present */
+	fail += check(default_http_log_format, 1024,
+		      "192.168.10.214:53412 [17/Oct/2026:12:34:56.789] http-in static/srv1 "
+		      "10/0/1/26/47 200 2750 - - ---- 1/1/1/1/0 0/0 "
+		      "{www.example.com|a#7Cb} {text/html} \"GET /images/logo.png HTTP/1.1\"");
+	fail += check("%hrl %hsl %st", 1024, "www.example.com a#7Cb text/html 200");
+	fail += check("%{+Q}hrl %{+Q}hsl", 1024, "\"www.example.com\" \"a#7Cb\" \"text/html\"");
+	fail += check("%{+X}Ci:%{+X}Cp %{+X}Ts %{+X}rt %{+X}pid %H", 1024,
+		      "C0A80AD6:D0A4 6AD36B70 1234 1092 lb1");
+
+	/* the line is truncated before the first element which does not fit */
+	fail += check(default_http_log_format, 40, "192.168.10.214:53412 [");
+	fail += check(default_http_log_format, 120,
+		      "192.168.10.214:53412 [17/Oct/2026:12:34:56.789] http-in static/srv1 "
+		      "10/0/1/26/47 200 2750 - - ---- 1/1/1/1/0 0/0 ");
+	fail += check(default_http_log_format, 180,
+		      "192.168.10.214:53412 [17/Oct/2026:12:34:56.789] http-in static/srv1 "
+		      "10/0/1/26/47 200 2750 - - ---- 1/1/1/1/0 0/0 "
+		      "{www.example.com|a#7Cb} {text/html} ");
+	fail += check("%st %{+Q}hrl", 25, "200 ");
+
+	/* no response capture : its separator is not repeated */
+	sess.txn.rsp.cap = NULL;
+	fail += check(default_http_log_format, 1024,
+		      "192.168.10.214:53412 [17/Oct/2026:12:34:56.789] http-in static/srv1 "
+		      "10/0/1/26/47 200 2750 - - ---- 1/1/1/1/0 0/0 "
+		      "{www.example.com|a#7Cb} \"GET /images/logo.png HTTP/1.1\"");
+
+	/* no capture at all */
+	sess.txn.req.cap = NULL;
+	fail += check(default_http_log_format, 1024,
+		      "192.168.10.214:53412 [17/Oct/2026:12:34:56.789] http-in static/srv1 "
+		      "10/0/1/26/47 200 2750 - - ---- 1/1/1/1/0 0/0 "
+		      "\"GET /images/logo.png HTTP/1.1\"");
+	fail += check("%hr %hs %st", 1024, "200");
+	fail += check("%st %hr %hs", 1024, "200 ");
+	fail += check("[%hr %hs]", 1024, "[ ]");
+
+	if (fail) {
+		printf("%d failed checks\n", fail);
+		return 1;
+	}
+
+	/* timing of the default format with the captures, compiled then walked
+	 * as a list of nodes on the same session.
+	 */
+	sess.txn.req.cap = req_cap;
+	sess.txn.rsp.cap = rsp_cap;
+	parse_logformat_string(strdup(default_http_log_format), &fe, &list, PR_MODE_HTTP);
+	prog = compile_logformat(&list);
+	if (!prog)
+		return 1;
+
+	build_logline(&sess, line, sizeof(line), prog);
+	ref_build_logline(&sess, ref_line, sizeof(ref_line), &list);
+	if (strcmp(line, ref_line) != 0) {
+		printf("FAIL: the reference line differs\n  got:       [%s]\n  reference: [%s]\n",
+		       line, ref_line);
+		return 1;
+	}
+
+	/* both are warmed up first so that the first one is not penalized */
+	for (i = 0; i < loops / 10; i++) {
+		build_logline(&sess, line, sizeof(line), prog);
+		ref_build_logline(&sess, ref_line, sizeof(ref_line), &list);
+	}
+
+	t0 = now_us();
+	for (i = 0; i < loops; i++) {
+		sess.logs.accept_date.tv_usec = i % 1000000;
+		len += build_logline(&sess, line, sizeof(line), prog);
+	}
+	t1 = now_us();
+	for (i = 0; i < loops; i++) {
+		sess.logs.accept_date.tv_usec = i % 1000000;
+		ref_len += ref_build_logline(&sess, ref_line, sizeof(ref_line), &list);
+	}
+	t2 = now_us();
+
+	if (len != ref_len) {
+		printf("FAIL: %d bytes built, %d by the reference\n", len, ref_len);
+		return 1;
+	}
+
+	printf("%d instructions, %d lines (%d bytes)\n", prog->nb_insn, loops, len);
+	printf("build_logline: %.1f ns/line\n", loops ? (t1 - t0) * 1000.0 / loops : 0.0);
+	printf("reference:     %.1f ns/line\n", loops ? (t2 - t1) * 1000.0 / loops : 0.0);
+	free_logformat_prog(prog);
+	return 0;
+}